@@ -3,7 +3,7 @@
 #include "follow.h"
 #include "communication.h"
 
-extern USERDATA * mydata;
+EXTERN_USERDATA(USERDATA)
 
 
 // message rx callback function. Pushes message to ring buffer.
@@ -28,6 +28,12 @@
 
 REGISTER_USERDATA(USERDATA)
 
+// for decoding the USERDATA stored in binary state files
+USERDATA_LAYOUT(USERDATA,
+		USERDATA_FIELD(gradient_value, KTR_FIELD_UINT16),
+		USERDATA_FIELD(recvd_gradient, KTR_FIELD_UINT16),
+		USERDATA_FIELD(new_message, KTR_FIELD_UINT8))
+
 // rainbow colors
 uint8_t colors[] = {
   RGB(0,0,0),  //0 - off
@@ -35,7 +35,7 @@ typedef struct
 
 } USERDATA;
 
-extern USERDATA *mydata;
+EXTERN_USERDATA(USERDATA)
 
 // Ring buffer operations. Taken from kilolib's ringbuffer.h
 // but adapted for use with mydata->
@@ -0,0 +1,344 @@
+/* Binary checkpoints of the current simulation.
+ *
+ * A checkpoint holds everything needed to continue the simulation exactly:
+ * the clock, the communication counters, every field of every bot, the bots'
+ * USERDATA and their position history. The file is
+ *
+ *   header
+ *   the size of each bot field, one uint32 per entry of bot_fields
+ *   each bot field for all bots, one array per field
+ *   the USERDATA of all bots, UserdataSize bytes each
+ *   the position history of each bot, n_hist x values then n_hist y values
+ *
+ * with each part starting at a multiple of 8 bytes. The data is in the
+ * byte order and layout of the machine, so a checkpoint is only read by the
+ * program that wrote it, built the same way; the field sizes are checked on
+ * loading. It is read through mmap(), so loading copies the data once.
+ *
+ * Function pointers - the bot's loop, setup and message callbacks - are stored
+ * relative to kilo_start(), which is linked into the same program.
+ * USERDATA is copied as is, so it must not contain pointers. Global
+ * variables of the bot program are not saved, set them in the global setup
+ * callback, which is run again on loading.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "skilobot.h"
+#include "params.h"
+#include "sim.h"
+#include "checkpoint.h"
+
+extern int UserdataSize;
+
+#define CHECKPOINT_MAGIC   "KILOCKPT"
+#define CHECKPOINT_VERSION 3
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t n_fields;
+  int32_t n_bots;
+  int32_t userdata_size;
+  int32_t history;     // 1 if the position history is stored
+  int32_t n_step;
+  double time;
+  uint32_t ticks;
+  int32_t tx_period;
+  uint32_t seed;
+  uint32_t reserved;
+  comm_stats stats;    // the per-type and per-tag counters of all workers
+} checkpoint_header;
+
+#define FIELD(f) {offsetof(kilobot, f), sizeof(((kilobot *) 0)->f)}
+
+// the bot fields stored, everything but pointers and what each step recomputes
+static const struct {
+  size_t offset, size;
+} bot_fields[] = {
+  FIELD(x), FIELD(y), FIELD(p_hist), FIELD(n_hist), FIELD(l_hist),
+  FIELD(right_motor_power), FIELD(left_motor_power),
+  FIELD(left_motor_offset), FIELD(right_motor_offset),
+  FIELD(left_motor_slope), FIELD(right_motor_slope),
+  FIELD(speed), FIELD(turn_rate_l), FIELD(turn_rate_r),
+  FIELD(ID), FIELD(direction), FIELD(r_led), FIELD(g_led), FIELD(b_led),
+  FIELD(radius), FIELD(leg_angle), FIELD(cr),
+  FIELD(tx_enabled), FIELD(tx_ticks), FIELD(tx_slot), FIELD(outbox),
+  FIELD(comm), FIELD(seed), FIELD(accumulator), FIELD(hard_draws), FIELD(n_events),
+  FIELD(ctx.uid),
+};
+#define N_FIELDS (sizeof(bot_fields) / sizeof(bot_fields[0]))
+
+// the function pointers, stored as offsets from kilo_start()
+#define N_FUNCTIONS 5
+#define FUNCTIONS_SIZE (sizeof(int64_t) * N_FUNCTIONS)
+
+static void **bot_function(kilobot *bot, int k)
+{
+  switch (k)
+    {
+    case 0:  return (void **) &bot->user_setup;
+    case 1:  return (void **) &bot->user_loop;
+    case 2:  return (void **) &bot->ctx.message_rx;
+    case 3:  return (void **) &bot->ctx.message_tx;
+    default: return (void **) &bot->ctx.message_tx_success;
+    }
+}
+
+static size_t align8(size_t n)
+{
+  return (n + 7) & ~(size_t) 7;
+}
+
+static int write_padded(FILE *f, const void *p, size_t n)
+{
+  static const char zeros[8];
+  return fwrite(p, 1, n, f) != n || fwrite(zeros, 1, align8(n) - n, f) != align8(n) - n;
+}
+
+/* The simulator's own random numbers come from the counter-based generator
+ * and need no saving, but bot programs may use rand(), which is shared by the
+ * process and whose state cannot be saved. It is restarted from the seed and
+ * step, both when saving and when loading.
+ */
+static void reseed_rand(void)
+{
+  srand(rng_seed ^ (uint32_t) sim->n_step * 2654435761u);
+}
+
+/* Save the current simulation to filename. The file is written under a
+ * temporary name and then renamed, so an existing checkpoint is only replaced
+ * by a complete one. Returns 0 on success.
+ */
+int checkpoint_save(const char *filename)
+{
+  int n = sim->n_bots, i, err = 0;
+  size_t k;
+  uint32_t sizes[N_FIELDS];
+  checkpoint_header h;
+  char *tmp = (char *) malloc(strlen(filename) + 5);
+  char *buf;
+  FILE *f;
+
+  sprintf(tmp, "%s.tmp", filename);
+  f = fopen(tmp, "wb");
+  if (!f)
+    {
+      fprintf(stderr, "Could not open checkpoint file %s\n", tmp);
+      free(tmp);
+      return 1;
+    }
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, CHECKPOINT_MAGIC, 8);
+  h.version = CHECKPOINT_VERSION;
+  h.n_fields = N_FIELDS;
+  h.n_bots = n;
+  h.userdata_size = UserdataSize;
+  h.history = simparams->storeHistory != 0;
+  h.n_step = sim->n_step;
+  h.time = sim->time;
+  h.ticks = kilo_ticks;
+  h.tx_period = tx_period_ticks;
+  h.seed = rng_seed;
+  comm_stats_merge(&h.stats);
+  err |= write_padded(f, &h, sizeof(h));
+
+  for (k = 0; k < N_FIELDS; k++)
+    sizes[k] = bot_fields[k].size;
+  err |= write_padded(f, sizes, sizeof(sizes));
+
+  size_t widest = FUNCTIONS_SIZE > (size_t) UserdataSize ? FUNCTIONS_SIZE : UserdataSize;
+  for (k = 0; k < N_FIELDS; k++)
+    if (bot_fields[k].size > widest)
+      widest = bot_fields[k].size;
+  buf = (char *) malloc((size_t) n * widest);
+  for (k = 0; k < N_FIELDS; k++)
+    {
+      size_t size = bot_fields[k].size;
+      for (i = 0; i < n; i++)
+	memcpy(buf + i * size, (char *) allbots[i] + bot_fields[k].offset, size);
+      err |= write_padded(f, buf, n * size);
+    }
+
+  for (i = 0; i < n; i++)
+    for (int j = 0; j < N_FUNCTIONS; j++)
+      {
+	int64_t d = (int64_t) ((intptr_t) *bot_function(allbots[i], j) - (intptr_t) kilo_start);
+	memcpy(buf + (i * N_FUNCTIONS + j) * sizeof(int64_t), &d, sizeof(d));
+      }
+  err |= write_padded(f, buf, n * FUNCTIONS_SIZE);
+
+  for (i = 0; i < n; i++)
+    memcpy(buf + (size_t) i * UserdataSize, allbots[i]->data, UserdataSize);
+  err |= write_padded(f, buf, (size_t) n * UserdataSize);
+  free(buf);
+
+  if (h.history)
+    for (i = 0; i < n; i++)
+      {
+	err |= write_padded(f, allbots[i]->x_history, sizeof(double) * allbots[i]->n_hist);
+	err |= write_padded(f, allbots[i]->y_history, sizeof(double) * allbots[i]->n_hist);
+      }
+
+  err |= fclose(f) != 0;
+  if (!err)
+    err = rename(tmp, filename) != 0;
+  if (err)
+    fprintf(stderr, "Error writing checkpoint file %s\n", filename);
+  free(tmp);
+
+  int waiting = 0;
+  for (i = 0; i < n; i++)
+    waiting += allbots[i]->runner != NULL;
+  if (waiting)
+    fprintf(stderr, "Warning: %d bots are in delay(), their loop() starts over "
+	    "when the checkpoint is loaded.\n", waiting);
+
+  reseed_rand();
+  return err;
+}
+
+// 1 if filename starts like a checkpoint
+int is_checkpoint(const char *filename)
+{
+  char magic[8];
+  FILE *f = fopen(filename, "rb");
+  int r;
+
+  if (!f)
+    return 0;
+  r = fread(magic, 1, 8, f) == 8 && memcmp(magic, CHECKPOINT_MAGIC, 8) == 0;
+  fclose(f);
+  return r;
+}
+
+/* Create the bots of the current simulation from a checkpoint. The bot
+ * program's main() is run for each bot, and then the bots' state is
+ * overwritten with that of the checkpoint. Returns 0 on success.
+ */
+int checkpoint_load(const char *filename)
+{
+  struct stat st;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st))
+    {
+      fprintf(stderr, "Could not open checkpoint file %s\n", filename);
+      if (fd >= 0)
+	close(fd);
+      return 1;
+    }
+
+  size_t file_size = st.st_size;
+  char *base = file_size >= sizeof(checkpoint_header) ?
+    (char *) mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0) : (char *) MAP_FAILED;
+  close(fd);
+  if (base == (char *) MAP_FAILED)
+    {
+      fprintf(stderr, "Could not read checkpoint file %s\n", filename);
+      return 1;
+    }
+
+  const checkpoint_header *h = (const checkpoint_header *) base;
+  const uint32_t *sizes = (const uint32_t *) (base + align8(sizeof(*h)));
+  int n = h->n_bots, i;
+  size_t k, pos = align8(sizeof(*h)) + align8(sizeof(uint32_t) * N_FIELDS);
+  const char *error = NULL;
+
+  if (memcmp(h->magic, CHECKPOINT_MAGIC, 8) || h->version != CHECKPOINT_VERSION)
+    error = "not a checkpoint of this version";
+  else if (h->n_fields != N_FIELDS || pos > file_size)
+    error = "written by a different version of the simulator";
+  else if (h->userdata_size != UserdataSize)
+    error = "USERDATA size differs";
+  else if (n <= 0)
+    error = "no bots";
+  else
+    {
+      for (k = 0; k < N_FIELDS; k++)
+	if (sizes[k] != bot_fields[k].size)
+	  error = "written by a different version of the simulator";
+      for (k = 0; k < N_FIELDS; k++)
+	pos += align8(bot_fields[k].size * n);
+      pos += align8(FUNCTIONS_SIZE * n) + align8((size_t) UserdataSize * n);
+      if (pos > file_size)
+	error = "file is truncated";
+    }
+  if (error)
+    {
+      fprintf(stderr, "Can not load checkpoint %s: %s.\n", filename, error);
+      munmap(base, file_size);
+      return 1;
+    }
+
+  create_bots(n);
+  init_all_bots(n);
+
+  pos = align8(sizeof(*h)) + align8(sizeof(uint32_t) * N_FIELDS);
+  for (k = 0; k < N_FIELDS; k++)
+    {
+      size_t size = bot_fields[k].size;
+      for (i = 0; i < n; i++)
+	memcpy((char *) allbots[i] + bot_fields[k].offset, base + pos + i * size, size);
+      pos += align8(size * n);
+    }
+
+  for (i = 0; i < n; i++)
+    for (int j = 0; j < N_FUNCTIONS; j++)
+      {
+	int64_t d;
+	memcpy(&d, base + pos + (i * N_FUNCTIONS + j) * sizeof(int64_t), sizeof(d));
+	*bot_function(allbots[i], j) = (void *) ((intptr_t) kilo_start + (intptr_t) d);
+      }
+  pos += align8(FUNCTIONS_SIZE * n);
+
+  for (i = 0; i < n; i++)
+    memcpy(allbots[i]->data, base + pos + (size_t) i * UserdataSize, UserdataSize);
+  pos += align8((size_t) UserdataSize * n);
+
+  for (i = 0; i < n; i++)
+    {
+      kilobot *bot = allbots[i];
+      bot->index = i;
+      if (!h->history || pos + 2 * align8(sizeof(double) * bot->n_hist) > file_size)
+	{
+	  // no history in the file: start a new one
+	  bot->p_hist = bot->l_hist = 0;
+	  if (simparams->storeHistory)
+	    {
+	      bot->n_hist = simparams->histLength;
+	      bot->x_history = (double *) realloc(bot->x_history, sizeof(double) * bot->n_hist);
+	      bot->y_history = (double *) realloc(bot->y_history, sizeof(double) * bot->n_hist);
+	    }
+	  continue;
+	}
+      size_t size = sizeof(double) * bot->n_hist;
+      bot->x_history = (double *) realloc(bot->x_history, size);
+      bot->y_history = (double *) realloc(bot->y_history, size);
+      memcpy(bot->x_history, base + pos, size);
+      memcpy(bot->y_history, base + pos + align8(size), size);
+      pos += 2 * align8(size);
+    }
+
+  sim->time = h->time;
+  sim->n_step = h->n_step;
+  kilo_ticks = h->ticks;
+  tx_period_ticks = h->tx_period;
+  rng_seed = h->seed;
+  memset(comm_stats_worker, 0, sizeof(comm_stats_worker));
+  comm_stats_worker[0] = h->stats;
+
+  munmap(base, file_size);
+  reseed_rand();
+  return 0;
+}
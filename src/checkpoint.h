@@ -0,0 +1,12 @@
+/* Binary checkpoints of the whole simulation state, for resuming a run or
+ * starting several runs from one warmed-up state. See checkpoint.c.
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+int checkpoint_save(const char *filename);
+int checkpoint_load(const char *filename);
+int is_checkpoint(const char *filename);
+
+#endif
@@ -0,0 +1,117 @@
+/* Reporting of the communication counters.
+ *
+ * The counting itself is done inline in pass_message(), and the tables are
+ * part of the simulation state, see sim.h.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <jansson.h>
+
+#include "skilobot.h"
+#include "commstats.h"
+#include "sim.h"
+
+void comm_stats_reset(void)
+{
+  memset(comm_stats_worker, 0, sizeof(comm_stats_worker));
+  for (int i = 0; i < sim->n_bots; i++)
+    memset(&allbots[i]->comm, 0, sizeof(comm_count));
+}
+
+static void add_count(comm_count *to, const comm_count *from)
+{
+  to->sent      += from->sent;
+  to->delivered += from->delivered;
+  to->dropped   += from->dropped;
+  to->bytes     += from->bytes;
+}
+
+void comm_stats_add(comm_stats *to, const comm_stats *from)
+{
+  for (int i = 0; i < 256; i++)
+    {
+      add_count(&to->type[i], &from->type[i]);
+      add_count(&to->tag[i], &from->tag[i]);
+    }
+}
+
+void comm_stats_merge(comm_stats *total)
+{
+  memset(total, 0, sizeof(comm_stats));
+  for (int w = 0; w < COMM_STATS_MAX_WORKERS; w++)
+    comm_stats_add(total, &comm_stats_worker[w]);
+}
+
+json_t *json_comm_count(const comm_count *c)
+{
+  json_t *j = json_object();
+  json_object_set_new(j, "sent",      json_integer(c->sent));
+  json_object_set_new(j, "delivered", json_integer(c->delivered));
+  json_object_set_new(j, "dropped",   json_integer(c->dropped));
+  json_object_set_new(j, "bytes",     json_integer(c->bytes));
+  return j;
+}
+
+/* The per-type and per-tag counters, as stored with each state snapshot,
+ * from the merged counters in total.
+ * Only the types and tags that have been used are included.
+ */
+json_t *json_comm_stats(const comm_stats *total)
+{
+  char key[8];
+  json_t *j = json_object();
+  json_t *j_type = json_object();
+  json_t *j_tag = json_object();
+
+  for (int i = 0; i < 256; i++)
+    {
+      snprintf(key, sizeof(key), "%d", i);
+      if (total->type[i].sent)
+	json_object_set_new(j_type, key, json_comm_count(&total->type[i]));
+      if (comm_stats_tag_byte >= 0 && total->tag[i].sent)
+	json_object_set_new(j_tag, key, json_comm_count(&total->tag[i]));
+    }
+  json_object_set_new(j, "types", j_type);
+  if (comm_stats_tag_byte >= 0)
+    json_object_set_new(j, "tags", j_tag);
+  return j;
+}
+
+static void print_count(FILE *f, const char *label, int key, const comm_count *c)
+{
+  double rx = c->delivered + c->dropped;
+  fprintf(f, "  %-6s %3d %12llu %12llu %12llu %14llu %7.1f%%\n", label, key,
+	  (unsigned long long) c->sent, (unsigned long long) c->delivered,
+	  (unsigned long long) c->dropped, (unsigned long long) c->bytes,
+	  rx > 0 ? 100.0 * c->delivered / rx : 0.0);
+}
+
+/* Print a summary of the communication: totals, and the counts for every
+ * message type and tag that was used.
+ */
+void comm_stats_report(FILE *f)
+{
+  comm_stats total;
+  comm_count all;
+  int i;
+
+  comm_stats_merge(&total);
+  memset(&all, 0, sizeof(all));
+  for (i = 0; i < 256; i++)
+    add_count(&all, &total.type[i]);
+
+  fprintf(f, "Communication summary (%d bots)\n", sim->n_bots);
+  fprintf(f, "  %-10s %12s %12s %12s %14s %8s\n", "", "sent", "delivered", "dropped", "bytes", "success");
+  print_count(f, "total", 0, &all);
+  for (i = 0; i < 256; i++)
+    if (total.type[i].sent)
+      print_count(f, "type", i, &total.type[i]);
+  if (comm_stats_tag_byte >= 0)
+    for (i = 0; i < 256; i++)
+      if (total.tag[i].sent)
+	print_count(f, "tag", i, &total.tag[i]);
+  if (sim->n_bots > 0)
+    fprintf(f, "  per bot: %.1f messages sent, %.1f delivered\n",
+	    (double) all.sent / sim->n_bots, (double) all.delivered / sim->n_bots);
+}
@@ -0,0 +1,41 @@
+/* Communication counters: messages sent, delivered and dropped, and bytes,
+ * per bot, per message type and per payload tag.
+ */
+
+#ifndef COMMSTATS_H
+#define COMMSTATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <jansson.h>
+
+#include "threadpool.h"
+
+typedef struct {
+  uint64_t sent;       // messages transmitted
+  uint64_t delivered;  // receptions passed to kilo_message_rx
+  uint64_t dropped;    // receptions lost in the channel or failing the CRC
+  uint64_t bytes;      // bytes transmitted
+} comm_count;
+
+/* Counters per message type and per payload tag.
+ * Each worker thread counts into its own table, they are summed by
+ * comm_stats_merge() when a report is made. The per-bot counters live in the
+ * kilobot struct, since a bot's counters are only updated by the thread
+ * handling that bot.
+ */
+typedef struct {
+  comm_count type[256];
+  comm_count tag[256];
+} comm_stats;
+
+#define COMM_STATS_MAX_WORKERS POOL_MAX_THREADS
+
+void comm_stats_reset(void);
+void comm_stats_add(comm_stats *to, const comm_stats *from);
+void comm_stats_merge(comm_stats *total);
+json_t *json_comm_count(const comm_count *c);
+json_t *json_comm_stats(const comm_stats *total);
+void comm_stats_report(FILE *f);
+
+#endif
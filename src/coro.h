@@ -0,0 +1,30 @@
+/* Stackful coroutines.
+ *
+ * The simulator runs the bots' loop() on coroutines, so that delay() can
+ * suspend a bot in the middle of its program and the simulation can go on
+ * with the other bots. Switching saves and restores only the callee-saved
+ * registers, in a few instructions of assembly on x86-64 and AArch64, and
+ * with swapcontext() elsewhere.
+ */
+
+#ifndef CORO_H
+#define CORO_H
+
+#include <stddef.h>
+
+typedef struct coro coro;
+
+// fn(arg) runs on the coroutine's own stack, and must never return
+coro *coro_create(size_t stack_size, void (*fn)(void *), void *arg);
+void coro_free(coro *c);
+
+// run c until it yields
+void coro_resume(coro *c);
+
+// from within a coroutine: return to the thread that resumed it
+void coro_yield(void);
+
+// the coroutine running on the calling thread, NULL if none
+coro *coro_current(void);
+
+#endif
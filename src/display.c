@@ -13,6 +13,8 @@
 #include "SDL/SDL_thread.h"
 #include "SDL/SDL_timer.h"
 #include "skilobot.h"
+#include "sim.h"
+#include "gui.h"
 
 
 //for mkdir
@@ -23,11 +25,6 @@
 
 
 
-extern void (*callback_F5) (void) ; // function pointer to user-defined callback function for F5 press
-extern void (*callback_F6) (void) ; // function pointer to user-defined callback function for F6 press
-                                    // run for *ALL* bots in sequence, used for reset
-extern char* (*callback_botinfo) (void) ; // function pointer to user-defined callback function for bot info
-
 SDL_Surface *screen;
 
 // note! background is different from the rest, in the format 0x00RRGGBB
@@ -80,8 +77,14 @@ void dieSDL(char *reason)
 }
 
 
-kilobot *grabbed = NULL; // the kilobot currently picked up with the mouse, or NULL
-kilobot *grabbedRot = NULL; // the kilobot currently picked for rotation, or NULL
+// the bots drawn most recently, and their number.
+// With the GUI, these are the copies in the frame on screen.
+kilobot **shown_bots = NULL;
+int n_shown = 0;
+
+// the bots are edited by the simulation thread, so the GUI refers to them by ID
+int grabbed = -1; // the ID of the kilobot currently picked up with the mouse, or -1
+int grabbedRot = -1; // the ID of the kilobot currently picked for rotation, or -1
 double angle; //variables for rotation
 int rotX0;
 
@@ -90,14 +93,17 @@ int rotX0;
  */
 int find_bot_index (int x, int y)
 {
-  int RR = allbots[0]->radius * simparams->display_scale;
+  if (n_shown == 0)
+    return -1;
+
+  int RR = shown_bots[0]->radius * simparams->display_scale;
   RR *= RR; // radius squared
 
   int i;
-  for (i = 0; i < n_bots; i++)
+  for (i = 0; i < n_shown; i++)
     {
-      int dx = allbots[i]->screen_x - x;
-      int dy = allbots[i]->screen_y - y;
+      int dx = shown_bots[i]->screen_x - x;
+      int dy = shown_bots[i]->screen_y - y;
       int rr = dx*dx + dy*dy;
       if (rr < RR)
 	return i;
@@ -113,51 +119,54 @@ kilobot * find_bot (int x, int y)
 {
   int i =  find_bot_index (x, y);
   if (i >= 0)
-    return allbots[i];
+    return shown_bots[i];
   else
     return NULL;
 }
 
 
-void move_bot_to_mouse(kilobot *bot)
+void move_bot_to_mouse(int ID)
 {
   int x, y;
   SDL_GetMouseState (&x, &y);
-  bot->x = (x - simparams->display_w/2) / simparams->display_scale + c_x;
-  bot->y = (y - simparams->display_h/2) / simparams->display_scale + c_y;
+  gui_push_edit(EDIT_MOVE, ID,
+		(x - simparams->display_w/2) / simparams->display_scale + c_x,
+		(y - simparams->display_h/2) / simparams->display_scale + c_y);
 }
 
 /* try to grab a bot with the mouse*/
 void grab_bot(int x, int y)
 {
-  grabbed = find_bot (x, y);
-  if (grabbed)
+  kilobot *bot = find_bot (x, y);
+  grabbed = bot ? bot->ID : -1;
+  if (bot)
     move_bot_to_mouse(grabbed);
 }
 
 
-void rotateBot (kilobot *bot)
+void rotateBot (int ID)
 {
   int x, y;
   SDL_GetMouseState (&x, &y);
   
-  bot->direction = angle + (x-rotX0)*.05;
+  gui_push_edit(EDIT_ROTATE, ID, angle + (x-rotX0)*.05, 0);
 }
 
 void grab_bot_rot(int x, int y)
 {
-  grabbedRot = find_bot (x, y);
-  if (grabbedRot)
+  kilobot *bot = find_bot (x, y);
+  grabbedRot = bot ? bot->ID : -1;
+  if (bot)
     {
       rotX0 = x;
-      angle = grabbedRot->direction;
+      angle = bot->direction;
     }
 }
 
 void release_bot()
 {
-  grabbed = NULL;
-  grabbedRot = NULL;
+  grabbed = -1;
+  grabbedRot = -1;
 }
 
 //try to open a file for reading. Return 1 if successful.
@@ -198,61 +207,46 @@ void screenshot (SDL_Surface *s)
 
 
 
+/* Handle input events. Anything affecting the simulation is queued with
+ * gui_push_edit(), and applied by the simulation thread between steps.
+ */
 void input(void)
 {
-  static int save_tx_period_ticks = 1;
- 
-  int i;
   SDL_Event event;      
   while (SDL_PollEvent(&event)) 
     switch(event.type) 
       {
       case SDL_QUIT:
-	quit = 1;
+	gui_push_edit(EDIT_QUIT, 0, 0, 0);
 	break;
       case SDL_KEYDOWN:
 	switch( event.key.keysym.sym )
 	  {
 	  case SDLK_ESCAPE:  
-	    quit = 1;           
+	    gui_push_edit(EDIT_QUIT, 0, 0, 0);
 	    break;
 	  case SDLK_s:
 	    screenshot(screen);
 	    break;
 	  case SDLK_v:
-	    simparams->saveVideo = !simparams->saveVideo;
+	    gui_push_edit(EDIT_VIDEO, 0, 0, 0);
 	    break;
 	  case SDLK_SPACE:
-	    if (state==RUNNING)
-	      state = PAUSE;
-	    else if (state == PAUSE)
-	      state = RUNNING;
+	    gui_push_edit(EDIT_PAUSE, 0, 0, 0);
 	    break;
 	  case SDLK_a:    //add bot
 	    break;
 	  case SDLK_F5: // "userdefined" callback to the bot program - (reread JSON)
-	    if (callback_F5)
-	      callback_F5();
+	    gui_push_edit(EDIT_F5, 0, 0, 0);
 	    break;
 	  case SDLK_F6: // "userdefined" callback to the bot program - (restart GRN)
-	    if (callback_F6)
-	      for (i = 0; i < n_bots; i++)
-		{
-		  prepare_bot(allbots[i]);
-		  callback_F6();
-		}
+	    gui_push_edit(EDIT_F6, 0, 0, 0);
 	    break;
 	  case SDLK_F11: //simulate at maximum speed (no delay between frames)
-	    fullSpeed = !fullSpeed;
+	    gui_push_edit(EDIT_FULL_SPEED, 0, 0, 0);
 	    break;
 	  case SDLK_F12: // fast communication mode
-	    if (tx_period_ticks > 1)
-	      {
-		save_tx_period_ticks = tx_period_ticks;
-		tx_period_ticks = 1;
-	      }
-	    else
-	      	tx_period_ticks = save_tx_period_ticks;
+	    gui_push_edit(EDIT_FAST_COMM, 0, 0, 0);
 	    break;
 	  default: break;
 	  }
@@ -269,9 +263,9 @@ void input(void)
       default: break;
       }
 
-  if (grabbed)
+  if (grabbed >= 0)
     move_bot_to_mouse(grabbed);
-  if (grabbedRot)
+  if (grabbedRot >= 0)
     rotateBot(grabbedRot);
 
   // Check which keys are held down
@@ -304,18 +298,14 @@ void input(void)
    c_y += d;
  if (keystates[SDLK_KP_MULTIPLY] ||
      keystates[SDLK_F4] ) // faster
-   simparams->stepsPerFrame++;
+   gui_push_edit(EDIT_STEPS, 1, 0, 0);
  if (keystates[SDLK_KP_DIVIDE] ||
      keystates[SDLK_F3] )   // slower
-   if (simparams->stepsPerFrame > 0)
-     simparams->stepsPerFrame--;
+   gui_push_edit(EDIT_STEPS, -1, 0, 0);
  if (keystates[SDLK_F1])
-   spread_out(n_bots, 500);
+   gui_push_edit(EDIT_SPREAD, 0, 500, 0);
  if (keystates[SDLK_F2])
-   {
-     spread_out(n_bots, -200);
-     update_interactions(n_bots);
-   }
+   gui_push_edit(EDIT_SPREAD, 0, -200, 1);
 }
 
 
@@ -494,23 +484,46 @@ Uint32 conv_RGBA(int r, int g, int b, int a)
   return a + (b << 8) + (g << 16) + (r << 24);
 }
 
+/* The part of the arena that is visible, with a margin of one
+ * communication range. The simulator skips storing communication lines
+ * outside it.
+ */
+void visible_area(double *x0, double *y0, double *x1, double *y1)
+{
+  double half_w = simparams->display_w / 2 / simparams->display_scale + simparams->commsRadius;
+  double half_h = simparams->display_h / 2 / simparams->display_scale + simparams->commsRadius;
+  *x0 = c_x - half_w;
+  *y0 = c_y - half_h;
+  *x1 = c_x + half_w;
+  *y1 = c_y + half_h;
+}
+
+// draw a communication line between arena coordinates (fx, fy) and (tx, ty)
+void draw_comm_line(SDL_Surface *surface, double fx, double fy, double tx, double ty)
+{
+  int x1 = simparams->display_w/2 + simparams->display_scale * (fx - c_x); 
+  int y1 = simparams->display_h/2 + simparams->display_scale * (fy - c_y);
+  int x2 = simparams->display_w/2 + simparams->display_scale * (tx - c_x); 
+  int y2 = simparams->display_h/2 + simparams->display_scale * (ty - c_y);  
+
+  if (colorscheme->anti_alias)
+    aalineColor (surface, x1, y1, x2, y2, colorscheme->comm);
+  else
+    lineColor (surface, x1, y1, x2, y2, colorscheme->comm);
+}
+
 void draw_commLines(SDL_Surface *surface)
 {
+  double x0, y0, x1, y1;
   int i;
-  for (i = 0; i < NcommLines; i++)
-    {
-      kilobot *from = commLines[i].from;
-      kilobot *to   = commLines[i].to;
 
-      int x1 = simparams->display_w/2 + simparams->display_scale * (from->x - c_x); 
-      int y1 = simparams->display_h/2 + simparams->display_scale * (from->y - c_y);
-      int x2 = simparams->display_w/2 + simparams->display_scale * (to->x - c_x); 
-      int y2 = simparams->display_h/2 + simparams->display_scale * (to->y - c_y);  
+  visible_area(&x0, &y0, &x1, &y1);
+  setCommLineViewport(x0, y0, x1, y1);
 
-      if (colorscheme->anti_alias)
-	aalineColor (surface, x1, y1, x2, y2, colorscheme->comm);
-      else
-	lineColor (surface, x1, y1, x2, y2, colorscheme->comm);
+  for (i = 0; i < commLines.count; i++)
+    {
+      CommLine *line = getCommLine(i);
+      draw_comm_line(surface, line->from->x, line->from->y, line->to->x, line->to->y);
     }
 }
 
@@ -596,7 +609,7 @@ void draw_bot(SDL_Surface *surface, int w, int h, kilobot *bot)
   /* Draw line to front */
   int x_front = draw_x + scale * r * sin(bot->direction);
   int y_front = draw_y + scale * r * cos(bot->direction);
-  lineColor(screen, draw_x, draw_y, x_front, y_front, colorscheme->bot_line_front);
+  lineColor(surface, draw_x, draw_y, x_front, y_front, colorscheme->bot_line_front);
 
   
   /* Draw legs */
@@ -643,8 +656,8 @@ void draw_bot(SDL_Surface *surface, int w, int h, kilobot *bot)
   int ty2 = draw_y + scale * r*.4 * cos(bot->direction-2*M_PI*.4);
 
   if (colorscheme->anti_alias)
-    aatrigonColor (screen, txf, tyf, tx1, ty1, tx2, ty2, colorscheme->bot_arrow);
-  filledTrigonColor (screen, txf, tyf, tx1, ty1, tx2, ty2, colorscheme->bot_arrow);
+    aatrigonColor (surface, txf, tyf, tx1, ty1, tx2, ty2, colorscheme->bot_arrow);
+  filledTrigonColor (surface, txf, tyf, tx1, ty1, tx2, ty2, colorscheme->bot_arrow);
   
 
   /* Draw transmit radius */
@@ -680,27 +693,20 @@ void displayString (SDL_Surface *surface, int x, int y, char *s)
 }
 
 
-// draw status message for one bot, if the mouse is over it
-// also draw a simulator status
-void draw_status(SDL_Surface *surface, int w, int h, double time, double FPS)
+// draw a simulator status, and botinfo - the status message of the
+// bot under the mouse, or NULL
+void draw_status(SDL_Surface *surface, int w, int h, double time, int ticks,
+		 int stepsPerFrame, double FPS, const char *botinfo)
 {
-  char buf[100];
+  char buf[500];
   sprintf(buf, "%3dx    time: %8.1f     kilo_ticks: %8d     FPS: %5.1f",
-	  simparams->stepsPerFrame, time, kilo_ticks, FPS);
+	  stepsPerFrame, time, ticks, FPS);
   displayString(surface, 10, 2, buf);
   
-  
-  // find bot under cursor
-  int x, y;
-  SDL_GetMouseState (&x, &y);
-
-  int i = find_bot_index (x, y);
-  if (i >= 0)
+  if (botinfo && botinfo[0])
     {
-      //switch to this bot
-      prepare_bot(allbots[i]);
-      char *s = callback_botinfo();
-      displayString(surface, 10, h-30, s);
+      snprintf(buf, sizeof(buf), "%s", botinfo); // displayString modifies its argument
+      displayString(surface, 10, h-30, buf);
     }
 }
 
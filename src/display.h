@@ -28,8 +28,15 @@ void draw_bot(SDL_Surface *surface, int w, int h, kilobot *bot);
 void draw_bot_history(SDL_Surface *surface, int w, int h, kilobot *bot);
 void draw_bot_history_ring(SDL_Surface *surface, int w, int h, kilobot *bot);
 void draw_commLines(SDL_Surface *surface);
-void draw_status(SDL_Surface *surface, int w, int h, double time, double FPS);
+void draw_comm_line(SDL_Surface *surface, double fx, double fy, double tx, double ty);
+void draw_status(SDL_Surface *surface, int w, int h, double time, int ticks,
+		 int stepsPerFrame, double FPS, const char *botinfo);
 void set_display_center(double X, double Y);
+void visible_area(double *x0, double *y0, double *x1, double *y1);
+int find_bot_index(int x, int y);
+
+extern kilobot **shown_bots;
+extern int n_shown;
 
 extern ColorScheme *colorscheme;
 extern ColorScheme darkColors, brightColors;
@@ -6,7 +6,9 @@
 #include"kilolib.h"
 #include"skilobot.h"
 #include"params.h"
+#include"sim.h"
 #include"stateio.h"
+#include"rng.h"
 
 
 
@@ -21,6 +23,13 @@ void distribute_elipse(int n_bots);
 void distribute_pile2(int n_bots);
 
 
+/* The random stream for placing bot i, keyed by the bot's ID so that its
+ * place does not depend on the other bots. */
+static void placement_stream(rng_stream *r, int i)
+{
+  rng_stream_init(r, rng_seed, allbots[i]->ID, 0, 0, RNG_PLACEMENT);
+}
+
 void distribute_line(int n_bots)
 {
   for (int i=0; i < n_bots; i++) {
@@ -37,10 +46,12 @@ void distribute_rline(int n_bots)
 
 void distribute_rand(int n_bots, int w, int h)
 {
+  rng_stream r;
   for (int i=0; i < n_bots; i++) {
-    allbots[i]->x = rand()%w - w/2;
-    allbots[i]->y = rand()%h - h/2;
-    allbots[i]->direction = 2 * M_PI * (float) rand() / (float) RAND_MAX;
+    placement_stream(&r, i);
+    allbots[i]->x = (int) (rng_next32(&r) % w) - w/2;
+    allbots[i]->y = (int) (rng_next32(&r) % h) - h/2;
+    allbots[i]->direction = 2 * M_PI * rng_next_u01(&r);
   }
 }
 
@@ -125,12 +136,14 @@ void distribute_random_pile(int n_bots)
 	float theta = 0;
 	float delta_theta = 0;
 	//	float alpha = theta - M_PI/4;
+	rng_stream r;
 
     while(bot < n_bots){
 
     	allbots[bot]->x = x_value;
     	allbots[bot]->y = y_value;
-    	allbots[bot]->direction =  ((float)rand()/(float)(RAND_MAX)) * (2*M_PI);
+    	placement_stream(&r, bot);
+    	allbots[bot]->direction =  rng_next_u01(&r) * (2*M_PI);
 
     	max_n_bots--;
     	if(max_n_bots > 0){
@@ -213,6 +226,7 @@ void distribute_pile2(int n_bots)
   int num_rows=ceil(sqrt(n_bots));
   float num_start=ceil(num_rows/2);
   int cont=0;
+  rng_stream r;
 
   for (int i=-num_start; i < num_start; i++) {
     for (int j=-num_start; j < num_start; j++) {
@@ -223,7 +237,8 @@ void distribute_pile2(int n_bots)
 	{
 	  allbots[cont]->x = pos_x;
 	  allbots[cont]->y = pos_y;
-	  allbots[cont]->direction = ((float)rand()/(float)(RAND_MAX)) * (2*M_PI);
+	  placement_stream(&r, cont);
+	  allbots[cont]->direction = rng_next_u01(&r) * (2*M_PI);
 	  //allbots[cont]->direction = 0;
 	}
       cont++;
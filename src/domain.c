@@ -0,0 +1,637 @@
+/* Spatial decomposition of one simulation over several processes.
+ *
+ * With numProcesses > 1, the arena is cut into vertical strips holding equal
+ * numbers of bots at the start, and each strip is simulated by a process of
+ * its own, forked from the main process once the bots are set up. The
+ * processes of neighboring strips are connected by a Unix socket. In every
+ * time step, each process runs and moves its own bots, and sends each
+ * neighbor
+ *
+ * - the bots that have moved into the neighbor's strip, in full with their
+ *   USERDATA, to be simulated there from now on, and
+ * - its bots within the halo - communication range or touching distance -
+ *   of the shared border, with their position and the message they are
+ *   transmitting.
+ *
+ * The halo bots received are put after the process' own bots in allbots as
+ * ghosts, so that the grid and the message delivery code find the neighbors
+ * and messages across the border as usual, and are only run for the own
+ * bots. Messages are passed in the phases of parallelMessaging: the ghosts'
+ * messages are collected by their own process before the exchange.
+ * A collision with a ghost only moves the own bot, the ghost's process moves
+ * the other one, so with collisions at the borders the result differs
+ * slightly from that of a single process.
+ *
+ * At the end of the simulation, the bots are collected in the main process,
+ * which goes on as a simulation in one process, and the others exit.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "skilobot.h"
+#include "params.h"
+#include "neighbors.h"
+#include "snapshot.h"
+#include "eventlog.h"
+#include "sim.h"
+#include "domain.h"
+
+extern int UserdataSize;
+
+enum {LEFT, RIGHT};
+
+typedef struct {
+  char *data;
+  size_t size, capacity;
+  size_t pos;  // read position
+} buffer;
+
+// what the neighbor needs of a halo bot
+typedef struct {
+  int ID;
+  double x, y, direction;
+  int radius;
+  double cr;
+  int tx_slot;
+  message_t outbox;
+  int left_motor_power, right_motor_power;  // for pushDisplacement
+} ghost_record;
+
+struct sim_domain {
+  int rank, n_procs;
+  double left, right;   // the strip of this process, left <= x < right
+  double halo;          // width of the halo at each border
+  int fd[2];            // sockets to the left and right neighbor, -1 if none
+  pid_t *children;      // in the main process, the other processes
+  int bots_capacity;    // of allbots
+  kilobot **ghosts;     // kept from step to step, to reuse their memory
+  int n_ghosts, ghost_capacity;
+  buffer out[2], in[2];
+  char *file_name;
+  int finishing;        // in domain_finish(), gathering the bots
+};
+
+
+static void reserve(buffer *b, size_t n)
+{
+  if (n > b->capacity)
+    {
+      b->capacity = n;
+      b->data = (char *) realloc(b->data, n);
+    }
+}
+
+static void put(buffer *b, const void *p, size_t n)
+{
+  if (b->size + n > b->capacity)
+    reserve(b, 2 * (b->size + n));
+  memcpy(b->data + b->size, p, n);
+  b->size += n;
+}
+
+static void get(buffer *b, void *p, size_t n)
+{
+  memcpy(p, b->data + b->pos, n);
+  b->pos += n;
+}
+
+static void lost_neighbor(struct sim_domain *d, int side)
+{
+  /* All processes reach domain_finish() in the same step, so once there the
+   * main process is gathering the bots, and the others leave quietly.
+   */
+  if (d->rank > 0 && d->finishing)
+    exit(0);
+  fprintf(stderr, "Lost the connection to simulation process %d.\n",
+	  side == LEFT ? d->rank - 1 : d->rank + 1);
+  exit(1);
+}
+
+/* Send out[side] to the neighbors in the bit mask send_to, and receive
+ * in[side] from those in recv_from, all at the same time, so that two
+ * neighbors sending each other more than the socket buffers hold do not
+ * wait for each other. Each transfer starts with its length.
+ */
+static void exchange(struct sim_domain *d, int send_to, int recv_from)
+{
+  const size_t H = sizeof(uint64_t);
+  uint64_t out_len[2], in_len[2] = {0, 0};
+  size_t sent[2] = {0, 0}, received[2] = {0, 0};
+  int s;
+
+  for (s = 0; s < 2; s++)
+    {
+      out_len[s] = d->out[s].size;
+      d->in[s].size = d->in[s].pos = 0;
+    }
+
+  for (;;)
+    {
+      struct pollfd pfd[2];
+      int side[2], n = 0;
+
+      for (s = 0; s < 2; s++)
+	{
+	  short events = 0;
+	  if (d->fd[s] < 0)
+	    continue;
+	  if ((send_to >> s & 1) && sent[s] < H + out_len[s])
+	    events |= POLLOUT;
+	  if ((recv_from >> s & 1) && (received[s] < H || received[s] < H + in_len[s]))
+	    events |= POLLIN;
+	  if (events)
+	    {
+	      pfd[n].fd = d->fd[s];
+	      pfd[n].events = events;
+	      side[n++] = s;
+	    }
+	}
+      if (n == 0)
+	break;
+
+      if (poll(pfd, n, -1) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  perror("poll");
+	  exit(1);
+	}
+
+      for (int k = 0; k < n; k++)
+	{
+	  ssize_t r;
+	  s = side[k];
+
+	  if (pfd[k].revents & POLLOUT)
+	    {
+	      if (sent[s] < H)
+		r = send(d->fd[s], (char *) &out_len[s] + sent[s], H - sent[s], MSG_NOSIGNAL);
+	      else
+		r = send(d->fd[s], d->out[s].data + sent[s] - H, H + out_len[s] - sent[s], MSG_NOSIGNAL);
+	      if (r < 0 && errno != EAGAIN && errno != EINTR)
+		lost_neighbor(d, s);
+	      if (r > 0)
+		sent[s] += r;
+	    }
+
+	  if ((pfd[k].events & POLLIN) && (pfd[k].revents & (POLLIN | POLLHUP | POLLERR)))
+	    {
+	      if (received[s] < H)
+		r = recv(d->fd[s], (char *) &in_len[s] + received[s], H - received[s], 0);
+	      else
+		r = recv(d->fd[s], d->in[s].data + received[s] - H, H + in_len[s] - received[s], 0);
+	      if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR))
+		lost_neighbor(d, s);
+	      if (r > 0)
+		{
+		  received[s] += r;
+		  if (received[s] == H)
+		    {
+		      reserve(&d->in[s], in_len[s]);
+		      d->in[s].size = in_len[s];
+		    }
+		}
+	    }
+	  else if (pfd[k].revents & (POLLHUP | POLLERR))
+	    lost_neighbor(d, s);
+	}
+    }
+}
+
+static void put_bot(buffer *b, kilobot *bot)
+{
+  put(b, bot, sizeof(kilobot));
+  put(b, bot->data, UserdataSize);
+}
+
+static kilobot *get_bot(struct sim_domain *d, buffer *b)
+{
+  kilobot *bot = (kilobot *) malloc(sizeof(kilobot));
+  get(b, bot, sizeof(kilobot));
+  bot->data = malloc(UserdataSize);
+  get(b, bot->data, UserdataSize);
+
+  // the pointers were those of the sending process
+  bot->in_range_size = IN_RANGE_SIZE;
+  bot->in_range = (int *) malloc(sizeof(int) * bot->in_range_size);
+  bot->n_in_range = 0;
+  bot->ctx.bot = bot;
+  bot->ctx.ticks = &kilo_ticks;
+  bot->x_history = bot->y_history = NULL;
+  bot->p_hist = bot->l_hist = 0;
+  bot->runner = NULL;
+  if (simparams->storeHistory)
+    {
+      bot->x_history = (double *) calloc(bot->n_hist, sizeof(double));
+      bot->y_history = (double *) calloc(bot->n_hist, sizeof(double));
+    }
+  return bot;
+}
+
+static void ghost_of(kilobot *bot, ghost_record *g)
+{
+  g->ID = bot->ID;
+  g->x = bot->x;
+  g->y = bot->y;
+  g->direction = bot->direction;
+  g->radius = bot->radius;
+  g->cr = bot->cr;
+  g->tx_slot = bot->tx_slot;
+  g->outbox = bot->outbox;
+  g->left_motor_power = bot->left_motor_power;
+  g->right_motor_power = bot->right_motor_power;
+}
+
+static void add_ghost(struct sim_domain *d, const ghost_record *g)
+{
+  if (d->n_ghosts == d->ghost_capacity)
+    {
+      d->ghost_capacity = d->ghost_capacity ? 2 * d->ghost_capacity : 64;
+      d->ghosts = (kilobot **) realloc(d->ghosts, sizeof(kilobot *) * d->ghost_capacity);
+      for (int i = d->n_ghosts; i < d->ghost_capacity; i++)
+	{
+	  d->ghosts[i] = (kilobot *) calloc(1, sizeof(kilobot));
+	  d->ghosts[i]->in_range_size = IN_RANGE_SIZE;
+	  d->ghosts[i]->in_range = (int *) malloc(sizeof(int) * IN_RANGE_SIZE);
+	}
+    }
+
+  kilobot *bot = d->ghosts[d->n_ghosts++];
+  bot->ID = g->ID;
+  bot->x = g->x;
+  bot->y = g->y;
+  bot->direction = g->direction;
+  bot->radius = g->radius;
+  bot->cr = g->cr;
+  bot->tx_slot = g->tx_slot;
+  bot->tx_enabled = g->tx_slot >= 0;
+  bot->outbox = g->outbox;
+  bot->left_motor_power = g->left_motor_power;
+  bot->right_motor_power = g->right_motor_power;
+  bot->n_in_range = 0;
+}
+
+static void reserve_bots(struct sim_domain *d, int n)
+{
+  if (n > d->bots_capacity)
+    {
+      d->bots_capacity = 2 * n;
+      allbots = (kilobot **) realloc(allbots, sizeof(kilobot *) * d->bots_capacity);
+    }
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+static int compare_ids(const void *a, const void *b)
+{
+  return (*(kilobot * const *) a)->ID - (*(kilobot * const *) b)->ID;
+}
+
+/* Split the current simulation over n_procs processes. Called by
+ * sim_create() after the bots are set up, before any threads are started.
+ * Returns in every process, with the bots of its strip.
+ */
+void domain_start(int n_procs)
+{
+  int n = sim->n_bots;
+  int i, k;
+
+  if (n_procs > n)
+    n_procs = n;
+  if (n_procs <= 1)
+    return;
+#ifndef SKILO_HEADLESS
+  if (simparams->GUI)
+    {
+      fprintf(stderr, "numProcesses needs GUI = 0, running in one process.\n");
+      return;
+    }
+#endif
+
+  struct sim_domain *d = (struct sim_domain *) calloc(1, sizeof(struct sim_domain));
+  d->n_procs = n_procs;
+  d->bots_capacity = n;
+  d->fd[LEFT] = d->fd[RIGHT] = -1;
+
+  // borders between the strips, at quantiles of the x coordinates
+  double *x = (double *) malloc(sizeof(double) * n);
+  double *border = (double *) malloc(sizeof(double) * (n_procs + 1));
+  for (i = 0; i < n; i++)
+    x[i] = allbots[i]->x;
+  qsort(x, n, sizeof(double), compare_doubles);
+  border[0] = -INFINITY;
+  border[n_procs] = INFINITY;
+  for (k = 1; k < n_procs; k++)
+    {
+      i = (long) n * k / n_procs;
+      border[k] = (x[i-1] + x[i]) / 2;
+    }
+
+  for (i = 0; i < n; i++)
+    d->halo = fmax(d->halo, fmax(allbots[i]->cr, 2 * allbots[i]->radius));
+  for (k = 1; k < n_procs - 1; k++)
+    if (border[k+1] - border[k] < d->halo)
+      {
+	fprintf(stderr, "Warning: strip %d is narrower than the communication range, "
+		"use fewer processes.\n", k);
+	break;
+      }
+
+  int (*sv)[2] = malloc(sizeof(int[2]) * (n_procs - 1));
+  for (k = 0; k < n_procs - 1; k++)
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv[k]))
+      {
+	perror("socketpair");
+	exit(1);
+      }
+
+  fflush(stdout);
+  fflush(stderr);
+  d->children = (pid_t *) calloc(n_procs, sizeof(pid_t));
+  for (k = 1; k < n_procs; k++)
+    {
+      pid_t pid = fork();
+      if (pid < 0)
+	{
+	  perror("fork");
+	  exit(1);
+	}
+      if (pid == 0)
+	{
+	  d->rank = k;
+	  free(d->children);
+	  d->children = NULL;
+	  break;
+	}
+      d->children[k] = pid;
+    }
+
+  // keep the sockets to our neighbors
+  for (k = 0; k < n_procs - 1; k++)
+    {
+      if (k == d->rank - 1)
+	d->fd[LEFT] = sv[k][1];
+      else
+	close(sv[k][1]);
+      if (k == d->rank)
+	d->fd[RIGHT] = sv[k][0];
+      else
+	close(sv[k][0]);
+    }
+  for (k = 0; k < 2; k++)
+    if (d->fd[k] >= 0)
+      fcntl(d->fd[k], F_SETFL, O_NONBLOCK);
+
+  d->left = border[d->rank];
+  d->right = border[d->rank + 1];
+
+  // keep our own bots
+  int n_own = 0;
+  for (i = 0; i < n; i++)
+    {
+      kilobot *bot = allbots[i];
+      if (bot->x >= d->left && bot->x < d->right)
+	{
+	  bot->index = n_own;
+	  allbots[n_own++] = bot;
+	}
+      else
+	free_kilobot(bot);
+    }
+  sim->n_bots = n_own;
+
+  // images show the bots of the main process only, and are saved by it
+  if (d->rank > 0)
+    {
+      simparams->saveVideo = 0;
+      simparams->finalImage = NULL;
+    }
+
+  free(x);
+  free(border);
+  free(sv);
+  sim->domain = d;
+}
+
+/* One time step of the bots of this process. */
+void domain_step(float timestep)
+{
+  struct sim_domain *d = sim->domain;
+  int n = sim->n_bots, n_own = 0;
+  int header[2][2] = {{0, 0}, {0, 0}};  // migrants and ghosts for each side
+  ghost_record g;
+  int i, s;
+
+  run_all_bots(n);
+  for (i = 0; i < n; i++)
+    update_bot(allbots[i], timestep);
+  collect_all_messages(n);
+
+  d->n_ghosts = 0;
+  for (s = 0; s < 2; s++)
+    {
+      d->out[s].size = 0;
+      put(&d->out[s], header[s], sizeof(header[s]));
+    }
+
+  // bots leaving the strip go to the neighbor, and stay here as ghosts
+  for (i = 0; i < n; i++)
+    {
+      kilobot *bot = allbots[i];
+      s = bot->x < d->left ? LEFT : bot->x >= d->right ? RIGHT : -1;
+      // a bot waiting in delay() has its stack here, it moves when done
+      if (s < 0 || bot->runner)
+	{
+	  allbots[n_own++] = bot;
+	  continue;
+	}
+      put_bot(&d->out[s], bot);
+      header[s][0]++;
+      ghost_of(bot, &g);
+      add_ghost(d, &g);
+      free_kilobot(bot);
+    }
+
+  // bots in the halo are ghosts for the neighbor
+  for (i = 0; i < n_own; i++)
+    {
+      kilobot *bot = allbots[i];
+      ghost_of(bot, &g);
+      if (d->fd[LEFT] >= 0 && bot->x - d->left < d->halo)
+	{
+	  put(&d->out[LEFT], &g, sizeof(g));
+	  header[LEFT][1]++;
+	}
+      if (d->fd[RIGHT] >= 0 && d->right - bot->x <= d->halo)
+	{
+	  put(&d->out[RIGHT], &g, sizeof(g));
+	  header[RIGHT][1]++;
+	}
+    }
+
+  for (s = 0; s < 2; s++)
+    memcpy(d->out[s].data, header[s], sizeof(header[s]));
+
+  exchange(d, 1 << LEFT | 1 << RIGHT, 1 << LEFT | 1 << RIGHT);
+
+  for (s = 0; s < 2; s++)
+    {
+      if (d->fd[s] < 0)
+	continue;
+      get(&d->in[s], header[s], sizeof(header[s]));
+      reserve_bots(d, n_own + header[s][0]);
+      for (i = 0; i < header[s][0]; i++)
+	allbots[n_own++] = get_bot(d, &d->in[s]);
+      for (i = 0; i < header[s][1]; i++)
+	{
+	  get(&d->in[s], &g, sizeof(g));
+	  add_ghost(d, &g);
+	}
+    }
+
+  // the ghosts go after our own bots
+  reserve_bots(d, n_own + d->n_ghosts);
+  for (i = 0; i < d->n_ghosts; i++)
+    allbots[n_own + i] = d->ghosts[i];
+  for (i = 0; i < n_own + d->n_ghosts; i++)
+    allbots[i]->index = i;
+  sim->n_bots = n_own;
+
+  if (n_own + d->n_ghosts > 0)
+    {
+      if (simparams->useGrid)
+	update_interactions_grid(n_own + d->n_ghosts);
+      else
+	update_interactions(n_own + d->n_ghosts);
+    }
+
+  deliver_all_messages(n_own);
+  confirm_all_messages(n_own);
+  leave_bot();
+}
+
+/* Collect all bots in the main process, which goes on as a simulation in one
+ * process, with the communication counters of all. The other processes save
+ * their state files and exit. Each process passes the bots of the strips to
+ * its right on to the left, together with its own.
+ */
+void domain_finish(void)
+{
+  struct sim_domain *d = sim->domain;
+  comm_stats stats, right_stats;
+  int count = 0, i;
+
+  d->finishing = 1;
+  if (d->fd[RIGHT] >= 0)
+    {
+      exchange(d, 0, 1 << RIGHT);
+      get(&d->in[RIGHT], &right_stats, sizeof(right_stats));
+      get(&d->in[RIGHT], &count, sizeof(count));
+    }
+
+  if (d->rank > 0)
+    {
+      buffer *b = &d->out[LEFT];
+      comm_stats_merge(&stats);
+      if (d->fd[RIGHT] >= 0)
+	comm_stats_add(&stats, &right_stats);
+      count += sim->n_bots;
+
+      b->size = 0;
+      put(b, &stats, sizeof(stats));
+      put(b, &count, sizeof(count));
+      for (i = 0; i < sim->n_bots; i++)
+	put_bot(b, allbots[i]);
+      if (d->fd[RIGHT] >= 0)
+	put(b, d->in[RIGHT].data + d->in[RIGHT].pos, d->in[RIGHT].size - d->in[RIGHT].pos);
+      exchange(d, 1 << LEFT, 0);
+
+      snapshot_writer_stop();
+      event_log_stop();
+      fflush(stdout);
+      exit(0);
+    }
+
+  if (d->fd[RIGHT] >= 0)
+    comm_stats_add(&comm_stats_worker[0], &right_stats);
+  reserve_bots(d, sim->n_bots + count);
+  for (i = 0; i < count; i++)
+    allbots[sim->n_bots++] = get_bot(d, &d->in[RIGHT]);
+
+  qsort(allbots, sim->n_bots, sizeof(kilobot *), compare_ids);
+  for (i = 0; i < sim->n_bots; i++)
+    allbots[i]->index = i;
+
+  domain_stop();
+}
+
+/* Leave the decomposition: close the connections, so that the other
+ * processes exit if they are still running, and wait for them.
+ */
+void domain_stop(void)
+{
+  struct sim_domain *d = sim->domain;
+  int i;
+
+  if (!d)
+    return;
+
+  for (i = 0; i < 2; i++)
+    {
+      if (d->fd[i] >= 0)
+	close(d->fd[i]);
+      free(d->out[i].data);
+      free(d->in[i].data);
+    }
+  if (d->children)
+    for (i = 1; i < d->n_procs; i++)
+      waitpid(d->children[i], NULL, 0);
+
+  for (i = 0; i < d->ghost_capacity; i++)
+    {
+      free(d->ghosts[i]->in_range);
+      free(d->ghosts[i]);
+    }
+  free(d->ghosts);
+  free(d->children);
+  free(d->file_name);
+  free(d);
+  sim->domain = NULL;
+}
+
+// 0 in the main process
+int domain_rank(void)
+{
+  return sim && sim->domain ? sim->domain->rank : 0;
+}
+
+/* The name of an output file of this process: name itself in the main
+ * process, name.<rank> in the others.
+ */
+const char *domain_file_name(const char *name)
+{
+  struct sim_domain *d = sim->domain;
+
+  if (!d || d->rank == 0 || !name)
+    return name;
+  free(d->file_name);
+  d->file_name = (char *) malloc(strlen(name) + 16);
+  sprintf(d->file_name, "%s.%d", name, d->rank);
+  return d->file_name;
+}
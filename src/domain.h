@@ -0,0 +1,15 @@
+/* Running one simulation in several processes, each simulating a strip
+ * of the arena. See domain.c.
+ */
+
+#ifndef DOMAIN_H
+#define DOMAIN_H
+
+void domain_start(int n_procs);
+void domain_step(float timestep);
+void domain_finish(void);
+void domain_stop(void);
+int domain_rank(void);
+const char *domain_file_name(const char *name);
+
+#endif
@@ -0,0 +1,328 @@
+/* Branching a simulation into an ensemble of runs.
+ *
+ * sim_branch() forks the simulation into a number of processes, each going
+ * on from the current state with a seed of its own, and optionally with
+ * some parameters changed. The forked processes share the memory of the
+ * simulation until they write to it, so the warm state is neither copied
+ * nor set up again. When its time is up, a branch sends its end state as
+ * JSON through a pipe to the process that branched, and exits. That process
+ * waits for all the branches, running at most n_parallel at a time, and
+ * writes their end states to a file.
+ *
+ * No threads may run while forking, so the worker threads and the state
+ * file writer are stopped first. Each branch starts its own workers.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "skilobot.h"
+#include "params.h"
+#include "stateio.h"
+#include "snapshot.h"
+#include "eventlog.h"
+#include "sim.h"
+#include "ensemble.h"
+
+extern void (*callback_global_setup) (void);
+
+struct sim_branch {
+  int index;
+  int fd;  // pipe to the process that branched
+  char *state_file, *event_file, *checkpoint_file;
+};
+
+// a running branch, as seen by the process that branched
+typedef struct {
+  pid_t pid;
+  int fd;
+  char *data;  // the end state received so far
+  size_t size, capacity;
+} branch_run;
+
+static char *indexed_name(const char *name, int i)
+{
+  char *s = (char *) malloc(strlen(name) + 16);
+  sprintf(s, "%s.%d", name, i);
+  return s;
+}
+
+/* Set up branch i in the forked process: change the parameters as the i:th
+ * object of the branchParams array says, pick the seed, run the global
+ * setup again so that the bot program sees the new parameters, and start
+ * the threads.
+ */
+static void enter_branch(sim_t *s, int i, int fd, int n_threads)
+{
+  struct sim_branch *b = (struct sim_branch *) calloc(1, sizeof(struct sim_branch));
+  b->index = i;
+  b->fd = fd;
+  s->branch = b;
+
+  json_t *list = json_object_get(simparams->root, "branchParams");
+  json_t *changes = json_array_size(list) ? json_array_get(list, i % json_array_size(list)) : NULL;
+  if (json_is_object(changes))
+    update_params(simparams, changes);
+
+  if (json_object_get(changes, "randSeed") && simparams->randSeed)
+    rng_seed = simparams->randSeed;
+  else
+    rng_seed += 1 + i;
+  srand(rng_seed);
+
+  if (callback_global_setup != NULL)
+    callback_global_setup();
+
+  sim_set_threads(n_threads);
+
+  if (simparams->stateFileName && simparams->stateFileSteps != 0)
+    {
+      b->state_file = indexed_name(simparams->stateFileName, i);
+      snapshot_writer_start(b->state_file);
+    }
+  if (simparams->eventFileName)
+    {
+      b->event_file = indexed_name(simparams->eventFileName, i);
+      event_log_start(b->event_file);
+    }
+  if (simparams->checkpointFileName)
+    {
+      b->checkpoint_file = indexed_name(simparams->checkpointFileName, i);
+      simparams->checkpointFileName = b->checkpoint_file;
+    }
+}
+
+static int write_all(int fd, const char *data, size_t size)
+{
+  while (size > 0)
+    {
+      ssize_t r = write(fd, data, size);
+      if (r < 0 && errno == EINTR)
+	continue;
+      if (r <= 0)
+	return 1;
+      data += r;
+      size -= r;
+    }
+  return 0;
+}
+
+// append what can be read from the branch's pipe, 0 at the end
+static int read_run(branch_run *r)
+{
+  if (r->capacity - r->size < 65536)
+    {
+      r->capacity = 2 * r->capacity + 65536;
+      r->data = (char *) realloc(r->data, r->capacity);
+    }
+  ssize_t n = read(r->fd, r->data + r->size, r->capacity - r->size);
+  if (n < 0 && errno == EINTR)
+    return 1;
+  if (n <= 0)
+    return 0;
+  r->size += n;
+  return 1;
+}
+
+static void write_results(branch_run *runs, int n_runs, const char *filename)
+{
+  FILE *f = fopen(filename, "w");
+  if (!f)
+    {
+      fprintf(stderr, "Could not open %s for writing the branches' end states.\n", filename);
+      return;
+    }
+  fprintf(f, "[\n");
+  for (int i = 0; i < n_runs; i++)
+    {
+      if (runs[i].size)
+	fwrite(runs[i].data, 1, runs[i].size, f);
+      else
+	fprintf(f, "null");
+      fprintf(f, i < n_runs - 1 ? ",\n" : "\n");
+    }
+  fprintf(f, "]\n");
+  fclose(f);
+}
+
+/* Whether a simulation with parameters p can be branched, printing the
+ * reason if not. For checking the parameters before the simulation starts.
+ */
+int branch_possible(const simulation_params *p)
+{
+  if (p->numProcesses > 1)
+    {
+      fprintf(stderr, "Can not branch a simulation split over processes.\n");
+      return 0;
+    }
+  if (p->maxTime <= 0)
+    {
+      fprintf(stderr, "Branching needs simulationTime > 0.\n");
+      return 0;
+    }
+#ifndef SKILO_HEADLESS
+  if (p->GUI)
+    {
+      fprintf(stderr, "Branching needs GUI = 0.\n");
+      return 0;
+    }
+#endif
+  return 1;
+}
+
+/* Fork simulation s into n_runs branches, at most n_parallel (0 for one per
+ * CPU core) running at a time. Branch i goes on with the seed of s plus
+ * 1 + i, or with the parameters of the i:th object of the branchParams
+ * array (cycled), if any, including randSeed. Each branch runs until its
+ * time is up, then its end state is collected and it exits in sim_step().
+ *
+ * Returns the branch number in each branch, and -1 in the calling process
+ * once all branches have finished and their end states are written to
+ * results_file, as a JSON array. Returns BRANCH_ERROR at once if s can not
+ * be branched, see branch_possible(). After -1, the caller may go on
+ * stepping s and must destroy it with sim_destroy(). Its worker threads
+ * are restarted, but its state and event files, if any, end at the
+ * branching point: no more states or events of s are written.
+ */
+int sim_branch(sim_t *s, int n_runs, int n_parallel, const char *results_file)
+{
+  sim = s;
+
+  if (s->domain || s->branch)
+    {
+      fprintf(stderr, "Can not branch a simulation split over processes, or a branch.\n");
+      return BRANCH_ERROR;
+    }
+  if (!branch_possible(simparams))
+    return BRANCH_ERROR;
+  if (n_parallel <= 0)
+    n_parallel = sysconf(_SC_NPROCESSORS_ONLN);
+
+  // fork without any threads running
+  int n_threads = pool_size(s->pool);
+  snapshot_writer_stop();
+  event_log_stop();
+  sim_set_threads(1);
+  fflush(stdout);
+  fflush(stderr);
+
+  branch_run *runs = (branch_run *) calloc(n_runs, sizeof(branch_run));
+  struct pollfd *fds = (struct pollfd *) malloc(sizeof(struct pollfd) * n_parallel);
+  int *running = (int *) malloc(sizeof(int) * n_parallel);
+  int n_running = 0, next = 0, i, k;
+
+  for (i = 0; i < n_runs; i++)
+    runs[i].fd = -1;
+
+  while (next < n_runs || n_running > 0)
+    {
+      while (n_running < n_parallel && next < n_runs)
+	{
+	  int fd[2];
+	  if (pipe(fd))
+	    {
+	      perror("pipe");
+	      exit(1);
+	    }
+	  pid_t pid = fork();
+	  if (pid < 0)
+	    {
+	      perror("fork");
+	      exit(1);
+	    }
+	  if (pid == 0)
+	    {
+	      close(fd[0]);
+	      for (k = 0; k < n_running; k++)
+		close(runs[running[k]].fd);
+	      free(runs);
+	      free(fds);
+	      free(running);
+	      enter_branch(s, next, fd[1], n_threads);
+	      return next;
+	    }
+	  close(fd[1]);
+	  runs[next].pid = pid;
+	  runs[next].fd = fd[0];
+	  running[n_running++] = next++;
+	}
+
+      for (k = 0; k < n_running; k++)
+	{
+	  fds[k].fd = runs[running[k]].fd;
+	  fds[k].events = POLLIN;
+	}
+      if (poll(fds, n_running, -1) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  perror("poll");
+	  exit(1);
+	}
+
+      for (k = n_running - 1; k >= 0; k--)
+	{
+	  branch_run *r = &runs[running[k]];
+	  int status;
+	  if (!(fds[k].revents & (POLLIN | POLLHUP | POLLERR)) || read_run(r))
+	    continue;
+
+	  close(r->fd);
+	  r->fd = -1;
+	  waitpid(r->pid, &status, 0);
+	  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	    {
+	      fprintf(stderr, "Branch %d failed.\n", running[k]);
+	      r->size = 0;
+	    }
+	  running[k] = running[--n_running];
+	}
+    }
+
+  write_results(runs, n_runs, results_file);
+
+  for (i = 0; i < n_runs; i++)
+    free(runs[i].data);
+  free(runs);
+  free(fds);
+  free(running);
+
+  sim_set_threads(n_threads);
+  return -1;
+}
+
+/* In a branch whose time is up: send the end state to the process that
+ * branched, and exit.
+ */
+void branch_finish(void)
+{
+  struct sim_branch *b = sim->branch;
+
+  json_t *root = json_rep_all_bots(allbots, sim->n_bots, kilo_ticks);
+  json_object_set_new(root, "branch", json_integer(b->index));
+  json_object_set_new(root, "seed", json_integer(rng_seed));
+  char *text = json_dumps(root, JSON_COMPACT | JSON_SORT_KEYS);
+  int err = !text || write_all(b->fd, text, strlen(text));
+  free(text);
+  json_decref(root);
+  close(b->fd);
+
+  snapshot_writer_stop();
+  event_log_stop();
+  fflush(stdout);
+  exit(err);
+}
+
+// the number of the branch running in this process, -1 if none
+int branch_index(void)
+{
+  return sim && sim->branch ? sim->branch->index : -1;
+}
@@ -0,0 +1,18 @@
+/* Ensembles of runs branching from one simulation state, each in a process
+ * of its own. See ensemble.c.
+ */
+
+#ifndef ENSEMBLE_H
+#define ENSEMBLE_H
+
+#include "sim.h"
+
+// returned by sim_branch() if the simulation can not be branched
+#define BRANCH_ERROR -2
+
+int branch_possible(const simulation_params *p);
+int sim_branch(sim_t *s, int n_runs, int n_parallel, const char *results_file);
+void branch_finish(void);
+int branch_index(void);
+
+#endif
@@ -0,0 +1,142 @@
+/* The event log, see eventlog.h.
+ *
+ * Each worker thread appends to a buffer of its own, indexed by
+ * pool_worker, so the bots never wait for each other. The main thread
+ * empties the buffers between steps, when no bot runs. A bot's events all
+ * carry a number of their own, so sorting puts them in the order in which
+ * the bot reported them, whichever threads ran it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "skilobot.h"
+#include "sim.h"
+#include "eventlog.h"
+
+typedef struct {
+  sim_event_record *events;
+  int n, size;
+} __attribute__((aligned(64))) event_buffer;  // one cache line each
+
+struct event_log {
+  FILE *out;
+  event_buffer buffers[POOL_MAX_THREADS];
+  sim_event_record *merged;  // the events of a step, sorted
+  int merged_size;
+  uint32_t n_global;         // events outside of the bots' code so far
+};
+
+/* Start logging the events of the current simulation to filename. */
+void event_log_start(const char *filename)
+{
+  event_log_header h;
+  struct event_log *l;
+  FILE *out = fopen(filename, "wb");
+
+  if (!out)
+    {
+      fprintf(stderr, "Could not open the event file %s\n", filename);
+      return;
+    }
+  memcpy(h.magic, EVENT_LOG_MAGIC, 8);
+  h.version = EVENT_LOG_VERSION;
+  h.record_size = sizeof(sim_event_record);
+  h.byte_order = EVENT_LOG_BYTE_ORDER;
+  h.reserved = 0;
+  fwrite(&h, sizeof(h), 1, out);
+
+  l = (struct event_log *) calloc(1, sizeof(struct event_log));
+  l->out = out;
+  sim->events = l;
+}
+
+// called by bots, in any thread
+void sim_event(int type, int a, int b)
+{
+  struct event_log *l = sim->events;
+  kilobot *bot = current_bot;
+
+  if (!l)
+    return;
+
+  event_buffer *buf = &l->buffers[pool_worker];
+  if (buf->n == buf->size)
+    {
+      buf->size = buf->size ? 2 * buf->size : 256;
+      buf->events = (sim_event_record *) realloc(buf->events, sizeof(sim_event_record) * buf->size);
+    }
+
+  sim_event_record *e = &buf->events[buf->n++];
+  e->ticks = kilo_ticks;
+  e->id = bot ? bot->ID : -1;
+  e->seq = bot ? bot->n_events++ : l->n_global++;
+  e->type = type;
+  e->a = a;
+  e->b = b;
+}
+
+static int compare_events(const void *p, const void *q)
+{
+  const sim_event_record *a = (const sim_event_record *) p;
+  const sim_event_record *b = (const sim_event_record *) q;
+
+  if (a->ticks != b->ticks)
+    return a->ticks < b->ticks ? -1 : 1;
+  if (a->id != b->id)
+    return a->id < b->id ? -1 : 1;
+  return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+/* Write the events reported since the last call, between steps. */
+void event_log_flush(void)
+{
+  struct event_log *l = sim->events;
+  int n = 0, w;
+
+  if (!l)
+    return;
+
+  for (w = 0; w < POOL_MAX_THREADS; w++)
+    n += l->buffers[w].n;
+  if (n == 0)
+    return;
+
+  if (n > l->merged_size)
+    {
+      l->merged_size = n;
+      l->merged = (sim_event_record *) realloc(l->merged, sizeof(sim_event_record) * n);
+    }
+  n = 0;
+  for (w = 0; w < POOL_MAX_THREADS; w++)
+    {
+      event_buffer *buf = &l->buffers[w];
+      if (buf->n == 0)
+	continue;
+      memcpy(l->merged + n, buf->events, sizeof(sim_event_record) * buf->n);
+      n += buf->n;
+      buf->n = 0;
+    }
+
+  qsort(l->merged, n, sizeof(sim_event_record), compare_events);
+  fwrite(l->merged, sizeof(sim_event_record), n, l->out);
+}
+
+/* Write the remaining events and close the event file. */
+void event_log_stop(void)
+{
+  struct event_log *l = sim->events;
+
+  if (!l)
+    return;
+  event_log_flush();
+  if (fclose(l->out))
+    fprintf(stderr, "Error writing the event file\n");
+
+  for (int w = 0; w < POOL_MAX_THREADS; w++)
+    free(l->buffers[w].events);
+  free(l->merged);
+  free(l);
+  sim->events = NULL;
+}
@@ -0,0 +1,50 @@
+/* A log of discrete events reported by the bots.
+ *
+ * Bot code calls sim_event(type, a, b), see kilolib.h, when something
+ * worth measuring happens: a change of state, a leader elected, a token
+ * passed. type, a and b mean whatever the bot program wants. The event is
+ * appended to a buffer of the calling thread, tagged with the ticks and the
+ * bot's ID, so reporting costs a few stores and needs no lock. At the end
+ * of each step the buffers are merged, sorted by ticks, bot ID and the
+ * order of the bot's events, and appended to the file set by the
+ * eventFileName parameter. Without it, sim_event() does nothing. On the
+ * real robot, sim_event() compiles to nothing.
+ *
+ * The file is a header, "KILOEVNT", version, record size and byte order
+ * mark, followed by one sim_event_record per event. Numbers are stored in
+ * the byte order of the machine that wrote the file; a reader finds
+ * EVENT_LOG_BYTE_ORDER in the header if its byte order is the same.
+ *
+ * Each simulation has a log of its own; the functions work on the current
+ * simulation.
+ */
+
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+#include <stdint.h>
+
+#define EVENT_LOG_MAGIC "KILOEVNT"
+#define EVENT_LOG_VERSION 2  // 2 added the byte order mark
+#define EVENT_LOG_BYTE_ORDER 0x01020304u
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;  // sizeof(sim_event_record)
+  uint32_t byte_order;   // EVENT_LOG_BYTE_ORDER, as the writer stored it
+  uint32_t reserved;
+} event_log_header;
+
+typedef struct {
+  uint32_t ticks;
+  int32_t id;    // the bot's ID, -1 for events outside of the bots' code
+  uint32_t seq;  // the number of the event among those of the bot
+  int32_t type, a, b;
+} sim_event_record;
+
+void event_log_start(const char *filename);
+void event_log_flush(void);
+void event_log_stop(void);
+
+#endif
@@ -0,0 +1,394 @@
+/* Threaded GUI, see gui.h.
+ *
+ * Frames are passed from the simulation to the GUI thread with three
+ * buffers: the simulation fills one, one holds the latest complete frame,
+ * and the GUI draws from the third. Publishing and picking up a frame only
+ * swap buffer indices, so the simulation never waits for drawing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "kilolib.h"
+#undef main   // to avoid warning when SDL redefines main
+
+#include <SDL/SDL.h>
+#include "gfx/SDL_framerate.h"
+#include "skilobot.h"
+#include "params.h"
+#include "sim.h"
+#include "display.h"
+#include "gui.h"
+
+extern void (*callback_F5) (void) ; // function pointer to user-defined callback function for F5 press
+extern void (*callback_F6) (void) ; // function pointer to user-defined callback function for F6 press
+                                    // run for *ALL* bots in sequence, used for reset
+extern char* (*callback_botinfo) (void) ; // function pointer to user-defined callback function for bot info
+
+typedef struct {
+  int n_bots, capacity;
+  kilobot *bots;       // copies of the bots ...
+  kilobot **bot_ptrs;  // ... and pointers to them
+  double *history;     // copies of the bots' history buffers
+  size_t history_size;
+  double *lines;       // communication lines, x1 y1 x2 y2
+  int n_lines, lines_size;
+  double time;
+  int ticks;
+  int stepsPerFrame;
+  char botinfo[500];
+  char video_file[256];  // if not empty, save the frame to this file
+} gui_frame;
+
+static gui_frame frames[3];
+static int frame_fill = 0, frame_ready = 1, frame_show = 2;
+static int frame_new = 0;    // frame_ready holds a frame not yet shown
+static int want_frame = 1;   // the GUI thread has taken the last frame
+static int video_pending = 0;
+static int sim_done = 0;
+
+// what the GUI shows, for the simulation thread
+static double view_x0, view_y0, view_x1, view_y1;
+static int hover = -1;  // ID of the bot under the mouse, or -1
+
+static pthread_mutex_t gui_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t video_cond = PTHREAD_COND_INITIALIZER;
+
+#define GUI_MAX_EDITS 256
+typedef struct {
+  int type, id;
+  double x, y;
+} gui_edit;
+
+static gui_edit edits[GUI_MAX_EDITS];
+static int n_edits = 0;
+
+
+void gui_push_edit(int type, int id, double x, double y)
+{
+  pthread_mutex_lock(&gui_lock);
+  if (n_edits < GUI_MAX_EDITS)
+    {
+      gui_edit e = {type, id, x, y};
+      edits[n_edits++] = e;
+    }
+  pthread_mutex_unlock(&gui_lock);
+}
+
+/* The bot with the given ID, NULL if there is none. The GUI refers to bots
+ * by ID, since IDs loaded from a file need not match the bots' indices.
+ */
+static kilobot *bot_with_id(int id)
+{
+  for (int i = 0; i < sim->n_bots; i++)
+    if (allbots[i]->ID == id)
+      return allbots[i];
+  return NULL;
+}
+
+/* Apply the edits queued by the GUI. Called between time steps. */
+void gui_apply_edits(void)
+{
+  static int save_tx_period_ticks = 1;
+  gui_edit todo[GUI_MAX_EDITS];
+  int n, i;
+
+  pthread_mutex_lock(&gui_lock);
+  n = n_edits;
+  memcpy(todo, edits, sizeof(gui_edit) * n);
+  n_edits = 0;
+  pthread_mutex_unlock(&gui_lock);
+
+  for (i = 0; i < n; i++)
+    {
+      gui_edit *e = &todo[i];
+      kilobot *bot;
+      switch (e->type)
+	{
+	case EDIT_MOVE:
+	  if ((bot = bot_with_id(e->id)))
+	    {
+	      bot->x = e->x;
+	      bot->y = e->y;
+	    }
+	  break;
+	case EDIT_ROTATE:
+	  if ((bot = bot_with_id(e->id)))
+	    bot->direction = e->x;
+	  break;
+	case EDIT_SPREAD:
+	  spread_out(sim->n_bots, e->x);
+	  if (e->y)
+	    update_interactions(sim->n_bots);
+	  break;
+	case EDIT_F5:
+	  if (callback_F5)
+	    callback_F5();
+	  break;
+	case EDIT_F6:
+	  if (callback_F6)
+	    for (int j = 0; j < sim->n_bots; j++)
+	      {
+		prepare_bot(allbots[j]);
+		callback_F6();
+	      }
+	  leave_bot();
+	  break;
+	case EDIT_PAUSE:
+	  state = state == RUNNING ? PAUSE : RUNNING;
+	  break;
+	case EDIT_VIDEO:
+	  simparams->saveVideo = !simparams->saveVideo;
+	  break;
+	case EDIT_FULL_SPEED:
+	  fullSpeed = !fullSpeed;
+	  break;
+	case EDIT_FAST_COMM:
+	  if (tx_period_ticks > 1)
+	    {
+	      save_tx_period_ticks = tx_period_ticks;
+	      tx_period_ticks = 1;
+	    }
+	  else
+	    tx_period_ticks = save_tx_period_ticks;
+	  break;
+	case EDIT_STEPS:
+	  simparams->stepsPerFrame += e->id;
+	  if (simparams->stepsPerFrame < 0)
+	    simparams->stepsPerFrame = 0;
+	  break;
+	case EDIT_QUIT:
+	  quit = 1;
+	  break;
+	}
+    }
+}
+
+int gui_frame_wanted(void)
+{
+  return __atomic_load_n(&want_frame, __ATOMIC_RELAXED);
+}
+
+// copy the current state of the simulation into f
+static void fill_frame(gui_frame *f, double time, int hover_id)
+{
+  int i;
+
+  if (sim->n_bots > f->capacity)
+    {
+      f->capacity = sim->n_bots;
+      f->bots = (kilobot *) realloc(f->bots, sizeof(kilobot) * sim->n_bots);
+      f->bot_ptrs = (kilobot **) realloc(f->bot_ptrs, sizeof(kilobot *) * sim->n_bots);
+    }
+  f->n_bots = sim->n_bots;
+  for (i = 0; i < sim->n_bots; i++)
+    {
+      f->bots[i] = *allbots[i];
+      f->bot_ptrs[i] = &f->bots[i];
+    }
+
+  if (simparams->showHist)
+    {
+      size_t size = 0;
+      for (i = 0; i < sim->n_bots; i++)
+	size += 2 * allbots[i]->n_hist;
+      if (size > f->history_size)
+	{
+	  f->history_size = size;
+	  f->history = (double *) realloc(f->history, sizeof(double) * size);
+	}
+
+      double *h = f->history;
+      for (i = 0; i < sim->n_bots; i++)
+	{
+	  int n = allbots[i]->n_hist;
+	  memcpy(h, allbots[i]->x_history, sizeof(double) * n);
+	  memcpy(h + n, allbots[i]->y_history, sizeof(double) * n);
+	  f->bots[i].x_history = h;
+	  f->bots[i].y_history = h + n;
+	  h += 2 * n;
+	}
+    }
+
+  f->n_lines = 0;
+  if (simparams->showComms)
+    {
+      if (commLines.count > f->lines_size)
+	{
+	  f->lines_size = commLines.capacity;
+	  f->lines = (double *) realloc(f->lines, sizeof(double) * 4 * f->lines_size);
+	}
+      for (i = 0; i < commLines.count; i++)
+	{
+	  CommLine *line = getCommLine(i);
+	  f->lines[4*i]   = line->from->x;
+	  f->lines[4*i+1] = line->from->y;
+	  f->lines[4*i+2] = line->to->x;
+	  f->lines[4*i+3] = line->to->y;
+	}
+      f->n_lines = commLines.count;
+    }
+
+  f->time = time;
+  f->ticks = kilo_ticks;
+  f->stepsPerFrame = simparams->stepsPerFrame;
+
+  f->botinfo[0] = 0;
+  kilobot *hover_bot = hover_id >= 0 && callback_botinfo ? bot_with_id(hover_id) : NULL;
+  if (hover_bot)
+    {
+      prepare_bot(hover_bot);
+      snprintf(f->botinfo, sizeof(f->botinfo), "%s", callback_botinfo());
+      leave_bot();
+    }
+}
+
+/* Publish the current state for drawing. If video_file is given, wait
+ * until the GUI thread has drawn the frame and saved it to that file.
+ */
+void gui_publish(double time, const char *video_file)
+{
+  double x0, y0, x1, y1;
+  int hover_id;
+  gui_frame *f;
+
+  pthread_mutex_lock(&gui_lock);
+  x0 = view_x0;
+  y0 = view_y0;
+  x1 = view_x1;
+  y1 = view_y1;
+  hover_id = hover;
+  f = &frames[frame_fill];
+  pthread_mutex_unlock(&gui_lock);
+
+  setCommLineViewport(x0, y0, x1, y1);
+  fill_frame(f, time, hover_id);
+  snprintf(f->video_file, sizeof(f->video_file), "%s", video_file ? video_file : "");
+
+  pthread_mutex_lock(&gui_lock);
+  int t = frame_fill;
+  frame_fill = frame_ready;
+  frame_ready = t;
+  frame_new = 1;
+  __atomic_store_n(&want_frame, 0, __ATOMIC_RELAXED);
+  if (video_file)
+    {
+      video_pending = 1;
+      while (video_pending)
+	pthread_cond_wait(&video_cond, &gui_lock);
+    }
+  pthread_mutex_unlock(&gui_lock);
+}
+
+static void draw_frame(gui_frame *f)
+{
+  int i;
+
+  SDL_FillRect(screen, NULL, colorscheme->background);
+
+  for (i = 0; i < f->n_bots; i++)
+    draw_bot_history_ring(screen, simparams->display_w, simparams->display_h, &f->bots[i]);
+
+  for (i = 0; i < f->n_lines; i++)
+    draw_comm_line(screen, f->lines[4*i], f->lines[4*i+1], f->lines[4*i+2], f->lines[4*i+3]);
+
+  for (i = 0; i < f->n_bots; i++)
+    draw_bot(screen, simparams->display_w, simparams->display_h, &f->bots[i]);
+
+  shown_bots = f->bot_ptrs;
+  n_shown = f->n_bots;
+}
+
+typedef struct {
+  void *(*simulate)(void *);
+  sim_t *sim;
+} sim_thread_arg;
+
+static void *run_simulation(void *arg)
+{
+  sim = ((sim_thread_arg *) arg)->sim;
+  ((sim_thread_arg *) arg)->simulate(NULL);
+  __atomic_store_n(&sim_done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/* The GUI loop, on the main thread: start the current simulation in its
+ * own thread, and draw the frames it publishes until it finishes.
+ */
+void gui_run(void *(*simulate)(void *))
+{
+  sim_thread_arg arg = {simulate, sim};
+  pthread_t sim_thread;
+  FPSmanager manager;
+  Uint32 lastTicks = SDL_GetTicks();
+  double frameTimeAvg = 0;
+  int x, y;
+
+  SDL_initFramerate(&manager);
+  SDL_setFramerate(&manager, 1.0 / simparams->timeStep);
+
+  visible_area(&view_x0, &view_y0, &view_x1, &view_y1);
+  if (pthread_create(&sim_thread, NULL, run_simulation, &arg))
+    {
+      fprintf(stderr, "Could not start the simulation thread.\n");
+      exit(1);
+    }
+
+  while (!__atomic_load_n(&sim_done, __ATOMIC_ACQUIRE))
+    {
+      input();
+
+      pthread_mutex_lock(&gui_lock);
+      int got = frame_new;
+      if (frame_new)
+	{
+	  int t = frame_show;
+	  frame_show = frame_ready;
+	  frame_ready = t;
+	  frame_new = 0;
+	}
+      pthread_mutex_unlock(&gui_lock);
+
+      gui_frame *f = &frames[frame_show];
+      draw_frame(f);
+
+      if (got && f->video_file[0])
+	{
+	  if (SDL_SaveBMP(screen, f->video_file))
+	    {
+	      fprintf(stderr, "Error saving video frame to file %s\n", f->video_file);
+	      exit(1);
+	    }
+	  pthread_mutex_lock(&gui_lock);
+	  video_pending = 0;
+	  pthread_cond_signal(&video_cond);
+	  pthread_mutex_unlock(&gui_lock);
+	}
+
+      // Draw status message on screen but not in video
+      draw_status(screen, simparams->display_w, simparams->display_h, f->time, f->ticks,
+		  f->stepsPerFrame, 1000.0/frameTimeAvg, f->botinfo);
+      SDL_Flip(screen);
+
+      // tell the simulation what is visible, and ask for the next frame
+      SDL_GetMouseState(&x, &y);
+      int i = find_bot_index(x, y);
+      pthread_mutex_lock(&gui_lock);
+      visible_area(&view_x0, &view_y0, &view_x1, &view_y1);
+      hover = i >= 0 ? shown_bots[i]->ID : -1;
+      __atomic_store_n(&want_frame, 1, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&gui_lock);
+
+      SDL_framerateDelay(&manager);
+
+      // rolling average of the time per frame, just for display
+      Uint32 t = SDL_GetTicks();
+      double w = .02;
+      frameTimeAvg = (1-w) * frameTimeAvg + w*(t-lastTicks);
+      lastTicks = t;
+    }
+
+  pthread_join(sim_thread, NULL);
+}
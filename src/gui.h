@@ -0,0 +1,38 @@
+/* Threaded GUI.
+ *
+ * With the GUI enabled, the simulation runs in its own thread, while the
+ * main thread - which owns the SDL window, as SDL requires - handles input
+ * and draws the most recent frame published by the simulation. Neither
+ * waits for the other, except when a video frame is saved.
+ *
+ * Edits made with the mouse and keyboard are queued by the GUI thread and
+ * applied by the simulation thread between time steps.
+ */
+
+#ifndef GUI_H
+#define GUI_H
+
+enum {
+  EDIT_MOVE,        // move bot id to (x, y)
+  EDIT_ROTATE,      // set the direction of bot id to x
+  EDIT_SPREAD,      // spread_out() with strength x, update interactions if y
+  EDIT_F5,          // call the user's F5 callback
+  EDIT_F6,          // call the user's F6 callback for every bot
+  EDIT_PAUSE,       // toggle pause
+  EDIT_VIDEO,       // toggle saving video
+  EDIT_FULL_SPEED,  // toggle running without delay
+  EDIT_FAST_COMM,   // toggle fast communication
+  EDIT_STEPS,       // change stepsPerFrame by id
+  EDIT_QUIT,
+};
+
+// GUI thread
+void gui_push_edit(int type, int id, double x, double y);
+void gui_run(void *(*simulate)(void *));
+
+// simulation thread
+void gui_apply_edits(void);
+int gui_frame_wanted(void);
+void gui_publish(double time, const char *video_file);
+
+#endif
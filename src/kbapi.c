@@ -1,27 +1,26 @@
 #include <math.h>
+#include <pthread.h>
 #include "skilobot.h"
 #include "kilolib.h"
+#include "coro.h"
+#include "rng.h"
+#include "sim.h"
 
-/* pointers to messaging functions 
- * the kilobot program typically sets these in main()
- *
- * for simplicity we have only ONE set of these instead of
- * one for each bot. If all bots register the same functions, 
- * this will work.
+/* The context of the bot currently running on this thread.
+ * It holds the bot's UID and pointers to its messaging functions, which
+ * the kilobot program typically sets in main().
+ * When no bot is running, it points to a dummy context.
  */
-message_tx_t kilo_message_tx = NULL;
-message_tx_success_t kilo_message_tx_success = NULL;
-message_rx_t kilo_message_rx = NULL;
+static volatile uint32_t no_bot_ticks = 0;
+static kilo_context_t no_bot_context = {.ticks = &no_bot_ticks};
+__thread kilo_context_t *kilo_ctx = &no_bot_context;
 
+// point the thread's context back to the dummy one, once no bot runs
+void leave_bot(void)
+{
+  kilo_ctx = &no_bot_context;
+}
 
-/* the clock variable. Counts ticks since beginning of the program.
- * Each bot really has it's own, but for now we have just one.
- * Declared volatile to match declaration in kilolib.h
- */
-volatile uint32_t kilo_ticks = 0;
-
-// the simulator will copy a new UID here, before calling each bot
-uint16_t kilo_uid = 0;
 
 /* motor calibration values 
  * In the kilobots, these are different for each robot, and are stored in the EEPROM.
@@ -97,39 +96,100 @@ uint8_t estimate_distance(const distance_measurement_t *d)
   return d->high_gain;
 }
 
-// checksum for messages 
+/* Checksum for messages, identical to message_crc() in kilolib.
+ * kilolib runs avr-libc's _crc_ccitt_update() (reflected CCITT polynomial
+ * 0x8408, initial value 0xffff) over the payload and type bytes. We compute
+ * the same CRC with slice-by-8 tables, so the 10 message bytes take one
+ * 8-byte step and two single-byte steps.
+ */
+#define CRC_POLY 0x8408
+static uint16_t crc_table[8][256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void make_crc_table(void)
+{
+  int i, j, k;
+
+  for (i = 0; i < 256; i++)
+    {
+      uint16_t crc = i;
+      for (j = 0; j < 8; j++)
+	crc = (crc & 1) ? (crc >> 1) ^ CRC_POLY : crc >> 1;
+      crc_table[0][i] = crc;
+    }
+
+  for (i = 0; i < 256; i++)
+    for (k = 1; k < 8; k++)
+      crc_table[k][i] = (crc_table[k-1][i] >> 8) ^ crc_table[0][crc_table[k-1][i] & 0xFF];
+}
+
+// simulations in several threads may start at the same time
+void message_crc_init(void)
+{
+  pthread_once(&crc_table_once, make_crc_table);
+}
+
 uint16_t message_crc(const message_t *msg)
 {
-  return 0; 
-  /* if we never check it we don't need to implement it.
-   * otherwise copy from kilolib, message_crc.c and
-   * the crc functions from util/crc16.h 
-   */
+  const uint8_t *p = (const uint8_t *) msg;
+  uint16_t crc = 0xFFFF;
+
+  message_crc_init();
+
+  // data[0..7] in one slice-by-8 step
+  crc = crc_table[7][(p[0] ^ crc) & 0xFF] ^
+        crc_table[6][(p[1] ^ (crc >> 8)) & 0xFF] ^
+        crc_table[5][p[2]] ^
+        crc_table[4][p[3]] ^
+        crc_table[3][p[4]] ^
+        crc_table[2][p[5]] ^
+        crc_table[1][p[6]] ^
+        crc_table[0][p[7]];
+
+  // data[8] and type
+  crc = (crc >> 8) ^ crc_table[0][(crc ^ p[8]) & 0xFF];
+  crc = (crc >> 8) ^ crc_table[0][(crc ^ p[9]) & 0xFF];
+
+  return crc;
 }
 
 
-/* delay is tricky to implement in the simulator
- * do as much as possible using the kilo_ticks variable instead 
+/* The bot's loop() runs on a coroutine, see run_all_bots(). delay() parks
+ * the bot there until kilo_ticks has advanced by the given time, rounded up
+ * to whole ticks, while the simulation and the bot's message callbacks go on.
+ * Outside loop(), or with botStackSize = 0, delay returns at once.
  */
 void _delay_ms(int ms)
 {
-  /* TODO - implementation! */
-  return;
+  kilobot *self = Me();
+
+  if (ms <= 0 || !coro_current())
+    return;
+  self->wake_tick = kilo_ticks + (ms * TICKS_PER_SEC + 999) / 1000;
+  coro_yield();
 }
 
 // the kilobot API version of delay
 void delay (uint16_t ms) 	
 {
-  return;
+  _delay_ms(ms);
 }
 
 /* Hardware random number generator - "truly random" in the bot.
- * In the simulator, we use rand(), with the SAME generator shared by all bots
- * and shared by the simulator itself, if it uses rand somewhere internally.
+ * In the simulator, each call takes a number from the counter-based
+ * generator, keyed by the seed and the bot's ID and counted by the tick and
+ * the number of calls so far, so the bots' draws do not depend on each other
+ * or on the order the bots are run in.
  */
 uint8_t rand_hard()
 {
-  return rand() & 0xFF;
+  kilobot* self = Me();
+  uint32_t key[2] = {rng_seed, self->ID};
+  uint32_t ctr[4] = {kilo_ticks, self->hard_draws++, RNG_HARD, 0};
+  uint32_t out[4];
+
+  philox4x32(ctr, key, out);
+  return out[0] & 0xFF;
 }
 
 /* Software random number generator.
@@ -75,6 +75,14 @@ void set_callback_lighting(int16_t (*fp)(double, double));
 
 #define SET_CALLBACK(ID, CALLBACK) set_callback_ ## ID (CALLBACK)
 
+// write the state of the swarm to the state file at the end of this step,
+// for states triggered by events
+void request_snapshot(void);
+
+// report an event to the event log, see eventlog.h; type, a and b are up to
+// the bot program, e.g. a change of state and the old and new state
+void sim_event(int type, int a, int b);
+
 // measure a fictive potential in the environment, for testing
 enum {POT_LINEAR, POT_PARABOLIC, POT_GRAVITY};
 float get_potential(int type);
@@ -106,6 +114,26 @@ typedef void (*message_rx_t)(message_t *, distance_measurement_t *d);
 typedef message_t *(*message_tx_t)(void);
 typedef void (*message_tx_success_t)(void);
 
+/* Simulator specific: the per-bot part of the kilolib state.
+ *
+ * The simulator keeps one context for each bot, and points kilo_ctx at the
+ * context of the bot it is currently running. kilo_ctx is thread-local, so
+ * several threads can run bots at the same time. The kilolib variables
+ * kilo_uid, kilo_message_rx, kilo_message_tx and kilo_message_tx_success are
+ * macros referring to the current context, and can be read and assigned
+ * as in kilolib. kilo_ticks refers to the clock of the bot's simulation.
+ */
+typedef struct {
+  uint16_t uid;
+  volatile uint32_t *ticks;  // the clock of the simulation the bot is in
+  message_rx_t message_rx;
+  message_tx_t message_tx;
+  message_tx_success_t message_tx_success;
+  void *bot;  // the simulator's kilobot struct for this bot
+} kilo_context_t;
+
+extern __thread kilo_context_t *kilo_ctx;
+
 /**
  * @brief Kilobot clock variable.
  *
@@ -139,7 +167,7 @@ typedef void (*message_tx_success_t)(void);
  * @endcode
  */
 
-extern volatile uint32_t kilo_ticks;
+#define kilo_ticks (*kilo_ctx->ticks)
 extern volatile uint16_t kilo_tx_period;
 /**
  * @brief Kilobot unique identifier.
@@ -147,7 +175,7 @@ extern volatile uint16_t kilo_tx_period;
  * This variable holds a 16-bit positive integer which is designated as
  * the kilobot's unique identifier during calibration.
  */
-extern uint16_t kilo_uid;
+#define kilo_uid (kilo_ctx->uid)
 /**
  * @brief Calibrated turn left duty-cycle.
  *
@@ -230,7 +258,7 @@ extern uint8_t kilo_straight_right;
  * @note You must register a message callback before calling kilo_start.
  * @see message_t, message_crc, kilo_message_tx, kilo_message_tx_success
  */
-extern message_rx_t kilo_message_rx;
+#define kilo_message_rx (kilo_ctx->message_rx)
 /**
  * @brief Callback for message transmission.
  *
@@ -287,7 +315,7 @@ extern message_rx_t kilo_message_rx;
  *
  * @see message_t, message_crc, kilo_message_tx, kilo_message_tx_success
  */
-extern message_tx_t kilo_message_tx;
+#define kilo_message_tx (kilo_ctx->message_tx)
 
 /**
  * @brief Callback for successful message transmission.
@@ -303,7 +331,7 @@ extern message_tx_t kilo_message_tx;
  *
  * @see message_t, message_crc, kilo_message_tx, kilo_message_tx_success
  */
-extern message_tx_success_t kilo_message_tx_success;
+#define kilo_message_tx_success (kilo_ctx->message_tx_success)
 
 #ifdef __cplusplus /* If this is a C++ compiler, use C linkage */
 extern "C" {
@@ -18,14 +18,41 @@
 
 #ifdef SIMULATOR 
 
+#include <stddef.h>
 #include "kilombo/params.h"
+#include "kilombo/trajectory.h"
 
 // fill in the size of the USERDATA structure,
 // used by the simulator to allocate space for it.
+// mydata is thread-local, since the simulator may run bots in several threads.
 
 #define REGISTER_USERDATA(UDT) 		\
 	int UserdataSize = sizeof(UDT); \
-	UDT *mydata;
+	__thread UDT *mydata;
+
+// declaration of mydata for other files of the program
+
+#define EXTERN_USERDATA(UDT) 		\
+	extern __thread UDT *mydata;
+
+// describe the fields of the USERDATA structure, stored with the raw
+// USERDATA in binary state files so that it can be decoded later:
+//   USERDATA_LAYOUT(USERDATA,
+//                   USERDATA_FIELD(gradient_value, KTR_FIELD_UINT16),
+//                   USERDATA_FIELD(neighbors, KTR_FIELD_UINT8))
+// an array field holds all its elements.
+
+void set_userdata_layout(const ktr_field *fields);
+
+#define USERDATA_LAYOUT(UDT, ...)					\
+	typedef UDT userdata_layout_type;				\
+	static const ktr_field userdata_layout[] = {__VA_ARGS__, {NULL, 0, 0, 0}}; \
+	__attribute__((constructor)) static void register_userdata_layout(void) \
+	{ set_userdata_layout(userdata_layout); }
+
+#define USERDATA_FIELD(FIELD, TYPE)					\
+	{#FIELD, TYPE, offsetof(userdata_layout_type, FIELD),		\
+	 sizeof(((userdata_layout_type *) 0)->FIELD)}
 
 #else // compiling for the real kilobot
 
@@ -36,8 +63,16 @@
 	UDT myuserdata;                 \
 	UDT *mydata = &myuserdata; 
 
+#define EXTERN_USERDATA(UDT) 		\
+	extern UDT *mydata;
+
 #define SET_CALLBACK(ID, CALLBACK)
 
+#define USERDATA_LAYOUT(UDT, ...)
+
+#define request_snapshot()
+#define sim_event(type, a, b)
+
 #endif	// SIMULATOR
 
 
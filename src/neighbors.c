@@ -10,13 +10,42 @@
 #include"skilobot.h"
 #include"cd_matrix.h"
 #include "neighbors.h"
+#include "params.h"
+#include "sim.h"
 
-pv_matrix grid_cache;
-coord2D gc_offset = {0, 0};
-coord2D gc_cell_sz = {100, 100};
+// the grid of one simulation, sim->grid
+struct neighbor_grid {
+  pv_matrix cache;
+  coord2D offset;
+  coord2D cell_sz;
 
-// initialized in update_all_bots before movement
-coord2D max_coord, min_coord;
+  // initialized in update_all_bots before movement
+  coord2D max_coord, min_coord;
+};
+
+#define grid_cache (sim->grid->cache)
+#define gc_offset  (sim->grid->offset)
+#define gc_cell_sz (sim->grid->cell_sz)
+#define max_coord  (sim->grid->max_coord)
+#define min_coord  (sim->grid->min_coord)
+
+static void new_grid_cache(void)
+{
+  sim->grid = (struct neighbor_grid *) calloc(1, sizeof(struct neighbor_grid));
+  gc_cell_sz.x = 100;
+  gc_cell_sz.y = 100;
+}
+
+void free_grid_cache(void)
+{
+  if (!sim->grid)
+    return;
+  for (size_t i = 0; i < grid_cache.x_size * grid_cache.y_size; i++)
+    free(grid_cache.data[i].data);
+  free(grid_cache.data);
+  free(sim->grid);
+  sim->grid = NULL;
+}
 
 size_t bot2gc_x(double x)
 {
@@ -110,6 +139,9 @@ int check_bots_in_bounds(int n_bots)
  */
 void update_interactions_grid (int n_bots)
 {
+  if (!sim->grid)
+    new_grid_cache();
+
   if (user_obstacles != NULL) {
     double push_x, push_y;
 
@@ -179,15 +211,17 @@ void update_interactions_grid (int n_bots)
 	       kilobot * other = cell->data[b];
 	       assert(other != NULL);
 	       
-	       // only process each pair once and don't pair with self
-	       if (other <= cur)
+	       // only process each pair once and don't pair with self,
+	       // in the order of allbots rather than of the bots' addresses,
+	       // which differ from run to run
+	       if (other->index <= cur->index)
 		 continue;
 	       
 	       double sq_bd = bot_sq_dist(cur, other);
 	       if (sq_bd < sq_cr) {
 		 //if (i == 0) printf("%d and %d in range\n", i, j);
-		 cur->in_range[cur->n_in_range++] = other->ID;  // ugly conversion back to index
-		 other->in_range[other->n_in_range++] = cur->ID;
+		 add_in_range(cur, other->index);
+		 add_in_range(other, cur->index);
 	       }
 	     }
 	 }
@@ -219,3 +253,136 @@ void update_interactions_grid (int n_bots)
      }
 	   
 }
+
+
+/* Line-of-sight occlusion.
+ *
+ * A message is occluded by every bot whose body intersects the straight line
+ * from the transmitter to the receiver. The candidate bots are found by
+ * walking the grid cells crossed by the line, and by the two lines offset
+ * one bot radius to each side of it, so the cost is proportional to the
+ * number of cells crossed, not to the number of bots.
+ *
+ * The grid is the one built by update_interactions_grid() in this time step.
+ * Bots moved across a cell border by collision resolution after that may be
+ * missed, which is a negligible error.
+ */
+
+#define MAX_LOS_CELLS 32
+
+// Add the cells crossed by the line (x0,y0)-(x1,y1) to cells[], skipping
+// duplicates. Grid traversal as in Amanatides & Woo, "A fast voxel traversal
+// algorithm for ray tracing", 1987.
+static int dda_cells(double x0, double y0, double x1, double y1, size_t *cells, int n)
+{
+  double gx0 = (x0 - gc_offset.x) / gc_cell_sz.x;
+  double gy0 = (y0 - gc_offset.y) / gc_cell_sz.y;
+  double gx1 = (x1 - gc_offset.x) / gc_cell_sz.x;
+  double gy1 = (y1 - gc_offset.y) / gc_cell_sz.y;
+  long cx = floor(gx0), cy = floor(gy0);
+  long ex = floor(gx1), ey = floor(gy1);
+  int sx = gx1 > gx0 ? 1 : -1;
+  int sy = gy1 > gy0 ? 1 : -1;
+  double dx = fabs(gx1 - gx0), dy = fabs(gy1 - gy0);
+
+  // parametric distance along the line to the next x and y cell border,
+  // and between borders
+  double t_dx = dx > 0 ? 1 / dx : INFINITY;
+  double t_dy = dy > 0 ? 1 / dy : INFINITY;
+  double t_x = dx > 0 ? (sx > 0 ? cx + 1 - gx0 : gx0 - cx) * t_dx : INFINITY;
+  double t_y = dy > 0 ? (sy > 0 ? cy + 1 - gy0 : gy0 - cy) * t_dy : INFINITY;
+
+  for (;;)
+    {
+      if (cx >= 0 && cx < (long) grid_cache.x_size &&
+	  cy >= 0 && cy < (long) grid_cache.y_size && n < MAX_LOS_CELLS)
+	{
+	  size_t c = matrix_c2i(&grid_cache, cx, cy);
+	  int k;
+	  for (k = 0; k < n && cells[k] != c; k++)
+	    ;
+	  if (k == n)
+	    cells[n++] = c;
+	}
+
+      if ((cx == ex && cy == ey) || (t_x > 1 && t_y > 1))
+	break;
+
+      if (t_x < t_y)
+	{
+	  t_x += t_dx;
+	  cx += sx;
+	}
+      else
+	{
+	  t_y += t_dy;
+	  cy += sy;
+	}
+    }
+
+  return n;
+}
+
+// 1 if the body of bot b intersects the line from tx to rx
+static int blocks_line(kilobot *b, kilobot *tx, kilobot *rx)
+{
+  double dx = rx->x - tx->x;
+  double dy = rx->y - tx->y;
+  double l_sq = dx * dx + dy * dy;
+  double t = l_sq > 0 ? ((b->x - tx->x) * dx + (b->y - tx->y) * dy) / l_sq : 0;
+
+  if (t < 0)
+    t = 0;
+  if (t > 1)
+    t = 1;
+
+  double px = tx->x + t * dx - b->x;
+  double py = tx->y + t * dy - b->y;
+  return px * px + py * py < b->radius * b->radius;
+}
+
+/* Count the bots, other than tx and rx, that block the line of sight between
+ * tx and rx. Counting stops at max.
+ */
+int count_occluders(kilobot *tx, kilobot *rx, int max)
+{
+  int n = 0;
+
+  if (!simparams->useGrid)
+    {
+      // no grid - any bot in the way is within range of the transmitter
+      for (int i = 0; i < tx->n_in_range && n < max; i++)
+	{
+	  kilobot *b = allbots[tx->in_range[i]];
+	  if (b != rx && blocks_line(b, tx, rx))
+	    n++;
+	}
+      return n;
+    }
+
+  size_t cells[MAX_LOS_CELLS];
+  int n_cells = 0;
+  double dx = rx->x - tx->x;
+  double dy = rx->y - tx->y;
+  double l = hypot(dx, dy);
+  double r = tx->radius;
+  double ox = l > 0 ? -dy / l * r : 0;  // offset of one radius, normal to the line
+  double oy = l > 0 ? dx / l * r : 0;
+
+  n_cells = dda_cells(tx->x, tx->y, rx->x, rx->y, cells, n_cells);
+  n_cells = dda_cells(tx->x + ox, tx->y + oy, rx->x + ox, rx->y + oy, cells, n_cells);
+  n_cells = dda_cells(tx->x - ox, tx->y - oy, rx->x - ox, rx->y - oy, cells, n_cells);
+
+  for (int c = 0; c < n_cells && n < max; c++)
+    {
+      p_vec *cell = &grid_cache.data[cells[c]];
+      for (size_t b = 0; b < cell->size && n < max; b++)
+	{
+	  kilobot *other = cell->data[b];
+	  if (other != tx && other != rx && blocks_line(other, tx, rx))
+	    n++;
+	}
+    }
+
+  return n;
+}
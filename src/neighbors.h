@@ -1,6 +1,8 @@
 #ifndef __NEIGHBORS_H
 #define __NEIGHBORS_H
 void update_interactions_grid (int n_bots);
+void free_grid_cache(void);
+int count_occluders(kilobot *tx, kilobot *rx, int max);
 
 static inline double bot_sq_dist(kilobot *bot1, kilobot *bot2)
 {
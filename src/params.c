@@ -1,13 +1,32 @@
 #include"params.h"
+#include"sim.h"
 
-simulation_params *simparams = NULL;
+// the parameters being read by parse_param_file() in this thread
+static __thread simulation_params *loading = NULL;
 
-void parse_param_file(const char *filename)
+static void read_params(simulation_params *p);
+static void read_state_selection(simulation_params *p);
+
+// the parameters get_*_param() read: those being loaded,
+// or else those of the current simulation
+static simulation_params *current_params(void)
+{
+  if (loading)
+    return loading;
+  return sim ? sim->params : NULL;
+}
+
+/* Read the parameter file. The parameters can be shared by several
+ * simulations, see sim_create(). Returns NULL if the file is not a
+ * parameter object.
+ */
+simulation_params *parse_param_file(const char *filename)
 {
   json_error_t error;
   json_t *root, *data;
+  simulation_params *p;
 
-  simparams = (simulation_params*) malloc(sizeof(simulation_params));
+  p = (simulation_params*) calloc(1, sizeof(simulation_params));
   printf ("Reading simulator parameters from %s\n", filename);
   root = json_load_file(filename, 0, &error);
 
@@ -25,60 +44,173 @@ void parse_param_file(const char *filename)
 
   if (!json_is_object(data)) {
     fprintf(stderr, "error: not an object\n");
-    return;
+    json_decref(root);
+    free(p);
+    return NULL;
   }
 
-  simparams->root = root;
-
+  p->root = root;
+  read_params(p);
+  return p;
+}
 
-  // extract parameter values, place in simparams struct.
+/* Set the parameters in the object changes, keeping the others, and read
+ * the parameter struct again.
+ */
+void update_params(simulation_params *p, json_t *changes)
+{
+  json_object_update(p->root, changes);
+  read_params(p);
+}
 
-  simparams->showComms            = get_int_param   ("showComms",      1);
-  simparams->maxTime              = get_float_param ("simulationTime", 0);
-  simparams->timeStep             = get_float_param ("timeStep",       0.02);
-  simparams->imageName            = get_string_param("imageName",      NULL);
-  simparams->finalImage           = get_string_param("finalImage",     NULL);
-  simparams->storeHistory         = get_int_param   ("storeHistory",   0);
-  simparams->saveVideoN           = get_int_param   ("saveVideoN",     1); // save video screenshot every Nth frame
-  simparams->saveVideo            = get_int_param   ("saveVideo",      0); // whether to save video.
+// extract parameter values, place in the parameter struct.
+static void read_params(simulation_params *p)
+{
+  loading = p;
+
+  p->showComms            = get_int_param   ("showComms",      1);
+  p->maxTime              = get_float_param ("simulationTime", 0);
+  p->timeStep             = get_float_param ("timeStep",       0.02);
+  p->imageName            = get_string_param("imageName",      NULL);
+  p->finalImage           = get_string_param("finalImage",     NULL);
+  p->storeHistory         = get_int_param   ("storeHistory",   0);
+  p->saveVideoN           = get_int_param   ("saveVideoN",     1); // save video screenshot every Nth frame
+  p->saveVideo            = get_int_param   ("saveVideo",      0); // whether to save video.
                                                                       // Toggle with 'v' at runtime
-  simparams->stateFileName        = get_string_param("stateFileName",  NULL);
-  simparams->stateFileSteps       = get_int_param   ("stateFileSteps", 100);
-  simparams->stepsPerFrame        = get_int_param   ("stepsPerFrame",  1);
-  simparams->bot_name             = get_string_param("botName",        "default");
-  simparams->display_w            = get_int_param   ("displayWidth",  -1);
-  simparams->display_h            = get_int_param   ("displayHeight", -1);
-  simparams->display_scale        = get_float_param ("displayScale",   1.0);
-  simparams->showCommsRadius      = get_int_param   ("showCommsRadius", 1);
-  simparams->commsRadius          = get_int_param   ("commsRadius", 70);
-  simparams->displayWidthPercent  = get_float_param("displayWidthPercent",  0.9);
-  simparams->displayHeightPercent = get_float_param("displayHeightPercent", 0.9);
-  simparams->histLength           = get_int_param("histLength", 500); // number of history points to draw
-  simparams->showHist             = get_int_param("showHist", 0);
-  simparams->randSeed             = get_int_param("randSeed", 0);
-  simparams->GUI                  = get_int_param("GUI", 1);
-  simparams->distance_noise       = get_float_param("distanceNoise", 0);
-  simparams->msg_success_rate     = get_float_param("msgSuccessRate", 1);
-  simparams->speed                = get_float_param("speed", 7);
-  simparams->speedVariation       = get_float_param("speedVariation", 0);
-  simparams->turn_rate            = get_float_param("turnRate", 13);
-  simparams->offsetVariation        = get_float_param("turnOffsetVariation", 0);
-  simparams->slopeVariation        = get_float_param("turnSlopeVariation", 0);
-  simparams->pushDisplacement     = get_float_param("pushDisplacement", 1.0); 
-  simparams->distanceCoefficient  = get_float_param("distanceCoefficient", 1.0);
-  simparams->displayX             = get_float_param("displayX", 0);
-  simparams->displayY             = get_float_param("displayY", 0);
-  simparams->useGrid              = get_int_param("useGrid", 1);
+  p->stateFileName        = get_string_param("stateFileName",  NULL);
+  p->stateFileSteps       = get_int_param   ("stateFileSteps", 100);
+  p->stateFileUserdata    = get_int_param   ("stateFileUserdata", 0);
+  p->stateFilePrecision   = get_float_param ("stateFilePrecision", 0.01);
+  p->eventFileName        = get_string_param("eventFileName", NULL);
+  p->checkpointFileName   = get_string_param("checkpointFileName", NULL);
+  p->checkpointSteps      = get_int_param   ("checkpointSteps", 0);
+  p->stepsPerFrame        = get_int_param   ("stepsPerFrame",  1);
+  p->bot_name             = get_string_param("botName",        "default");
+  p->display_w            = get_int_param   ("displayWidth",  -1);
+  p->display_h            = get_int_param   ("displayHeight", -1);
+  p->display_scale        = get_float_param ("displayScale",   1.0);
+  p->showCommsRadius      = get_int_param   ("showCommsRadius", 1);
+  p->commsRadius          = get_int_param   ("commsRadius", 70);
+  p->displayWidthPercent  = get_float_param("displayWidthPercent",  0.9);
+  p->displayHeightPercent = get_float_param("displayHeightPercent", 0.9);
+  p->histLength           = get_int_param("histLength", 500); // number of history points to draw
+  p->showHist             = get_int_param("showHist", 0);
+  p->randSeed             = get_int_param("randSeed", 0);
+  p->GUI                  = get_int_param("GUI", 1);
+  p->distance_noise       = get_float_param("distanceNoise", 0);
+  p->msg_success_rate     = get_float_param("msgSuccessRate", 1);
+  p->msg_bit_error_rate   = get_float_param("msgBitErrorRate", 0);
+  p->speed                = get_float_param("speed", 7);
+  p->speedVariation       = get_float_param("speedVariation", 0);
+  p->turn_rate            = get_float_param("turnRate", 13);
+  p->offsetVariation        = get_float_param("turnOffsetVariation", 0);
+  p->slopeVariation        = get_float_param("turnSlopeVariation", 0);
+  p->pushDisplacement     = get_float_param("pushDisplacement", 1.0); 
+  p->distanceCoefficient  = get_float_param("distanceCoefficient", 1.0);
+  p->displayX             = get_float_param("displayX", 0);
+  p->displayY             = get_float_param("displayY", 0);
+  p->useGrid              = get_int_param("useGrid", 1);
+  p->commStats            = get_int_param("commStats", 1);
+  p->numThreads           = get_int_param("numThreads", 1);
+  p->numProcesses         = get_int_param("numProcesses", 1);
+  p->branchStep           = get_int_param("branchStep", 0);
+  p->branchRuns           = get_int_param("branchRuns", 0);
+  p->branchParallel       = get_int_param("branchParallel", 0);
+  p->branchFileName       = get_string_param("branchFileName", "branches.json");
+  p->botStackSize         = get_int_param("botStackSize", 32768);
+  p->parallelMessaging    = get_int_param("parallelMessaging", 0);
+  p->occlusionFactor      = get_float_param("occlusionFactor", 1.5);
+
+  const char *occlusion           = get_string_param("occlusion", "none");
+  if (occlusion == NULL || strcmp(occlusion, "none") == 0)
+    p->occlusion = OCCLUSION_NONE;
+  else if (strcmp(occlusion, "drop") == 0)
+    p->occlusion = OCCLUSION_DROP;
+  else if (strcmp(occlusion, "attenuate") == 0)
+    p->occlusion = OCCLUSION_ATTENUATE;
+  else {
+    fprintf(stderr, "Unknown occlusion mode %s, use none, drop or attenuate.\n", occlusion);
+    exit(1);
+  }
+
+  const char *state_format         = get_string_param("stateFileFormat", "jsonl");
+  if (state_format == NULL || strcmp(state_format, "jsonl") == 0)
+    p->stateFileFormat = STATE_JSONL;
+  else if (strcmp(state_format, "json") == 0)
+    p->stateFileFormat = STATE_JSON;
+  else if (strcmp(state_format, "binary") == 0)
+    p->stateFileFormat = STATE_BINARY;
+  else {
+    fprintf(stderr, "Unknown stateFileFormat %s, use jsonl, json or binary.\n", state_format);
+    exit(1);
+  }
+  read_state_selection(p);
+
+  loading = NULL;
+}
+
+/* The stateSelection object: which bots go to the state file, and how often
+ * each part of their state. Without it, each state has all bots, and the
+ * parts that the format always had, every stateFileSteps steps.
+ */
+static void read_state_selection(simulation_params *p)
+{
+  static const char *field_names[N_STATE_FIELDS] = {"position", "led", "state", "comm"};
+  json_t *selection = json_object_get(p->root, "stateSelection");
+  json_t *fields = json_object_get(selection, "fields");
+  json_t *bots = json_object_get(selection, "bots");
+  json_t *sample = json_object_get(selection, "sample");
+  int i;
+
+  for (i = 0; i < N_STATE_FIELDS; i++)
+    {
+      json_t *steps = json_object_get(fields, field_names[i]);
+      if (!json_is_object(fields))
+	p->stateFieldSteps[i] = i == STATE_LED && p->stateFileFormat != STATE_BINARY ? 0 : p->stateFileSteps;
+      else if (json_is_integer(steps) && json_integer_value(steps) >= 0)
+	p->stateFieldSteps[i] = json_integer_value(steps);
+      else
+	{
+	  if (steps)
+	    fprintf(stderr, "stateSelection: fields.%s should be a number of steps.\n", field_names[i]);
+	  p->stateFieldSteps[i] = 0;
+	}
+    }
+  if (json_is_object(fields) && json_object_size(fields) == 0)
+    fprintf(stderr, "stateSelection: no fields, the states will be empty.\n");
+
+  // bots: a list of IDs and [first, last] ranges of IDs
+  free(p->stateBotRanges);
+  p->stateBotRanges = NULL;
+  p->stateBotRangeCount = json_array_size(bots);
+  if (p->stateBotRangeCount)
+    p->stateBotRanges = (int *) malloc(sizeof(int) * 2 * p->stateBotRangeCount);
+  for (i = 0; i < p->stateBotRangeCount; i++)
+    {
+      json_t *b = json_array_get(bots, i);
+      json_t *first = json_is_array(b) ? json_array_get(b, 0) : b;
+      json_t *last = json_is_array(b) ? json_array_get(b, 1) : b;
+      if (!json_is_integer(first) || !json_is_integer(last))
+	{
+	  fprintf(stderr, "stateSelection: bots should hold IDs and [first, last] ranges of them.\n");
+	  exit(1);
+	}
+      p->stateBotRanges[2*i] = json_integer_value(first);
+      p->stateBotRanges[2*i+1] = json_integer_value(last);
+    }
+
+  p->stateBotSample = json_is_number(sample) ? json_number_value(sample) : 1;
 }
 
 int get_int_param(const char *param_name, int default_val)
 {
-  if (!simparams) {
+  simulation_params *params = current_params();
+  if (!params) {
     fprintf(stderr, "Error: attempted to read parameter without loading parameter file\n");
     exit(2);
   }
 
-  json_t *param = json_object_get(simparams->root, param_name);
+  json_t *param = json_object_get(params->root, param_name);
 
   if (!json_is_integer(param)) {
     fprintf(stderr, "Requested parameter: %s is not an integer.\n Using default value %d.\n", param_name, default_val);
@@ -92,12 +224,13 @@ int get_int_param(const char *param_name, int default_val)
 
 float get_float_param(const char *param_name, float default_val)
 {
-  if (!simparams) {
+  simulation_params *params = current_params();
+  if (!params) {
     fprintf(stderr, "Error: attempted to read parameter without loading parameter file\n");
     exit(2);
   }
 
-  json_t *param = json_object_get(simparams->root, param_name);
+  json_t *param = json_object_get(params->root, param_name);
 
   if (!json_is_number(param)) {
     fprintf(stderr, "Requested parameter: %s is not a number.\n Using default value %f.\n", param_name, default_val);
@@ -110,12 +243,13 @@ float get_float_param(const char *param_name, float default_val)
 }
 
 size_t get_array_param_size(const char * param_name){
-  if (!simparams) {
+  simulation_params *params = current_params();
+  if (!params) {
     fprintf(stderr, "Error: attempted to read parameter without loading parameter file\n");
     exit(2);
   }
 
-  json_t *param = json_object_get(simparams->root, param_name);
+  json_t *param = json_object_get(params->root, param_name);
 
   if (!json_is_array(param)) {
     fprintf(stderr, "Requested parameter: %s is not an array.\n", param_name);
@@ -127,12 +261,13 @@ size_t get_array_param_size(const char * param_name){
 
 int get_int_array_param(const char * param_name, int index, int default_val)
 {
-  if (!simparams) {
+  simulation_params *params = current_params();
+  if (!params) {
     fprintf(stderr, "Error: attempted to read parameter without loading parameter file\n");
     exit(2);
   }
 
-  json_t *param = json_object_get(simparams->root, param_name);
+  json_t *param = json_object_get(params->root, param_name);
 
   if (!json_is_array(param)) {
     fprintf(stderr, "Requested parameter: %s is not an array.\n Using default value %d.\n", param_name, default_val);
@@ -159,12 +294,13 @@ int get_int_array_param(const char * param_name, int index, int default_val)
 
 float get_float_array_param(const char * param_name, int index, float default_val)
 {
-  if (!simparams) {
+  simulation_params *params = current_params();
+  if (!params) {
     fprintf(stderr, "Error: attempted to read parameter without loading parameter file\n");
     exit(2);
   }
 
-  json_t *param = json_object_get(simparams->root, param_name);
+  json_t *param = json_object_get(params->root, param_name);
 
   if (!json_is_array(param)) {
     fprintf(stderr, "Requested parameter: %s is not an array.\n Using default value %f.\n", param_name, default_val);
@@ -191,12 +327,13 @@ float get_float_array_param(const char * param_name, int index, float default_va
 
 const char* get_string_param(const char *param_name, char *default_val)
 {
-  if (!simparams) {
+  simulation_params *params = current_params();
+  if (!params) {
     fprintf(stderr, "Error: attempted to read parameter without loading parameter file\n");
     exit(2);
   }
 
-  json_t *param = json_object_get(simparams->root, param_name);
+  json_t *param = json_object_get(params->root, param_name);
 
   if (!json_is_string(param) && !json_is_null(param)) {
     fprintf(stderr, "Requested parameter: %s is not a string\n", param_name);
@@ -6,6 +6,15 @@
 #ifndef _PARAMS_H
 #define _PARAMS_H
 
+// line-of-sight models for messages
+enum {OCCLUSION_NONE, OCCLUSION_DROP, OCCLUSION_ATTENUATE};
+
+// formats of the state file
+enum {STATE_JSONL, STATE_JSON, STATE_BINARY};
+
+// the parts of a bot's state in the state file, see stateSelection
+enum {STATE_POSITION, STATE_LED, STATE_USERSTATE, STATE_COMM, N_STATE_FIELDS};
+
 typedef struct {
   json_t *root;
 
@@ -20,6 +29,16 @@ typedef struct {
   int saveVideo;
   const char *stateFileName; 
   int stateFileSteps; 
+  int stateFileFormat; // STATE_JSONL, STATE_JSON or STATE_BINARY
+  int stateFileUserdata; // if true, store the bots' raw USERDATA in binary state files
+  float stateFilePrecision; // mm, of positions in binary state files, 0 to store them exactly
+  int stateFieldSteps[N_STATE_FIELDS]; // steps between writing each part of the states, 0 for never
+  int *stateBotRanges;    // the bots in the state file: first and last ID of each range ...
+  int stateBotRangeCount; // ... and the number of ranges, 0 for all bots
+  float stateBotSample;   // the fraction of those bots that is written
+  const char *eventFileName; // the bots' events from sim_event(), see eventlog.h
+  const char *checkpointFileName; // binary checkpoint of the whole simulation
+  int checkpointSteps;
   int stepsPerFrame; 
   const char *bot_name;
   float display_scale;  
@@ -40,13 +59,26 @@ typedef struct {
   double pushDisplacement; // [0,1]
   int GUI;
   float msg_success_rate;
+  float msg_bit_error_rate; // probability of flipping each bit of a message
   float distance_noise;
   double distanceCoefficient; // slope of measured distance
   double displayX, displayY;
   int useGrid; // if true, use the grid cache
+  int occlusion; // OCCLUSION_NONE, _DROP or _ATTENUATE
+  double occlusionFactor; // distance scaling per blocking bot, when attenuating
+  int commStats; // if true, store communication counters with the state and print a summary
+  int parallelMessaging; // if true, pass messages in three parallel phases
+  int numThreads; // worker threads for running the bots, 0 for one per CPU core
+  int numProcesses; // processes simulating a strip of the arena each
+  int botStackSize; // bytes of stack for a bot's loop(), 0 to run it on the worker's stack
+  int branchStep; // step at which runsim branches into branchRuns runs, see ensemble.h
+  int branchRuns;
+  int branchParallel; // branches running at once, 0 for one per CPU core
+  const char *branchFileName; // the end states of the branches
 } simulation_params;
 
-void parse_param_file(const char *filename);
+simulation_params *parse_param_file(const char *filename);
+void update_params(simulation_params *p, json_t *changes);
 int get_int_param(const char *param_name, int default_val);
 float get_float_param(const char *param_name, float default_val);
 const char* get_string_param(const char *param_name, char* default_val);
@@ -54,6 +86,4 @@ size_t get_array_param_size(const char * param_name);
 int get_int_array_param(const char * param_name, int index, int default_val);
 float get_float_array_param(const char * param_name, int index, float default_val);
 
-extern simulation_params* simparams;
-
 #endif
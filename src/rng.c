@@ -0,0 +1,104 @@
+/* Normal samples by the Ziggurat method (Marsaglia and Tsang, "The Ziggurat
+ * method for generating random variables", J. Stat. Softw. 5, 2000), with
+ * 128 layers. A 32 bit word picks a layer with its low 7 bits and a point in
+ * it with the others; the point is accepted at once in about 99% of the
+ * cases, which costs a table lookup and a multiplication. The rest - the
+ * edges of the layers and the tail beyond R - take more numbers from a
+ * stream, see rng_gauss_slow().
+ */
+
+#include <math.h>
+
+#include "rng.h"
+
+#define ZIG_R 3.442619855899    // start of the tail
+#define ZIG_V 9.91256303526217e-3  // area of each layer
+
+uint32_t zig_k[ZIG_LAYERS];
+double zig_w[ZIG_LAYERS];
+static double zig_f[ZIG_LAYERS];
+
+// the tables of the layers' edges, filled before main() runs
+__attribute__((constructor))
+static void zig_tables(void)
+{
+  const double m = 2147483648.0;
+  double d = ZIG_R, t = d;
+  double q = ZIG_V / exp(-0.5 * d * d);
+  int i;
+
+  zig_k[0] = (uint32_t) (d / q * m);
+  zig_k[1] = 0;
+  zig_w[0] = q / m;
+  zig_w[ZIG_LAYERS - 1] = d / m;
+  zig_f[0] = 1.0;
+  zig_f[ZIG_LAYERS - 1] = exp(-0.5 * d * d);
+
+  for (i = ZIG_LAYERS - 2; i >= 1; i--)
+    {
+      d = sqrt(-2.0 * log(ZIG_V / d + exp(-0.5 * d * d)));
+      zig_k[i + 1] = (uint32_t) (d / t * m);
+      t = d;
+      zig_f[i] = exp(-0.5 * d * d);
+      zig_w[i] = d / m;
+    }
+}
+
+/* The sample for a word u that rng_gauss_fast() rejected, drawing more
+ * numbers from s as needed.
+ */
+double rng_gauss_slow(uint32_t u, rng_stream *s)
+{
+  for (;;)
+    {
+      int i = u & (ZIG_LAYERS - 1);
+      int32_t j = (int32_t) (u & ~(uint32_t) (ZIG_LAYERS - 1));
+      double x = j * zig_w[i];
+
+      if (i == 0)
+	{
+	  // the tail, beyond R
+	  double y;
+	  do
+	    {
+	      x = -log(rng_u01_open(rng_next32(s))) / ZIG_R;
+	      y = -log(rng_u01_open(rng_next32(s)));
+	    }
+	  while (y + y < x * x);
+	  return j > 0 ? ZIG_R + x : -ZIG_R - x;
+	}
+
+      // the edge of layer i, under the curve or not
+      if (zig_f[i] + rng_next_u01(s) * (zig_f[i - 1] - zig_f[i]) < exp(-0.5 * x * x))
+	return x;
+
+      u = rng_next32(s);
+      if (rng_gauss_fast(u, &x))
+	return x;
+    }
+}
+
+/* Fill out with n standard normal samples from s. The words are drawn in
+ * one go and converted in a loop without branches, the few rejected ones
+ * are redone afterwards.
+ */
+void rng_gauss_fill(rng_stream *s, double *out, int n)
+{
+  uint32_t u[64];
+  uint8_t ok[64];
+  int i;
+
+  while (n > 0)
+    {
+      int m = n < 64 ? n : 64;
+      for (i = 0; i < m; i++)
+	u[i] = rng_next32(s);
+      for (i = 0; i < m; i++)
+	ok[i] = rng_gauss_fast(u[i], &out[i]);
+      for (i = 0; i < m; i++)
+	if (!ok[i])
+	  out[i] = rng_gauss_slow(u[i], s);
+      out += m;
+      n -= m;
+    }
+}
@@ -0,0 +1,137 @@
+/* Counter-based random number generation.
+ *
+ * Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3",
+ * SC'11) maps a 128 bit counter and a 64 bit key to 128 random bits.
+ * There is no hidden state: the same (key, counter) always gives the same
+ * numbers, so draws do not depend on the order in which bots are processed,
+ * and many draws can be generated independently in one loop.
+ */
+
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+// what a draw is used for - part of the counter, to keep the streams apart
+enum {
+  RNG_DELIVERY,    // message arrival and distance noise, per receiver
+  RNG_CORRUPTION,  // bit errors in a message, per receiver
+  RNG_CALIBRATION, // motor calibration and message timing of a new bot
+  RNG_PLACEMENT,   // random start position of a bot
+  RNG_HARD,        // the bot's rand_hard(), per call
+  RNG_SELECTION,   // whether a bot is sampled for the state file
+};
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+static inline void philox4x32(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4])
+{
+  uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+  uint32_t k0 = key[0], k1 = key[1];
+  int r;
+
+  for (r = 0; r < 10; r++)
+    {
+      uint64_t p0 = (uint64_t) PHILOX_M0 * c0;
+      uint64_t p1 = (uint64_t) PHILOX_M1 * c2;
+      uint32_t n0 = (uint32_t) (p1 >> 32) ^ c1 ^ k0;
+      uint32_t n2 = (uint32_t) (p0 >> 32) ^ c3 ^ k1;
+      c1 = (uint32_t) p1;
+      c3 = (uint32_t) p0;
+      c0 = n0;
+      c2 = n2;
+      k0 += PHILOX_W0;
+      k1 += PHILOX_W1;
+    }
+
+  out[0] = c0;
+  out[1] = c1;
+  out[2] = c2;
+  out[3] = c3;
+}
+
+// uniform in [0,1)
+static inline double rng_u01(uint32_t x)
+{
+  return x * (1.0 / 4294967296.0);
+}
+
+// uniform in (0,1], safe to take the log of
+static inline double rng_u01_open(uint32_t x)
+{
+  return (x + 1.0) * (1.0 / 4294967296.0);
+}
+
+/* A sequential stream of numbers on top of the counter-based generator.
+ * The first three counter words identify the stream, the last one counts
+ * the blocks drawn from it.
+ */
+typedef struct {
+  uint32_t key[2];
+  uint32_t ctr[4];
+  uint32_t buf[4];
+  int avail;
+} rng_stream;
+
+static inline void rng_stream_init(rng_stream *s, uint32_t k0, uint32_t k1,
+				   uint32_t c0, uint32_t c1, uint32_t c2)
+{
+  s->key[0] = k0;
+  s->key[1] = k1;
+  s->ctr[0] = c0;
+  s->ctr[1] = c1;
+  s->ctr[2] = c2;
+  s->ctr[3] = 0;
+  s->avail = 0;
+}
+
+static inline uint32_t rng_next32(rng_stream *s)
+{
+  if (s->avail == 0)
+    {
+      philox4x32(s->ctr, s->key, s->buf);
+      s->ctr[3]++;
+      s->avail = 4;
+    }
+  return s->buf[--s->avail];
+}
+
+static inline double rng_next_u01(rng_stream *s)
+{
+  return rng_u01(rng_next32(s));
+}
+
+/* Standard normal samples, by the Ziggurat method, see rng.c.
+ * rng_gauss_fast() turns one 32 bit word into a sample in about 99% of the
+ * cases, returning 0 otherwise; rng_gauss_slow() then finishes the job with
+ * more numbers from a stream.
+ */
+#define ZIG_LAYERS 128
+
+extern uint32_t zig_k[ZIG_LAYERS];
+extern double zig_w[ZIG_LAYERS];
+
+static inline int rng_gauss_fast(uint32_t u, double *x)
+{
+  int i = u & (ZIG_LAYERS - 1);
+  int32_t j = (int32_t) (u & ~(uint32_t) (ZIG_LAYERS - 1));
+  uint32_t a = j < 0 ? -(uint32_t) j : (uint32_t) j;
+
+  *x = j * zig_w[i];
+  return a < zig_k[i];
+}
+
+double rng_gauss_slow(uint32_t u, rng_stream *s);
+void rng_gauss_fill(rng_stream *s, double *out, int n);
+
+static inline double rng_next_gauss(rng_stream *s)
+{
+  uint32_t u = rng_next32(s);
+  double x;
+  return rng_gauss_fast(u, &x) ? x : rng_gauss_slow(u, s);
+}
+
+#endif
@@ -0,0 +1,192 @@
+/* Creating, running and destroying simulations, see sim.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "kilolib.h"
+#include "skilobot.h"
+#include "params.h"
+#include "stateio.h"
+#include "neighbors.h"
+#include "snapshot.h"
+#include "eventlog.h"
+#include "sim.h"
+#include "domain.h"
+#include "checkpoint.h"
+#include "ensemble.h"
+
+void distribute_bots(int n_bots);
+extern void (*callback_global_setup) (void);
+
+/* Create a simulation with the given parameters, and make it the current
+ * simulation of the calling thread.
+ *
+ * seed is the random seed, if 0 the randSeed parameter is used, and if that
+ * is 0 too, the time. If bot_file is a checkpoint, the simulation continues
+ * from it, with its seed. Otherwise the bots are loaded from bot_file if
+ * given, or nBots bots (n_bots if the parameter is not set) are placed as the
+ * formation parameter says. Then the bots' main() and setup functions are run.
+ * Returns NULL on error.
+ */
+sim_t *sim_create(simulation_params *params, uint32_t seed, int n_bots, const char *bot_file)
+{
+  sim_t *s = (sim_t *) calloc(1, sizeof(sim_t));
+
+  sim = s;
+  s->params = params;
+  tx_period_ticks = 15;  // Message twice a second.
+
+  if (seed)
+    rng_seed = seed;
+  else if (params->randSeed)
+    rng_seed = params->randSeed;
+  else
+    rng_seed = time(0);
+  srand(rng_seed);  // only for bot programs calling rand()
+
+  comm_stats_tag_byte = get_int_param("commStatsTagByte", -1);
+  if (comm_stats_tag_byte >= (int) sizeof(((message_t *) 0)->data))
+    {
+      fprintf(stderr, "commStatsTagByte must be less than the message payload size.\n");
+      sim_destroy(s);
+      return NULL;
+    }
+
+  if (bot_file && is_checkpoint(bot_file))
+    {
+      // the bots continue where they were, only the global setup is run
+      if (checkpoint_load(bot_file))
+	{
+	  sim_destroy(s);
+	  return NULL;
+	}
+      if (callback_global_setup != NULL)
+	callback_global_setup();
+    }
+  else
+    {
+      if (bot_file)
+	{
+	  allbots = bot_loader(bot_file, &s->n_bots);
+	  if (allbots == NULL)
+	    {
+	      fprintf(stderr, "Could not parse the given bot file\n");
+	      sim_destroy(s);
+	      return NULL;
+	    }
+	}
+      else
+	{
+	  n_bots = get_int_param("nBots", n_bots);
+
+	  if (n_bots <= 0)
+	    {
+	      fprintf(stderr, "nBots must be > 0.\n");
+	      sim_destroy(s);
+	      return NULL;
+	    }
+
+	  create_bots(n_bots);
+	  distribute_bots(n_bots);
+	}
+
+      // call main() in every bot
+      init_all_bots(s->n_bots);
+
+      // call user-supplied global setup after reading parameters but before
+      // doing any real work
+      if (callback_global_setup != NULL)
+	callback_global_setup();
+
+      // call the per-bot setup here so that global setup can provide
+      // e.g. simulation-specific parameter values to it
+      user_setup_all_bots(s->n_bots);
+    }
+
+  // fork before starting any threads
+  domain_start(params->numProcesses);
+  sim_set_threads(params->numThreads);
+
+  if (params->stateFileName && params->stateFileSteps != 0)
+    snapshot_writer_start(domain_file_name(params->stateFileName));
+  if (params->eventFileName)
+    event_log_start(domain_file_name(params->eventFileName));
+
+  return s;
+}
+
+static int time_up(sim_t *s)
+{
+  return simparams->maxTime > 0 && s->time >= simparams->maxTime;
+}
+
+/* Run steps time steps of simulation s, in the calling thread.
+ * Returns 0 when the simulation time is up, 1 otherwise. A simulation split
+ * over several processes is joined in the main process when the time is up,
+ * the other processes exit here, and so does a branch of an ensemble, see
+ * sim_branch().
+ */
+int sim_step(sim_t *s, int steps)
+{
+  sim = s;
+
+  for (int i = 0; i < steps && !time_up(s); i++)
+    {
+      if (s->domain)
+	domain_step(simparams->timeStep);
+      else
+	process_bots(s->n_bots, simparams->timeStep);
+      s->time += simparams->timeStep;
+      kilo_ticks = s->time * TICKS_PER_SEC;
+      event_log_flush();
+
+      // save simulation state, unless the writer was stopped by sim_branch()
+      if (s->snapshots)
+	{
+	  int fields = snapshot_fields(s->n_step);
+	  if (fields)
+	    snapshot_take(kilo_ticks, fields);
+	}
+
+      // increment step here so that state is saved at t=0
+      s->n_step++;
+
+      // a checkpoint to continue from the next step
+      if (simparams->checkpointFileName && simparams->checkpointSteps > 0 && !s->domain
+	  && s->n_step % simparams->checkpointSteps == 0)
+	checkpoint_save(simparams->checkpointFileName);
+    }
+
+  if (!time_up(s))
+    return 1;
+  if (s->domain)
+    domain_finish();
+  else if (s->branch)
+    branch_finish();
+  return 0;
+}
+
+/* Finish writing the state file and free simulation s. The parameters are
+ * left alone, they may be used by other simulations.
+ */
+void sim_destroy(sim_t *s)
+{
+  sim = s;
+
+  snapshot_writer_stop();
+  event_log_stop();
+  domain_stop();
+  pool_destroy(s->pool);
+  s->pool = NULL;
+  if (allbots)
+    free_all_bots();
+  free_runners();
+  freeCommLines();
+  free_grid_cache();
+
+  free(s->branch);
+  free(s);
+  sim = NULL;
+}
@@ -0,0 +1,107 @@
+/* The simulation context.
+ *
+ * All the state of one simulation - the bots, the parameters, the time, the
+ * communication lines and counters, the neighbor grid and the worker threads -
+ * is kept in a sim_t. Each thread has a current simulation, sim, which the
+ * simulator code works on. Several simulations can run in one process,
+ * each in a thread of its own:
+ *
+ *   simulation_params *params = parse_param_file("kilombo.json");
+ *   sim_t *s = sim_create(params, seed, 100, NULL);
+ *   while (sim_step(s, 100))
+ *     ;
+ *   sim_destroy(s);
+ *
+ * The parameters are only read by the simulation, so one set can be shared
+ * by all of them.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+
+#include "skilobot.h"
+#include "params.h"
+#include "commstats.h"
+#include "threadpool.h"
+
+struct neighbor_grid;     // neighbors.c
+struct snapshot_writer;  // snapshot.c
+struct event_log;        // eventlog.c
+struct sim_domain;       // domain.c
+struct sim_branch;       // ensemble.c
+
+// for each worker thread: coroutines running the bots' loop(), see skilobot.c
+typedef struct {
+  struct runner *spare;  // runners not in use
+  kilobot **parked;      // bots waiting in delay(), resumed by this worker
+  int n_parked, parked_size;
+} bot_runners;
+
+typedef struct sim_t {
+  simulation_params *params;
+
+  kilobot **bots;
+  int n_bots;
+
+  double time;                 // simulated time in s
+  int n_step;                  // time steps taken
+  volatile uint32_t ticks;     // kilo_ticks
+  int tx_period;               // ticks between messages of a bot
+  uint32_t seed;               // key of the counter-based random number generator
+
+  // communication lines to draw, and the area of the arena shown on screen,
+  // lines outside it are not stored
+  CommLineStore comm_lines;
+  coord2D view_min, view_max;
+  int view_set;
+
+  // communication counters, one table per worker thread,
+  // and the index of the payload byte used as message tag, -1 to disable
+  comm_stats worker_stats[COMM_STATS_MAX_WORKERS];
+  int tag_byte;
+
+  thread_pool *pool;
+  bot_runners runners[POOL_MAX_THREADS];
+  struct neighbor_grid *grid;
+  struct snapshot_writer *snapshots;
+  int snapshot_requested;     // by a bot, for the end of the step, see snapshot.h
+  struct event_log *events;   // events reported by the bots, see eventlog.h
+  struct sim_domain *domain;  // the strips of other processes, see domain.h
+  struct sim_branch *branch;  // this run's place in an ensemble, see ensemble.h
+} sim_t;
+
+// the simulation the calling thread works on
+extern __thread sim_t *sim;
+
+/* The simulator code refers to the state of the current simulation by the
+ * names the globals used to have.
+ */
+#define simparams           (sim->params)
+#define allbots             (sim->bots)
+#define tx_period_ticks     (sim->tx_period)
+#define rng_seed            (sim->seed)
+#define commLines           (sim->comm_lines)
+#define commView_min        (sim->view_min)
+#define commView_max        (sim->view_max)
+#define commView_set        (sim->view_set)
+#define comm_stats_worker   (sim->worker_stats)
+#define comm_stats_tag_byte (sim->tag_byte)
+
+// the bots see the ticks through their context, see kilolib.h
+#undef kilo_ticks
+#define kilo_ticks          (sim->ticks)
+
+static inline CommLine *getCommLine(int i)
+{
+  return &commLines.lines[(commLines.head + i) & (commLines.capacity - 1)];
+}
+
+sim_t *sim_create(simulation_params *params, uint32_t seed, int n_bots, const char *bot_file);
+int sim_step(sim_t *s, int steps);
+void sim_destroy(sim_t *s);
+
+void sim_set_threads(int n_threads);
+
+#endif
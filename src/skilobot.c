@@ -4,6 +4,7 @@
 #include<stdio.h>
 #include<stdlib.h>
 #include<math.h>
+#include<string.h>
 
 #include <jansson.h>
 
@@ -12,6 +13,10 @@
 #include "kilolib.h"
 
 #include "neighbors.h"
+#include "rng.h"
+#include "threadpool.h"
+#include "sim.h"
+#include "coro.h"
 
 /* Global variables.
  */
@@ -20,20 +25,13 @@
 // Filled in by the user program.
 extern int UserdataSize ;
 
-// Variables used to simulate many bots.
-kilobot** allbots;
-kilobot* current_bot;
-
-// Settings of the simulation.
-int tx_period_ticks = 15;  // Message twice a second.
+// The simulation this thread works on. Its state - the bots, the settings
+// and the counters - is all in the sim_t, see sim.h.
+__thread sim_t *sim = NULL;
 
 // Callback function pointer for saving the bot's internal state as JSON.
 json_t* (*callback_json_state) (void) = NULL;
 
-// Variables used to display communication lines.
-CommLine commLines[MAXCOMMLINES];
-int NcommLines = 0;
-
 
 // Function pointers to user defined callback functions.
 
@@ -55,7 +53,6 @@ void message_rx_dummy(message_t *m, distance_measurement_t *d) { }
 message_t *message_tx_dummy() { return NULL; }
 void message_tx_success_dummy() {}
 
-double rnd_gauss (double mean, double sig);
 
 void set_callback_params(void (*fp)(void))
 {
@@ -142,6 +139,7 @@ kilobot *new_kilobot(int ID, int n_bots)
   // calloc sets the memory area to 0 - guarantees initialization of user data.
 
   bot->ID = ID;
+  bot->index = ID;
   bot->x = 0;
   bot->y = 0;
 
@@ -161,12 +159,20 @@ kilobot *new_kilobot(int ID, int n_bots)
   bot->right_motor_power = 0;
   bot->left_motor_power = 0;
 
-  bot->left_motor_offset = 60 + rnd_gauss(0, simparams->offsetVariation);
-  bot->right_motor_offset = 60 + rnd_gauss(0, simparams->offsetVariation);
-  bot->left_motor_slope = 1.0 + rnd_gauss(0, simparams->slopeVariation);
-  bot->right_motor_slope = 1.0 + rnd_gauss(0, simparams->slopeVariation);
+  // the bot's own random stream, so that its calibration does not depend
+  // on the order in which the bots are created
+  rng_stream rng;
+  rng_stream_init(&rng, rng_seed, ID, 0, 0, RNG_CALIBRATION);
+
+  double g[5];
+  rng_gauss_fill(&rng, g, 5);
+
+  bot->left_motor_offset = 60 + simparams->offsetVariation * g[0];
+  bot->right_motor_offset = 60 + simparams->offsetVariation * g[1];
+  bot->left_motor_slope = 1.0 + simparams->slopeVariation * g[2];
+  bot->right_motor_slope = 1.0 + simparams->slopeVariation * g[3];
   
-  bot->speed = simparams->speed + rnd_gauss(0, simparams->speedVariation);
+  bot->speed = simparams->speed + simparams->speedVariation * g[4];
   bot->turn_rate_l = 0;
   bot->turn_rate_r = 0;
 
@@ -177,18 +183,26 @@ kilobot *new_kilobot(int ID, int n_bots)
   bot->b_led = 0;
 
   bot->cr = simparams->commsRadius;
+  bot->tx_slot = -1;
             
-  bot->in_range = (int*) malloc(sizeof(int) * n_bots);
+  // room for the bots in range grows as needed, see add_in_range()
+  bot->in_range_size = n_bots < IN_RANGE_SIZE ? n_bots : IN_RANGE_SIZE;
+  bot->in_range = (int*) malloc(sizeof(int) * bot->in_range_size);
   bot->n_in_range = 0;
 
-  bot->tx_ticks = rand() % tx_period_ticks;
+  bot->tx_ticks = rng_next32(&rng) % tx_period_ticks;
 
   bot->user_setup = NULL;
   bot->user_loop  = NULL;
+  bot->runner = NULL;
+  bot->wake_tick = 0;
   
-  bot->kilo_message_tx = message_tx_dummy;
-  bot->kilo_message_tx_success = message_tx_success_dummy;
-  bot->kilo_message_rx = message_rx_dummy;
+  bot->ctx.uid = ID;
+  bot->ctx.ticks = &kilo_ticks;
+  bot->ctx.message_tx = message_tx_dummy;
+  bot->ctx.message_tx_success = message_tx_success_dummy;
+  bot->ctx.message_rx = message_rx_dummy;
+  bot->ctx.bot = bot;
 
   bot->data = malloc(UserdataSize);
   
@@ -203,6 +217,7 @@ void create_bots(int n_bots)
    */
 
   allbots = (kilobot**) malloc(sizeof(kilobot*) * n_bots);
+  sim->n_bots = n_bots;
 
   for (int i=0; i<n_bots; i++) {
     allbots[i] = new_kilobot(i, n_bots);
@@ -213,11 +228,44 @@ void init_all_bots(int n_bots)
 {
   /* Call the setup function of the user's bot. */
 
+  message_crc_init();
+
   for (int i=0; i<n_bots; i++) {
     prepare_bot(allbots[i]);
     bot_main();
-    finalize_bot(allbots[i]);
   }
+  leave_bot();
+}
+
+
+// a coroutine running loop() for a bot, see run_all_bots()
+typedef struct runner {
+  coro *co;
+  kilobot *bot;         // the bot running, NULL once its loop() has returned
+  struct runner *next;  // in the list of spare runners
+} runner;
+
+void free_kilobot(kilobot *bot)
+{
+  free(bot->x_history);
+  free(bot->y_history);
+  free(bot->in_range);
+  free(bot->data);
+  if (bot->runner)
+    {
+      coro_free(bot->runner->co);
+      free(bot->runner);
+    }
+  free(bot);
+}
+
+void free_all_bots(void)
+{
+  for (int i=0; i<sim->n_bots; i++)
+    free_kilobot(allbots[i]);
+  free(allbots);
+  allbots = NULL;
+  sim->n_bots = 0;
 }
 
 
@@ -228,8 +276,8 @@ void user_setup_all_bots(int n_bots)
     {
       prepare_bot(allbots[i]);
       current_bot->user_setup();
-      finalize_bot(allbots[i]);
     }
+  leave_bot();
 }
 
 
@@ -237,36 +285,21 @@ kilobot *Me()
 {
   /* Return the current bot to the calling function.
    *
-   * Uses the global variable current_bot to work out which bot is active.
+   * Uses the thread's kilolib context to work out which bot is active.
    */
 
   return current_bot;
 }
 
-/* prepare Bot i for running
- * mydata
- * kilo_uid
+/* prepare Bot i for running:
+ * point the thread's kilolib context and mydata to the bot's own.
+ * The bot's messaging functions and UID are stored in its context,
+ * so there is nothing to copy back afterwards.
  */
 void prepare_bot(kilobot *bot)
 {
-  current_bot = bot; 
-  kilo_uid                = bot->ID;
-  mydata                  = bot->data;
-  kilo_message_rx         = bot->kilo_message_rx;
-  kilo_message_tx         = bot->kilo_message_tx;
-  kilo_message_tx_success = bot->kilo_message_tx_success;
-}
-
-/* store the values of kilo_message_* poiners in the per-robot variables
- * to make it possible to have different functions in different bots.
- * Kilolib specifies these to be set by assigning to global variables,
- * to be compatible we have to copy the values.
- */
-void finalize_bot(kilobot *bot)
-{
-  bot->kilo_message_rx         =  kilo_message_rx;
-  bot->kilo_message_tx         =  kilo_message_tx;
-  bot->kilo_message_tx_success =  kilo_message_tx_success;
+  kilo_ctx = &bot->ctx;
+  mydata   = bot->data;
 }
 
 
@@ -518,8 +551,8 @@ void update_n_in_range_indices(kilobot* bot1, kilobot* bot2)
   /* Set bot1 and bot2 to be within commuication radius of each other
    * and increment the n_in_range counters. */
 
-  bot1->in_range[bot1->n_in_range++] = bot2->ID;
-  bot2->in_range[bot2->n_in_range++] = bot1->ID;
+  add_in_range(bot1, bot2->index);
+  add_in_range(bot2, bot1->index);
 }
 
 
@@ -576,66 +609,79 @@ void update_interactions(int n_bots)
   }
 }
 
+void setCommLineViewport(double x_min, double y_min, double x_max, double y_max)
+{
+  commView_min.x = x_min;
+  commView_min.y = y_min;
+  commView_max.x = x_max;
+  commView_max.y = y_max;
+  commView_set = 1;
+}
+
+void growCommLines()
+{
+  /* Double the capacity of the line store, unwrapping the ring buffer. */
+
+  int capacity = commLines.capacity ? 2 * commLines.capacity : COMMLINES_INITIAL;
+  CommLine *lines = (CommLine *) malloc(sizeof(CommLine) * capacity);
+
+  for (int i = 0; i < commLines.count; i++)
+    lines[i] = *getCommLine(i);
+
+  free(commLines.lines);
+  commLines.lines = lines;
+  commLines.capacity = capacity;
+  commLines.head = 0;
+}
+
 void addCommLine(kilobot *from, kilobot *to)
 {
-  /* Add a communication line between two bots. */
+  /* Add a communication line between two bots.
+   * Lines entirely outside the viewport are skipped.
+   */
 
-  commLines[NcommLines].from = from;
-  commLines[NcommLines].to = to;
-  commLines[NcommLines].time = 0;
-  if (NcommLines < MAXCOMMLINES-1) {
-    NcommLines++;
-  }
+  if (commView_set &&
+      ((from->x < commView_min.x && to->x < commView_min.x) ||
+       (from->x > commView_max.x && to->x > commView_max.x) ||
+       (from->y < commView_min.y && to->y < commView_min.y) ||
+       (from->y > commView_max.y && to->y > commView_max.y)))
+    return;
+
+  if (commLines.count == commLines.capacity)
+    growCommLines();
+
+  CommLine *line = getCommLine(commLines.count);
+  line->from = from;
+  line->to = to;
+  line->time = kilo_ticks;
+  commLines.count++;
 }
 
-void removeOldCommLines(int dt, int maxt)
+void removeOldCommLines(int now, int maxt)
 {
-  /* Remove old communication lines. */
+  /* Remove communication lines older than maxt ticks. */
 
-  int i;
-  for (i = NcommLines-1; i >= 0; i--) {
-    commLines[i].time += dt;
-    if (commLines[i].time > maxt) {
-      commLines[i] = commLines[NcommLines-1];
-      NcommLines--;
-    }
+  while (commLines.count > 0 && now - commLines.lines[commLines.head].time > maxt) {
+    commLines.head = (commLines.head + 1) & (commLines.capacity - 1);
+    commLines.count--;
   }
 }
 
-// random number between 0 and 1
-// NOTE: this can return 1!
-double rnd_uniform()
+void freeCommLines(void)
 {
-  return rand() / (double)RAND_MAX;
+  free(commLines.lines);
+  memset(&commLines, 0, sizeof(commLines));
 }
 
-double rnd_gauss (double mean, double sig)
-	{
-	double x, y, r2;
-	
-	do
-		{
-		// choose x,y in uniform square (-1,-1) to (+1,+1)
-		x = -1.0 + 2.0 * rnd_uniform();
-		y = -1.0 + 2.0 * rnd_uniform();
-		
-		// see if it is in the unit circle
-		r2 = x * x + y * y;
-		}
-	while (r2 > 1.0 || r2 == 0.0);
-	
-	// Box-Muller transform
-	return mean + sig * y * sqrt (-2.0 * log (r2) / r2);
-	}
-
 /* Simulate a distance measurement
  * with optional gaussian noise and a linear correction.
+ * noise is a sample from the standard normal distribution, scaled here by distanceNoise.
  * 
  * observations, with bots on whiteboard, not yet simulated 
  * - more noise on long distances, maybe noise proportional to distance-d0
  * - measured distance vs distance starts as linear but flattens out at ~100 mm . 
  */
-double noisy_distance(double dist)
+double noisy_distance(double dist, double noise)
 {
   double alpha = simparams->distanceCoefficient;
   double d0 = 2 * allbots[0]->radius; 
@@ -646,101 +692,562 @@ double noisy_distance(double dist)
 
   // add noise
   if (simparams->distance_noise > 0.0)
-    dist += rnd_gauss(0, simparams->distance_noise);
+    dist += simparams->distance_noise * noise;
   
   return dist > 0 ? dist : 0;
 }
 
-int message_success()
+/* The per-receiver draws for a message, from one block of random bits:
+ * whether it arrives (with probability msgSuccessRate), and a standard
+ * normal sample for the distance noise (Ziggurat). The rare samples the
+ * Ziggurat needs more bits for continue with the next blocks of the
+ * receiver's stream.
+ */
+static inline int fate_arrives(uint32_t u, double rate)
+{
+  return rate >= 1 || rng_u01(u) < rate;
+}
+
+static inline double fate_gauss(kilobot *tx, int rx_id, uint32_t slot, uint32_t u)
+{
+  rng_stream more;
+  double x;
+
+  if (rng_gauss_fast(u, &x))
+    return x;
+  rng_stream_init(&more, rng_seed, tx->ID, slot, rx_id, RNG_DELIVERY);
+  more.ctr[3] = 1;  // after the block of the first draws
+  return rng_gauss_slow(u, &more);
+}
+
+/* Buffers for the per-receiver draws of one message, one set per thread,
+ * since simulations in different threads pass messages at the same time. */
+static __thread uint32_t *fate_bits = NULL;
+__thread uint8_t *fate_success = NULL;
+__thread double *fate_noise = NULL;
+static __thread int fate_size = 0;
+
+/* Draw the fate of one message for all n receivers in one batch:
+ * whether the message arrives, and the distance noise (used if
+ * distanceNoise > 0).
+ *
+ * The draws come from the counter-based generator, keyed by the transmitter
+ * and counted by the transmission slot and the receiver's ID, so they do not
+ * depend on the order in which messages are processed. The generator loop has
+ * no data dependencies between receivers, so the compiler can vectorize it.
+ */
+void draw_message_fates(kilobot *tx, uint32_t slot, int n)
 {
-  return simparams->msg_success_rate >= 1 ? 
-    1 : (double)rand() / RAND_MAX <= simparams->msg_success_rate;
+  const int *rx_id = tx->in_range;
+  uint32_t key[2] = {rng_seed, tx->ID};
+  double rate = simparams->msg_success_rate;
+  int i;
+
+  if (n > fate_size)
+    {
+      fate_size = n;
+      fate_bits = (uint32_t *) realloc(fate_bits, 2 * sizeof(uint32_t) * n);
+      fate_success = (uint8_t *) realloc(fate_success, sizeof(uint8_t) * n);
+      fate_noise = (double *) realloc(fate_noise, sizeof(double) * n);
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      uint32_t ctr[4] = {slot, rx_id[i], RNG_DELIVERY, 0};
+      uint32_t out[4];
+      philox4x32(ctr, key, out);
+      fate_bits[2*i]   = out[0];
+      fate_bits[2*i+1] = out[1];
+    }
+
+  for (i = 0; i < n; i++)
+    fate_success[i] = fate_arrives(fate_bits[2*i], rate);
+
+  if (simparams->distance_noise > 0.0)
+    for (i = 0; i < n; i++)
+      fate_noise[i] = fate_gauss(tx, rx_id[i], slot, fate_bits[2*i+1]);
+  else
+    for (i = 0; i < n; i++)
+      fate_noise[i] = 0;
+}
+
+/* The same draws as draw_message_fates(), for a single receiver. */
+static int draw_message_fate(kilobot *tx, kilobot *rx, uint32_t slot, double *noise)
+{
+  uint32_t key[2] = {rng_seed, tx->ID};
+  uint32_t ctr[4] = {slot, rx->ID, RNG_DELIVERY, 0};
+  uint32_t out[4];
+
+  philox4x32(ctr, key, out);
+  *noise = simparams->distance_noise > 0.0 ? fate_gauss(tx, rx->ID, slot, out[1]) : 0;
+  return fate_arrives(out[0], simparams->msg_success_rate);
+}
+
+/* Flip each bit of the message independently with probability p.
+ * The positions of the flipped bits are drawn as geometrically distributed
+ * gaps, so the cost is proportional to the number of errors rather than
+ * the number of bits in the message.
+ * Returns the number of flipped bits.
+ */
+int corrupt_message(message_t *msg, double p, rng_stream *rng)
+{
+  uint8_t *raw = (uint8_t *) msg;
+  int nbits = 8 * sizeof(message_t);
+  double l = log1p(-p);
+  int bit = -1, flipped = 0;
+
+  for (;;)
+    {
+      double gap = floor(log(rng_u01_open(rng_next32(rng))) / l);
+      if (gap >= nbits - 1 - bit)
+	break;
+      bit += 1 + (int) gap;
+      raw[bit / 8] ^= 1 << (bit % 8);
+      flipped++;
+    }
+
+  return flipped;
+}
+
+static inline comm_count *count_by_tag(comm_stats *stats, message_t *msg)
+{
+  return &stats->tag[comm_stats_tag_byte >= 0 ? msg->data[comm_stats_tag_byte] : 0];
+}
+
+static void count_sent(kilobot *tx, message_t *msg, comm_stats *stats)
+{
+  comm_count *by_type = &stats->type[msg->type];
+  comm_count *by_tag = count_by_tag(stats, msg);
+  tx->comm.sent++;
+  tx->comm.bytes += sizeof(message_t);
+  by_type->sent++;
+  by_type->bytes += sizeof(message_t);
+  by_tag->sent++;
+  by_tag->bytes += sizeof(message_t);
+}
+
+static inline void count_dropped(kilobot *rx, comm_count *by_type, comm_count *by_tag)
+{
+  rx->comm.dropped++;
+  by_type->dropped++;
+  by_tag->dropped++;
+}
+
+/* Deliver msg from tx to rx, unless it is lost: by chance (arrives is 0),
+ * by occlusion or by bit errors. noise is the receiver's distance noise
+ * sample. Counts the outcome in the receiver's counters and in stats.
+ */
+static void deliver_message(kilobot *tx, kilobot *rx, message_t *msg, uint32_t slot,
+			    int arrives, double noise, comm_stats *stats)
+{
+  distance_measurement_t distm;
+  message_t rx_msg;
+  rng_stream rng;
+  comm_count *by_type = &stats->type[msg->type];
+  comm_count *by_tag = count_by_tag(stats, msg);
+
+  if (!arrives) // messages arrive with some probability
+    {
+      count_dropped(rx, by_type, by_tag);
+      return;
+    }
+
+  double dist = bot_dist(tx, rx);
+
+  /* Line of sight: bots in the way either block the message, or
+   * weaken the signal so that the sender seems further away by
+   * occlusionFactor per bot, out of range eventually.
+   */
+  if (simparams->occlusion != OCCLUSION_NONE)
+    {
+      int blocking = count_occluders(tx, rx, simparams->occlusion == OCCLUSION_DROP ? 1 : tx->n_in_range);
+      if (blocking)
+	{
+	  dist *= pow(simparams->occlusionFactor, blocking);
+	  if (simparams->occlusion == OCCLUSION_DROP || dist >= tx->cr)
+	    {
+	      count_dropped(rx, by_type, by_tag);
+	      return;
+	    }
+	}
+    }
+
+  /* With the bit error model enabled, each receiver gets its own
+   * copy of the message, possibly corrupted, and discards it if the
+   * CRC does not match - as the kilobot does. Note that this also
+   * discards messages sent without a valid CRC.
+   */
+  if (simparams->msg_bit_error_rate > 0)
+    {
+      rx_msg = *msg;
+      rng_stream_init(&rng, rng_seed, tx->ID, slot, rx->ID, RNG_CORRUPTION);
+      corrupt_message(&rx_msg, simparams->msg_bit_error_rate, &rng);
+      if (message_crc(&rx_msg) != rx_msg.crc)
+	{
+	  count_dropped(rx, by_type, by_tag);
+	  return;
+	}
+      msg = &rx_msg;
+    }
+
+  /* Set up a distance measurement structure.
+   * We know the true distance, so we just store it in the structure.
+   * estimate_distance() will just return high_gain.
+   */
+  distm.low_gain = 0;
+  distm.high_gain = noisy_distance(dist, noise);
+
+  rx->comm.delivered++;
+  by_type->delivered++;
+  by_tag->delivered++;
+
+  prepare_bot(rx);
+  kilo_message_rx(msg, &distm);
 }
 
 void pass_message(kilobot* tx)
 {
   /* Pass message from tx to all bots in range. */
-  distance_measurement_t distm;
+  uint32_t slot = tx->tx_ticks;
+  comm_stats *stats = &comm_stats_worker[0];
   int i;
   prepare_bot(tx);
-  //  kilo_uid = tx->ID;
-  //  mydata = tx->data;
   message_t * msg = kilo_message_tx();
-  finalize_bot(tx);
 
   if (msg)
     {
       tx->tx_enabled = 1;
+      count_sent(tx, msg, stats);
+
+      draw_message_fates(tx, slot, tx->n_in_range);
       //printf ("n_in_range=%d\n",tx->n_in_range);
       for (i = 0; i < tx->n_in_range; i++) {
 	kilobot *rx = allbots[tx->in_range[i]];
 #ifndef SKILO_HEADLESS
-	if (simparams->GUI)
+	if (simparams->GUI && simparams->showComms)
 	  addCommLine(tx, rx);
 #endif
-	
-	if (message_success()) // messages arrive with some probability
-	  {
-	    /* Set up a distance measurement structure.
-	     * We know the true distance, so we just store it in the structure.
-	     * estimate_distance() will just return high_gain.
-	     */
-	    distm.low_gain = 0;
-	    distm.high_gain = noisy_distance(bot_dist(tx, rx));
-	    
-	    prepare_bot(rx);
-	    kilo_message_rx(msg, &distm);
-	    finalize_bot(rx);
-	  }
+	deliver_message(tx, rx, msg, slot, fate_success[i], fate_noise[i], stats);
       }
       
       // Switch to the transmitting bot, to call kilo_message_tx_success().
       prepare_bot(tx);
       kilo_message_tx_success();
-      finalize_bot(tx);
     }
   else
     {
       tx->tx_enabled = 0;
     }
 }
- 
+
+/* Parallel messaging, in three phases with a barrier between them:
+ *
+ * 1. every bot due to transmit calls kilo_message_tx(), and the message is
+ *    copied to the bot's outbox.
+ * 2. every bot receives the messages of the transmitters in its range,
+ *    in order of transmitter ID.
+ * 3. every bot that transmitted calls kilo_message_tx_success().
+ *
+ * Each phase only changes the state of the bot it is run for, and the
+ * random draws depend only on the (transmitter, receiver, slot), so the
+ * result does not depend on the number of threads.
+ */
+static void collect_messages(int begin, int end, void *arg)
+{
+  comm_stats *stats = &comm_stats_worker[pool_worker];
+
+  for (int i = begin; i < end; i++)
+    {
+      kilobot *tx = allbots[i];
+      tx->tx_slot = -1;
+      if (kilo_ticks < tx->tx_ticks)
+	continue;
+
+      prepare_bot(tx);
+      message_t *msg = kilo_message_tx();
+      tx->tx_enabled = msg != NULL;
+      if (msg)
+	{
+	  tx->outbox = *msg;
+	  tx->tx_slot = tx->tx_ticks;
+	  count_sent(tx, msg, stats);
+	}
+      tx->tx_ticks += tx_period_ticks;
+    }
+}
+
+// indices of the transmitters heard by the receiver, per worker thread
+static __thread int *inbox = NULL;
+static __thread int inbox_size = 0;
+
+static void deliver_messages(int begin, int end, void *arg)
+{
+  comm_stats *stats = &comm_stats_worker[pool_worker];
+
+  for (int i = begin; i < end; i++)
+    {
+      kilobot *rx = allbots[i];
+      int n = 0, j, k;
+
+      if (rx->n_in_range > inbox_size)
+	{
+	  inbox_size = rx->n_in_range;
+	  inbox = (int *) realloc(inbox, sizeof(int) * inbox_size);
+	}
+
+      // insertion sort by ID - the lists are short
+      for (j = 0; j < rx->n_in_range; j++)
+	{
+	  int t = rx->in_range[j];
+	  if (allbots[t]->tx_slot < 0)
+	    continue;
+	  for (k = n++; k > 0 && allbots[inbox[k-1]]->ID > allbots[t]->ID; k--)
+	    inbox[k] = inbox[k-1];
+	  inbox[k] = t;
+	}
+
+      for (k = 0; k < n; k++)
+	{
+	  kilobot *tx = allbots[inbox[k]];
+	  double noise;
+	  int arrives = draw_message_fate(tx, rx, tx->tx_slot, &noise);
+	  deliver_message(tx, rx, &tx->outbox, tx->tx_slot, arrives, noise, stats);
+	}
+    }
+}
+
+static void confirm_messages(int begin, int end, void *arg)
+{
+  for (int i = begin; i < end; i++)
+    if (allbots[i]->tx_slot >= 0)
+      {
+	prepare_bot(allbots[i]);
+	kilo_message_tx_success();
+      }
+}
+
+/* The phases of parallel messaging, for bots 0 ... n_bots-1. */
+void collect_all_messages(int n_bots)
+{
+  pool_for(sim->pool, n_bots, collect_messages, NULL);
+}
+
+void deliver_all_messages(int n_bots)
+{
+  pool_for(sim->pool, n_bots, deliver_messages, NULL);
+}
+
+void confirm_all_messages(int n_bots)
+{
+  pool_for(sim->pool, n_bots, confirm_messages, NULL);
+}
+
 void process_messaging(int n_bots)
 {
   /* Update messaging between bots. */
 
-  for (int i=0; i<n_bots; i++) {
-    if (kilo_ticks >= allbots[i]->tx_ticks) {
-      allbots[i]->tx_ticks += tx_period_ticks;
-      pass_message(allbots[i]);
+  if (simparams->parallelMessaging)
+    {
+      collect_all_messages(n_bots);
+#ifndef SKILO_HEADLESS
+      if (simparams->GUI && simparams->showComms)
+	for (int i = 0; i < n_bots; i++)
+	  if (allbots[i]->tx_slot >= 0)
+	    for (int j = 0; j < allbots[i]->n_in_range; j++)
+	      addCommLine(allbots[i], allbots[allbots[i]->in_range[j]]);
+#endif
+      deliver_all_messages(n_bots);
+      confirm_all_messages(n_bots);
+    }
+  else
+    for (int i=0; i<n_bots; i++) {
+      if (kilo_ticks >= allbots[i]->tx_ticks) {
+	pass_message(allbots[i]);
+	allbots[i]->tx_ticks += tx_period_ticks;
+      }
     }
-  }
 
 #ifndef SKILO_HEADLESS
-  // Run removeOldCommLines at most once every kilo_ticks.
-  static int last_ticks = 0;
-  if (simparams->GUI && kilo_ticks > last_ticks) {
-    removeOldCommLines(kilo_ticks-last_ticks, tx_period_ticks);
-    last_ticks = kilo_ticks;
-  }
+  if (simparams->GUI)
+    removeOldCommLines(kilo_ticks, tx_period_ticks);
   #endif
 }
 
 
 /* Functions called by the runsim/headless process_bots function. */
 
-void run_all_bots(int n_bots)
+/* The bots' loop() runs on coroutines, runners, so that delay() can
+ * suspend a bot until its wake-up tick. A worker thread runs loop() for one
+ * bot after the other on the same runner. A bot that calls delay() keeps its
+ * runner, and is resumed by the same worker thread once its time has come,
+ * before the other bots run; meanwhile the worker uses another runner.
+ * Parked bots are skipped when running the others, so they cost one
+ * comparison per step.
+ */
+static void runner_main(void *arg)
 {
-  /* Run the user program for each bot. */
-  int i;
-  for (i=0; i<n_bots; i++) {
-    prepare_bot(allbots[i]);
+  runner *r = (runner *) arg;
+  for (;;)
+    {
+      r->bot->user_loop();
+      r->bot = NULL;
+      coro_yield();
+    }
+}
+
+static void park(bot_runners *w, kilobot *bot)
+{
+  if (w->n_parked == w->parked_size)
+    {
+      w->parked_size = w->parked_size ? 2 * w->parked_size : 64;
+      w->parked = (kilobot **) realloc(w->parked, sizeof(kilobot *) * w->parked_size);
+    }
+  w->parked[w->n_parked++] = bot;
+}
+
+// run r until the bot's loop() returns or the bot waits in delay()
+static void resume_runner(bot_runners *w, runner *r)
+{
+  coro_resume(r->co);
+  if (r->bot)
+    {
+      r->bot->runner = r;
+      park(w, r->bot);
+    }
+  else
+    {
+      r->next = w->spare;
+      w->spare = r;
+    }
+}
+
+static void run_bots(int begin, int end, void *arg)
+{
+  bot_runners *w = &sim->runners[pool_worker];
+
+  for (int i = begin; i < end; i++) {
+    kilobot *bot = allbots[i];
+    // a switch to a coroutine stalls the processor, so it cannot fetch
+    // the next bots from memory in the meantime by itself
+    if (i + 8 < end)
+      {
+	__builtin_prefetch(&allbots[i + 8]->runner);
+	__builtin_prefetch(&allbots[i + 8]->ctx);
+      }
+    if (i + 4 < end)
+      __builtin_prefetch(allbots[i + 4]->data);
+    if (bot->runner)
+      continue;  // in delay(), see resume_bots()
+    prepare_bot(bot);
     //printf ("running bot %d.\n", kilo_uid);
-    current_bot->user_loop();
-    finalize_bot(allbots[i]);
+    if (simparams->botStackSize <= 0)
+      {
+	current_bot->user_loop();
+	continue;
+      }
+
+    runner *r = w->spare;
+    if (r)
+      w->spare = r->next;
+    else
+      {
+	r = (runner *) malloc(sizeof(runner));
+	r->co = coro_create(simparams->botStackSize, runner_main, r);
+      }
+    r->bot = bot;
+    resume_runner(w, r);
   }
 }
 
+// continue the bots of this worker whose delay() is over
+static void resume_bots(int begin, int end, void *arg)
+{
+  bot_runners *w = &sim->runners[pool_worker];
+  int i = 0;
+
+  while (i < w->n_parked)
+    {
+      kilobot *bot = w->parked[i];
+      if ((int32_t) (bot->wake_tick - kilo_ticks) > 0)
+	{
+	  i++;
+	  continue;
+	}
+      w->parked[i] = w->parked[--w->n_parked];
+      runner *r = bot->runner;
+      bot->runner = NULL;
+      prepare_bot(bot);
+      resume_runner(w, r);
+    }
+}
+
+void run_all_bots(int n_bots)
+{
+  /* Run the user program for each bot, in parallel if there are several
+   * worker threads. Each bot only touches its own data, so the order
+   * does not matter.
+   */
+  pool_each(sim->pool, resume_bots, NULL);
+  pool_for(sim->pool, n_bots, run_bots, NULL);
+}
+
+// hand the runners of workers from ... POOL_MAX_THREADS-1 to worker 0
+static void merge_runners(int from)
+{
+  bot_runners *w0 = &sim->runners[0];
+
+  for (int t = from; t < POOL_MAX_THREADS; t++)
+    {
+      bot_runners *w = &sim->runners[t];
+      while (w->spare)
+	{
+	  runner *r = w->spare;
+	  w->spare = r->next;
+	  r->next = w0->spare;
+	  w0->spare = r;
+	}
+      for (int i = 0; i < w->n_parked; i++)
+	park(w0, w->parked[i]);
+      w->n_parked = 0;
+    }
+}
+
+/* Free the runners not held by a bot. */
+void free_runners(void)
+{
+  merge_runners(1);
+  while (sim->runners[0].spare)
+    {
+      runner *r = sim->runners[0].spare;
+      sim->runners[0].spare = r->next;
+      coro_free(r->co);
+      free(r);
+    }
+  for (int t = 0; t < POOL_MAX_THREADS; t++)
+    {
+      free(sim->runners[t].parked);
+      sim->runners[t].parked = NULL;
+      sim->runners[t].n_parked = sim->runners[t].parked_size = 0;
+    }
+}
+
+static void enter_sim(void *s)
+{
+  sim = (sim_t *) s;
+}
+
+/* Run the bots of the current simulation on n_threads threads,
+ * n_threads <= 0 for one per CPU core. The workers work on the simulation
+ * of the calling thread.
+ */
+void sim_set_threads(int n_threads)
+{
+  pool_destroy(sim->pool);
+  sim->pool = n_threads == 1 ? NULL : pool_create(n_threads, enter_sim, sim);
+  // bots waiting in delay() on workers that are gone
+  merge_runners(pool_size(sim->pool));
+}
+
 void update_all_bots(int n_bots, float timestep)
 {
   /* Progress the simulation by a timestep. */
@@ -757,7 +1264,7 @@ void update_all_bots(int n_bots, float timestep)
   process_messaging(n_bots);
 }
 
-char botinfo_buffer[500];
+__thread char botinfo_buffer[500];
 
 //default callback_botinfo function
 char *botinfo_simple()
@@ -795,4 +1302,6 @@ void process_bots(int n_bots, float timestep)
 {
     run_all_bots(n_bots);
     update_all_bots(n_bots, timestep);
+    // code running between the steps is outside of any bot
+    leave_bot();
 }
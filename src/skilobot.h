@@ -1,6 +1,8 @@
 #include<stdlib.h>
 #include<stdint.h>
 #include"kilolib.h"
+#include"rng.h"
+#include"commstats.h"
 
 #ifndef SKILOBOT_H
 #define SKILOBOT_H
@@ -13,7 +15,9 @@
 
 //#include "userdata.h" //declarations of user data
 
-#define MAXCOMMLINES 10000
+#define COMMLINES_INITIAL 1024 // initial capacity of the communication line store
+
+struct runner;  // coroutine running a bot's loop(), skilobot.c
 
 typedef struct {
   double x, y;
@@ -40,28 +44,41 @@ typedef struct {
   int radius;       // kilobot radius in mm
   double leg_angle; // angle front leg - center - rear leg in radians
 
-  int *in_range;
+  int index;      // position in allbots
+  int *in_range;  // allbots indices of the bots in communication range
   int n_in_range;
+  int in_range_size;  // room in in_range, grown by add_in_range()
 
   /* Messaging */
   double cr; // Communication radius
   int tx_enabled;  //1 if the bot is transmitting - used for drawing communication circles
   int tx_ticks;    //the time in ticks when this bot is to transmit next
+  int tx_slot;     //with parallelMessaging: slot of the message in outbox, -1 if not sending
+  message_t outbox;
   
   int screen_x, screen_y; //where the bot is drawn on screen
 
+  /* Communication counters: sent and bytes as transmitter,
+   * delivered and dropped as receiver */
+  comm_count comm;
+
   /* Random number generator */ 
   uint8_t seed;  //for the software random number generator
   uint8_t accumulator;
+  uint32_t hard_draws;  // rand_hard() calls so far, the counter of its random numbers
+  uint32_t n_events;    // sim_event() calls so far, to keep the bot's events in order
 
   /* Setup and loop functions */
   void (*user_setup)(void);
   void (*user_loop)(void);
 
-  // 
-  message_tx_t kilo_message_tx;
-  message_tx_success_t kilo_message_tx_success;
-  message_rx_t kilo_message_rx;
+  // while the bot waits in delay(): the coroutine running its loop(),
+  // and the tick when it goes on
+  struct runner *runner;
+  uint32_t wake_tick;
+
+  // kilolib state of this bot: UID and messaging functions
+  kilo_context_t ctx;
   
   void *data;
   
@@ -76,20 +93,49 @@ typedef struct
 {
   kilobot *from;
   kilobot *to;
-  int time;
+  int time;   // kilo_ticks when the message was passed
 } CommLine;
 
-extern CommLine commLines[];
-extern int NcommLines;
+/* Communication lines, kept as a ring buffer in the order they were added.
+ * Since lines expire in the same order, expiry only touches the expired lines.
+ * The capacity is a power of two, doubled when the buffer is full.
+ */
+typedef struct
+{
+  CommLine *lines;
+  int capacity;
+  int head;   // index of the oldest line
+  int count;
+} CommLineStore;
+
+void addCommLine(kilobot *from, kilobot *to);
+void removeOldCommLines(int now, int maxt);
+void setCommLineViewport(double x_min, double y_min, double x_max, double y_max);
 
+void freeCommLines(void);
 
-extern int n_bots;
 //extern void (*user_setup)(void);
 //extern void (*user_loop)(void);
 
-extern kilobot** allbots;
+// the initial room in a bot's in_range list
+#define IN_RANGE_SIZE 16
+
+// add the bot at allbots index to the bots in range of bot
+static inline void add_in_range(kilobot *bot, int index)
+{
+  if (bot->n_in_range == bot->in_range_size)
+    {
+      bot->in_range_size = bot->in_range_size ? 2 * bot->in_range_size : IN_RANGE_SIZE;
+      bot->in_range = (int *) realloc(bot->in_range, sizeof(int) * bot->in_range_size);
+    }
+  bot->in_range[bot->n_in_range++] = index;
+}
+
 void create_bots(int n_bots);
 kilobot *new_kilobot(int ID, int n_bots);
+void free_kilobot(kilobot *bot);
+void free_all_bots(void);
+void free_runners(void);
 void init_all_bots(int n_bots);
 void user_setup_all_bots(int n_bots);
 void run_all_bots(int n_bots);
@@ -97,29 +143,37 @@ void dump_all_bots(int n_bots);
 void update_all_bots(int n_bots, float timestep);
 double bot_dist(kilobot *bot1, kilobot *bot2);
 void process_bots(int n_bots, float timestep);
+void update_bot(kilobot *bot, float timestep);
 void update_interactions(int n_bots);
 coord2D separation_unit_vector(kilobot* bot1, kilobot* bot2);
 void separate_clashing_bots(kilobot* bot1, kilobot* bot2);
 void spread_out(int n_bots, double k);
 
-extern kilobot* current_bot;
+// the bot currently running on this thread
+#define current_bot ((kilobot *) kilo_ctx->bot)
 
 // we need to supress this declaration in user code
 #ifndef KILOMBO_H
-extern void* mydata;
+extern __thread void* mydata;
 #endif
 
 kilobot *Me();
 void prepare_bot(kilobot *bot);
-void finalize_bot(kilobot *bot);
+void leave_bot(void);
 
 void set_speeds(kilobot * bot, uint8_t left, uint8_t right);
 
+void message_crc_init(void);
+void draw_message_fates(kilobot *tx, uint32_t slot, int n);
+void collect_all_messages(int n_bots);
+void deliver_all_messages(int n_bots);
+void confirm_all_messages(int n_bots);
+int corrupt_message(message_t *msg, double p, rng_stream *rng);
+
 int bot_main (void);
 
 enum {PAUSE, RUNNING};
 extern int state;   //simulator state. PAUSE or RUNNING.
-extern int tx_period_ticks;
 extern int fullSpeed;
 extern int stepsPerFrame;
 
@@ -0,0 +1,356 @@
+/* Asynchronous state snapshots, see snapshot.h.
+ *
+ * The buffers form a single-producer single-consumer ring: the simulation
+ * fills the buffer at tail, the writer thread empties the one at head.
+ * Each index is only written by one side, so no locks are needed. When all
+ * buffers are full, the simulation waits for the writer.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <jansson.h>
+
+#include "skilobot.h"
+#include "params.h"
+#include "sim.h"
+#include "stateio.h"
+#include "snapshot.h"
+#include "trajectory.h"
+#include "rng.h"
+
+extern int UserdataSize;
+
+typedef struct {
+  int ticks;
+  int n_bots;
+  int capacity;
+  kilobot *bots;       // copies of the bots ...
+  kilobot **bot_ptrs;  // ... and pointers to them, for json_rep_bots()
+  char *userdata;      // copies of the bots' USERDATA
+  comm_stats comm;
+  ktr_frame frame;     // for binary state files, the columns instead
+  int fields;          // the parts of the bots' states to write, 1 << STATE_...
+} snapshot;
+
+// the fields of USERDATA, if the bot program described them
+static const ktr_field *layout;
+
+void set_userdata_layout(const ktr_field *fields)
+{
+  layout = fields;
+}
+
+// the writer of one simulation, sim->snapshots
+struct snapshot_writer {
+  snapshot buffers[SNAPSHOT_BUFFERS];
+  unsigned head, tail;  // buffers head ... tail-1 are full
+  int stopping;
+  pthread_t thread;
+  sim_t *sim;
+  FILE *out;      // the state file, NULL if it could not be opened
+  int format;     // STATE_JSONL, STATE_JSON or STATE_BINARY
+  int n_written;  // states in the file so far
+
+  ktr_writer *ktr;  // for binary state files
+};
+
+static void pause_briefly(void)
+{
+  struct timespec t = {0, 200000};
+  nanosleep(&t, NULL);
+}
+
+/* Whether bot id goes to the state file, by the bots and sample of
+ * stateSelection. Whether a bot is in the sample depends only on the seed
+ * and its ID, so it is the same in every state.
+ */
+static int bot_selected(int id)
+{
+  const simulation_params *p = simparams;
+  int i, in = p->stateBotRangeCount == 0;
+
+  for (i = 0; i < p->stateBotRangeCount && !in; i++)
+    in = id >= p->stateBotRanges[2*i] && id <= p->stateBotRanges[2*i+1];
+  if (in && p->stateBotSample < 1)
+    {
+      rng_stream r;
+      rng_stream_init(&r, rng_seed, id, 0, 0, RNG_SELECTION);
+      in = rng_next_u01(&r) < p->stateBotSample;
+    }
+  return in;
+}
+
+static int all_bots_selected(void)
+{
+  return simparams->stateBotRangeCount == 0 && simparams->stateBotSample >= 1;
+}
+
+/* Copy the selected bots into s. The copies point to their own USERDATA
+ * and context, so that json_state callbacks can run on them while the
+ * simulation goes on.
+ */
+static void fill_snapshot(snapshot *s, int ticks, int fields)
+{
+  int n_bots = sim->n_bots, all = all_bots_selected(), n = 0;
+
+  if (n_bots > s->capacity)
+    {
+      s->capacity = n_bots;
+      s->bots = (kilobot *) realloc(s->bots, sizeof(kilobot) * n_bots);
+      s->bot_ptrs = (kilobot **) realloc(s->bot_ptrs, sizeof(kilobot *) * n_bots);
+      s->userdata = (char *) realloc(s->userdata, (size_t) UserdataSize * n_bots);
+    }
+
+  s->ticks = ticks;
+  s->fields = fields;
+  for (int i = 0; i < n_bots; i++)
+    {
+      if (!all && !bot_selected(allbots[i]->ID))
+	continue;
+      kilobot *b = &s->bots[n];
+      *b = *allbots[i];
+      b->data = s->userdata + (size_t) UserdataSize * n;
+      memcpy(b->data, allbots[i]->data, UserdataSize);
+      b->ctx.bot = b;
+      s->bot_ptrs[n++] = b;
+    }
+  s->n_bots = n;
+
+  if (simparams->commStats && (fields & 1 << STATE_COMM))
+    comm_stats_merge(&s->comm);
+}
+
+/* For binary state files, gather only the stored fields of the selected
+ * bots into the columns of s->frame, and the raw USERDATA one bot after
+ * another.
+ */
+static void fill_frame(snapshot *s, int ticks, int fields)
+{
+  ktr_frame *f = &s->frame;
+  int n = sim->n_bots, all = all_bots_selected(), j = 0;
+  int userdata = simparams->stateFileUserdata;
+
+  if (n > s->capacity)
+    {
+      s->capacity = n;
+      f->id = (int32_t *) realloc(f->id, sizeof(int32_t) * n);
+      f->x = (double *) realloc(f->x, sizeof(double) * n);
+      f->y = (double *) realloc(f->y, sizeof(double) * n);
+      f->direction = (double *) realloc(f->direction, sizeof(double) * n);
+      f->r_led = (uint8_t *) realloc(f->r_led, n);
+      f->g_led = (uint8_t *) realloc(f->g_led, n);
+      f->b_led = (uint8_t *) realloc(f->b_led, n);
+      if (userdata)
+	f->userdata = (uint8_t *) realloc(f->userdata, (size_t) UserdataSize * n);
+    }
+
+  s->fields = fields;
+  userdata = userdata && (fields & 1 << STATE_USERSTATE);
+  f->ticks = ticks;
+  for (int i = 0; i < n; i++)
+    {
+      const kilobot *b = allbots[i];
+      if (!all && !bot_selected(b->ID))
+	continue;
+      f->id[j] = b->ID;
+      if (fields & 1 << STATE_POSITION)
+	{
+	  f->x[j] = b->x;
+	  f->y[j] = b->y;
+	  f->direction[j] = b->direction;
+	}
+      if (fields & 1 << STATE_LED)
+	{
+	  f->r_led[j] = b->r_led;
+	  f->g_led[j] = b->g_led;
+	  f->b_led[j] = b->b_led;
+	}
+      if (userdata)
+	memcpy(f->userdata + (size_t) UserdataSize * j, b->data, UserdataSize);
+      j++;
+    }
+  f->n_bots = j;
+}
+
+// the columns of s to write, those of the parts not in this state NULL
+static ktr_frame frame_of(const snapshot *s)
+{
+  ktr_frame f = s->frame;
+
+  if (!(s->fields & 1 << STATE_POSITION))
+    f.x = f.y = f.direction = NULL;
+  if (!(s->fields & 1 << STATE_LED))
+    f.r_led = f.g_led = f.b_led = NULL;
+  if (!(s->fields & 1 << STATE_USERSTATE))
+    f.userdata = NULL;
+  return f;
+}
+
+static void free_snapshot(snapshot *s)
+{
+  free(s->bots);
+  free(s->bot_ptrs);
+  free(s->userdata);
+  free(s->frame.id);
+  free(s->frame.x);
+  free(s->frame.y);
+  free(s->frame.direction);
+  free(s->frame.r_led);
+  free(s->frame.g_led);
+  free(s->frame.b_led);
+  free(s->frame.userdata);
+}
+
+/* Append one state to the file, and flush it, so that the states written
+ * survive a crash of the simulation.
+ */
+static void write_state(struct snapshot_writer *w, json_t *state)
+{
+  if (!w->out)
+    return;
+  if (w->format == STATE_JSON)
+    {
+      fputs(w->n_written ? ",\n" : "[\n", w->out);
+      json_dumpf(state, w->out, JSON_INDENT(2) | JSON_SORT_KEYS);
+    }
+  else
+    {
+      json_dumpf(state, w->out, JSON_COMPACT | JSON_SORT_KEYS);
+      fputc('\n', w->out);
+    }
+  fflush(w->out);
+  w->n_written++;
+}
+
+static void *writer_main(void *arg)
+{
+  struct snapshot_writer *w = (struct snapshot_writer *) arg;
+
+  // the json_state callbacks may read the parameters of the simulation
+  sim = w->sim;
+
+  for (;;)
+    {
+      unsigned t = __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE);
+      if (w->head == t)
+	{
+	  if (__atomic_load_n(&w->stopping, __ATOMIC_ACQUIRE) &&
+	      w->head == __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE))
+	    break;
+	  pause_briefly();
+	  continue;
+	}
+
+      snapshot *s = &w->buffers[w->head % SNAPSHOT_BUFFERS];
+      if (w->ktr)
+	{
+	  ktr_frame f = frame_of(s);
+	  ktr_write(w->ktr, &f);
+	  w->n_written++;
+	}
+      else
+	{
+	  json_t *state = json_rep_fields(s->bot_ptrs, s->n_bots, s->ticks, &s->comm, s->fields);
+	  write_state(w, state);
+	  json_decref(state);
+	}
+      __atomic_store_n(&w->head, w->head + 1, __ATOMIC_RELEASE);
+    }
+
+  if (w->ktr && ktr_close_writer(w->ktr))
+    fprintf(stderr, "Error writing the state file\n");
+
+  if (w->out)
+    {
+      if (w->format == STATE_JSON)
+	fputs(w->n_written ? "\n]\n" : "[]\n", w->out);
+      fclose(w->out);
+    }
+  return NULL;
+}
+
+/* Start saving the states of the current simulation to filename. */
+void snapshot_writer_start(const char *filename)
+{
+  struct snapshot_writer *w = (struct snapshot_writer *) calloc(1, sizeof(struct snapshot_writer));
+
+  w->sim = sim;
+  w->format = simparams->stateFileFormat;
+  if (w->format == STATE_BINARY)
+    {
+      w->ktr = ktr_create(filename, simparams->stateFileUserdata ? UserdataSize : 0);
+      if (w->ktr)
+	{
+	  ktr_set_precision(w->ktr, simparams->stateFilePrecision);
+	  ktr_set_userdata_layout(w->ktr, layout);
+	}
+    }
+  else
+    w->out = fopen(filename, "w");
+  if (!w->out && !w->ktr)
+    fprintf(stderr, "Could not open the state file %s\n", filename);
+  if (pthread_create(&w->thread, NULL, writer_main, w))
+    {
+      fprintf(stderr, "Could not start the state writer thread.\n");
+      exit(1);
+    }
+  sim->snapshots = w;
+}
+
+/* The parts of the bots' states due at step, as a set of 1 << STATE_..., or
+ * 0 if no state is to be written. A state requested by a bot has all the
+ * parts that are ever written.
+ */
+int snapshot_fields(int step)
+{
+  const int *steps = simparams->stateFieldSteps;
+  int fields = 0, i;
+  int requested = __atomic_exchange_n(&sim->snapshot_requested, 0, __ATOMIC_RELAXED);
+
+  for (i = 0; i < N_STATE_FIELDS; i++)
+    if (steps[i] > 0 && (requested || step % steps[i] == 0))
+      fields |= 1 << i;
+  return fields;
+}
+
+// called by bots, in any thread
+void request_snapshot(void)
+{
+  __atomic_store_n(&sim->snapshot_requested, 1, __ATOMIC_RELAXED);
+}
+
+void snapshot_take(int ticks, int fields)
+{
+  struct snapshot_writer *w = sim->snapshots;
+
+  // wait for a free buffer
+  while (w->tail - __atomic_load_n(&w->head, __ATOMIC_ACQUIRE) == SNAPSHOT_BUFFERS)
+    pause_briefly();
+
+  if (w->ktr)
+    fill_frame(&w->buffers[w->tail % SNAPSHOT_BUFFERS], ticks, fields);
+  else
+    fill_snapshot(&w->buffers[w->tail % SNAPSHOT_BUFFERS], ticks, fields);
+  __atomic_store_n(&w->tail, w->tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Write out the remaining snapshots and close the state file. */
+void snapshot_writer_stop(void)
+{
+  struct snapshot_writer *w = sim->snapshots;
+
+  if (!w)
+    return;
+  __atomic_store_n(&w->stopping, 1, __ATOMIC_RELEASE);
+  pthread_join(w->thread, NULL);
+
+  for (int i = 0; i < SNAPSHOT_BUFFERS; i++)
+    free_snapshot(&w->buffers[i]);
+  free(w);
+  sim->snapshots = NULL;
+}
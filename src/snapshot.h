@@ -0,0 +1,32 @@
+/* Asynchronous saving of the simulation state.
+ *
+ * snapshot_take() copies the bots and their USERDATA into a free buffer and
+ * hands it to a background thread, which converts it to JSON - calling the
+ * json_state callback of each bot - and appends it to the state file right
+ * away, as one line of JSON Lines or as an element of a JSON array. For a
+ * binary trajectory file (see trajectory.h), only the stored fields are
+ * copied, straight into columns, with the raw USERDATA if wanted. The
+ * simulation only pays for the copy, and memory use does not grow with the
+ * number of states.
+ *
+ * Which bots and which parts of their states are written, and how often,
+ * is set by the stateSelection parameter; snapshot_fields() tells which
+ * parts are due at a step. A bot can also ask for a state to be written at
+ * the end of the current step with request_snapshot().
+ *
+ * Each simulation has a writer of its own; the functions work on the
+ * current simulation.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#define SNAPSHOT_BUFFERS 2
+
+void snapshot_writer_start(const char *filename);
+int snapshot_fields(int step);
+void snapshot_take(int ticks, int fields);
+void request_snapshot(void);
+void snapshot_writer_stop(void);
+
+#endif
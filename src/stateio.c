@@ -1,14 +1,23 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <ctype.h>
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <getopt.h>
 #include <math.h>
 #include <time.h>
 
 #include "skilobot.h"
 #include "params.h"
+#include "sim.h"
+#include "stateio.h"
 #include "kilolib.h"
+#include "trajectory.h"
 #include <jansson.h>
 
 json_t* (*callback_json_state) (void);
@@ -25,16 +34,38 @@ void json_store_int(json_t* root, const char *key, int value)
 json_object_set_new(root, key, jvalue);
 }
 
-json_t* json_bot_rep(kilobot *bot)
+// the parts of a bot's state written unless stateSelection says otherwise
+#define DEFAULT_FIELDS (1 << STATE_POSITION | 1 << STATE_USERSTATE | 1 << STATE_COMM)
+
+/* The parts in fields, a set of 1 << STATE_..., of the state of bot. */
+json_t* json_bot_fields(kilobot *bot, int fields)
 {
   //printf("%d: %f, %f, %f\n", bot->ID, bot->x, bot->y, bot->direction);
 
   json_t* root = json_object();
 
   json_store_int(root, "ID", bot->ID);
-  json_store_double(root, "direction", bot->direction);
-  json_store_double(root, "x_position", bot->x);
-  json_store_double(root, "y_position", bot->y);
+  if (fields & 1 << STATE_POSITION)
+    {
+      json_store_double(root, "direction", bot->direction);
+      json_store_double(root, "x_position", bot->x);
+      json_store_double(root, "y_position", bot->y);
+    }
+
+  if (fields & 1 << STATE_LED)
+    {
+      json_t *led = json_array();
+      json_array_append_new(led, json_integer(bot->r_led));
+      json_array_append_new(led, json_integer(bot->g_led));
+      json_array_append_new(led, json_integer(bot->b_led));
+      json_object_set_new(root, "led", led);
+    }
+
+  if (simparams->commStats && (fields & 1 << STATE_COMM))
+    json_object_set_new(root, "comm", json_comm_count(&bot->comm));
+
+  if (!(fields & 1 << STATE_USERSTATE))
+    return root;
 
   /*
   // store history in bot state
@@ -60,6 +91,7 @@ json_t* json_bot_rep(kilobot *bot)
       // switch to the current bot
       prepare_bot(bot);
       j_state = callback_json_state();
+      leave_bot();
     }  
   else // if the bot did not define a callback function
     j_state = json_object();   // ... output an empty object
@@ -69,7 +101,22 @@ json_t* json_bot_rep(kilobot *bot)
   return root;
 }
 
-json_t* json_rep_all_bots(kilobot **bot_array, int array_size, int ticks)
+json_t* json_bot_rep(kilobot *bot)
+{
+  return json_bot_fields(bot, DEFAULT_FIELDS);
+}
+
+/* The state of the bots in bot_array, with the merged communication
+ * counters comm (may be NULL if commStats is off).
+ */
+json_t* json_rep_bots(kilobot **bot_array, int array_size, int ticks, const comm_stats *comm)
+{
+  return json_rep_fields(bot_array, array_size, ticks, comm, DEFAULT_FIELDS);
+}
+
+/* As json_rep_bots(), with only the parts in fields of each bot's state. */
+json_t* json_rep_fields(kilobot **bot_array, int array_size, int ticks, const comm_stats *comm,
+			int fields)
 {
   json_t* root = json_object();
   json_t* j_bot_array = json_array();
@@ -77,10 +124,12 @@ json_t* json_rep_all_bots(kilobot **bot_array, int array_size, int ticks)
   
   json_object_set_new(root, "bot_states", j_bot_array);
   json_store_int(root, "ticks", ticks);
+  if (simparams->commStats && comm && (fields & 1 << STATE_COMM))
+    json_object_set_new(root, "comm", json_comm_stats(comm));
    
   json_t *jbot;
   for (int i=0; i<array_size; i++) {
-    jbot = json_bot_rep(bot_array[i]);
+    jbot = json_bot_fields(bot_array[i], fields);
     json_array_append_new(j_bot_array, jbot);
   }
 
@@ -92,6 +141,15 @@ json_t* json_rep_all_bots(kilobot **bot_array, int array_size, int ticks)
 
 }
 
+json_t* json_rep_all_bots(kilobot **bot_array, int array_size, int ticks)
+{
+  comm_stats total;
+
+  if (simparams->commStats)
+    comm_stats_merge(&total);
+  return json_rep_bots(bot_array, array_size, ticks, &total);
+}
+
 void save_bot_state_to_file(kilobot **bot_array, int array_size, const char *filename)
 {
   json_t* root = json_rep_all_bots(bot_array, array_size, kilo_ticks);
@@ -103,73 +161,336 @@ void save_bot_state_to_file(kilobot **bot_array, int array_size, const char *fil
 
 
 
-double extract_double(json_t* js, const char *param_name)
-{
-  json_t *param = json_object_get(js, param_name);
-
-  if (!json_is_number(param)) {
-    fprintf(stderr, "error: Failed to read value: %s\n", param_name);
-    return 0;
-  }
+/* Loading the bots' start positions.
+ *
+ * A start file can hold hundreds of thousands of bots, so it is not loaded
+ * as a jansson tree. Instead the file is mapped into memory and scanned
+ * once for the start of each object in bot_states, only following quotes
+ * and brackets. Then the objects are parsed, and their bots created, in
+ * parallel, each bot into its place in the bot array. Only ID, x_position,
+ * y_position and direction are read, other members are skipped.
+ *
+ * A binary trajectory file can be given instead, see trajectory.h; the bots
+ * start from its first state.
+ */
 
-  return (double) json_real_value(param);
+static const char *skip_space(const char *p, const char *end)
+{
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+    p++;
+  return p;
 }
 
-int extract_int(json_t* js, const char *param_name)
+// the end of the string starting at p, after the closing quote, NULL if none
+static const char *skip_string(const char *p, const char *end)
 {
-  json_t *param = json_object_get(js, param_name);
+  for (p++; p < end; p++)
+    if (*p == '\\')
+      p++;
+    else if (*p == '"')
+      return p + 1;
+  return NULL;
+}
 
-  json_int_t i_param = json_integer_value(param);
+// the end of the JSON value starting at p, NULL if it does not end
+static const char *skip_value(const char *p, const char *end)
+{
+  int depth = 0;
 
-  return (int) i_param;
+  if (p < end && *p != '{' && *p != '[' && *p != '"')
+    {
+      // a number, true, false or null
+      const char *q = p;
+      while (q < end && *q != ',' && *q != ']' && *q != '}'
+	     && *q != ' ' && *q != '\t' && *q != '\n' && *q != '\r')
+	q++;
+      return q > p ? q : NULL;
+    }
+
+  while (p < end)
+    {
+      if (*p == '"')
+	{
+	  p = skip_string(p, end);
+	  if (!p || depth == 0)
+	    return p;
+	  continue;
+	}
+      if (*p == '{' || *p == '[')
+	depth++;
+      else if ((*p == '}' || *p == ']') && --depth == 0)
+	return p + 1;
+      p++;
+    }
+  return NULL;
 }
 
-kilobot* bot_from_json(json_t* bot_rep, int n_bots)
+/* The offsets of the objects in the bot_states array of the JSON object in
+ * text, in *start, and their number. On error -1, with the offset of the
+ * error in *at.
+ */
+static long find_bot_states(const char *text, size_t size, size_t **start, size_t *at)
 {
-  int ID = extract_int(bot_rep, "ID");
-
-  kilobot *bot = new_kilobot(ID, n_bots);
+  const char *end = text + size;
+  const char *p = skip_space(text, end);
+  long n = 0, capacity = 0;
 
-  bot->x = extract_double(bot_rep, "x_position");
-  bot->y = extract_double(bot_rep, "y_position");
-  bot->direction = extract_double(bot_rep, "direction");
+  *start = NULL;
+  if (p == end || *p != '{')
+    goto fail;
+  p = skip_space(p + 1, end);
 
-  return bot;
+  while (p < end && *p == '"')
+    {
+      const char *key = p + 1;
+      p = skip_string(p, end);
+      if (!p)
+	goto fail;
+      int found = p - 1 - key == 10 && memcmp(key, "bot_states", 10) == 0;
+      p = skip_space(p, end);
+      if (p == end || *p != ':')
+	goto fail;
+      p = skip_space(p + 1, end);
+
+      if (found)
+	{
+	  if (p == end || *p != '[')
+	    goto fail;
+	  p = skip_space(p + 1, end);
+	  while (p < end && *p == '{')
+	    {
+	      if (n == capacity)
+		{
+		  capacity = capacity ? 2 * capacity : 1024;
+		  *start = (size_t *) realloc(*start, sizeof(size_t) * capacity);
+		}
+	      (*start)[n++] = p - text;
+	      p = skip_value(p, end);
+	      if (!p)
+		goto fail;
+	      p = skip_space(p, end);
+	      if (p == end || *p != ',')
+		break;
+	      p = skip_space(p + 1, end);
+	    }
+	  if (p == end || *p != ']')
+	    goto fail;
+	  return n;
+	}
+
+      p = skip_value(p, end);
+      if (!p)
+	goto fail;
+      p = skip_space(p, end);
+      if (p < end && *p == ',')
+	p = skip_space(p + 1, end);
+    }
+
+ fail:
+  *at = p ? (size_t) (p - text) : size;
+  free(*start);
+  *start = NULL;
+  return -1;
 }
 
-kilobot** bot_loader(const char *filename, int *n_bots)
+/* The ID and the position (x, y, direction) of the bot object at p. Returns
+ * 0 if all of them were found.
+ */
+static int parse_bot(const char *p, const char *end, int *id, double pos[3])
 {
-  json_error_t error;
-  json_t* root;
+  static const char *const names[] = {"x_position", "y_position", "direction"};
+  int found = 0;
 
-  root = json_load_file(filename, 0, &error);
+  p = skip_space(p + 1, end);
+  while (p < end && *p == '"')
+    {
+      const char *key = p + 1, *q;
+      char *num;
+      int k;
+
+      p = skip_string(p, end);
+      if (!p)
+	return 1;
+      size_t len = p - 1 - key;
+      p = skip_space(p, end);
+      if (p == end || *p != ':')
+	return 1;
+      p = skip_space(p + 1, end);
+
+      for (k = 0; k < 3; k++)
+	if (strlen(names[k]) == len && memcmp(key, names[k], len) == 0)
+	  break;
+      if (len == 2 && memcmp(key, "ID", 2) == 0)
+	{
+	  *id = strtol(p, &num, 10);
+	  q = num;
+	  found |= 1;
+	}
+      else if (k < 3)
+	{
+	  pos[k] = strtod(p, &num);
+	  q = num;
+	  found |= 2 << k;
+	}
+      else
+	q = skip_value(p, end);
+      if (!q || q == p)
+	return 1;
+
+      p = skip_space(q, end);
+      if (p == end || *p != ',')
+	break;
+      p = skip_space(p + 1, end);
+    }
+  return p == end || *p != '}' || found != 15;
+}
 
-  if (!root) {
-    fprintf(stderr, "Failed to parse %s.\nLine %d: %s\n", filename, error.line,error.text);
-    return NULL;
-  }
+// the line number of offset at in text
+static int line_of(const char *text, size_t at)
+{
+  int line = 1;
+  for (size_t k = 0; k < at; k++)
+    line += text[k] == '\n';
+  return line;
+}
 
-  if (!json_is_object(root)) {
-    fprintf(stderr, "error: not an object\n");
-    return NULL;
-  }
+typedef struct {
+  const char *text;        // a JSON start file
+  size_t size;
+  size_t *start;           // ... and the offsets of its bot objects
+  const ktr_frame *frame;  // or the first state of a binary one
+  kilobot **bots;
+  int n_bots;
+} bot_load;
+
+// create bots begin ... end-1, leaving NULL for those that cannot be parsed
+static void load_bots(int begin, int end, void *arg)
+{
+  bot_load *l = (bot_load *) arg;
 
-  json_t* j_state_array = json_object_get(root, "bot_states");
+  for (int i = begin; i < end; i++)
+    {
+      double pos[3];
+      int id = 0;
+
+      if (l->frame)
+	{
+	  id = l->frame->id[i];
+	  pos[0] = l->frame->x[i];
+	  pos[1] = l->frame->y[i];
+	  pos[2] = l->frame->direction[i];
+	}
+      else if (parse_bot(l->text + l->start[i], l->text + l->size, &id, pos))
+	{
+	  l->bots[i] = NULL;
+	  continue;
+	}
+
+      kilobot *bot = new_kilobot(id, l->n_bots);
+      bot->x = pos[0];
+      bot->y = pos[1];
+      bot->direction = pos[2];
+      bot->index = i;
+      l->bots[i] = bot;
+    }
+}
 
-  if (!json_is_array(j_state_array)) {
-    fprintf(stderr, "error: bot_states is not an array\n");
-    return NULL;
-  }
+static void enter_sim(void *s)
+{
+  sim = (sim_t *) s;
+}
 
-  *n_bots = json_array_size(j_state_array);
-  json_t* bot_state;
-  kilobot **bots = (kilobot **) malloc(sizeof(kilobot *) * *n_bots);
+static kilobot **create_loaded_bots(bot_load *l, const char *filename)
+{
+  /* The simulation's own pool is only started once the bots are set up, so
+   * this one is for loading alone, and not worth starting for a few bots.
+   */
+  thread_pool *pool = NULL;
+  if (simparams->numThreads != 1 && l->n_bots >= 1000)
+    pool = pool_create(simparams->numThreads, enter_sim, sim);
+
+  l->bots = (kilobot **) malloc(sizeof(kilobot *) * l->n_bots);
+  pool_for(pool, l->n_bots, load_bots, l);
+  pool_destroy(pool);
+
+  int failed = 0;
+  for (int i = 0; i < l->n_bots; i++)
+    if (!l->bots[i] && !failed++)
+      fprintf(stderr, "Failed to parse %s.\nLine %d: bot %d needs a numeric ID, x_position, "
+	      "y_position and direction\n", filename, line_of(l->text, l->start[i]), i);
+  if (!failed)
+    return l->bots;
+
+  for (int i = 0; i < l->n_bots; i++)
+    if (l->bots[i])
+      free_kilobot(l->bots[i]);
+  free(l->bots);
+  return NULL;
+}
 
-  for (int i=0; i<*n_bots; i++) {
-    bot_state = json_array_get(j_state_array, i);
-    bots[i] = bot_from_json(bot_state, *n_bots);
-  }
+kilobot** bot_loader(const char *filename, int *n_bots)
+{
+  bot_load l;
+  kilobot **bots;
 
+  memset(&l, 0, sizeof(l));
+
+  if (is_trajectory(filename))
+    {
+      ktr_reader *r = ktr_open(filename);
+      ktr_frame f;
+
+      if (!r || ktr_read(r, &f) <= 0 || !f.x)
+	{
+	  fprintf(stderr, "Failed to read the bots' positions from the first state of %s.\n", filename);
+	  if (r)
+	    ktr_close(r);
+	  return NULL;
+	}
+      l.frame = &f;
+      l.n_bots = f.n_bots;
+      bots = create_loaded_bots(&l, filename);
+      ktr_close(r);
+    }
+  else
+    {
+      struct stat st;
+      int fd = open(filename, O_RDONLY);
+      size_t at;
+
+      if (fd < 0 || fstat(fd, &st))
+	{
+	  fprintf(stderr, "Could not open %s.\n", filename);
+	  if (fd >= 0)
+	    close(fd);
+	  return NULL;
+	}
+      l.size = st.st_size;
+      if (l.size > 0)
+	l.text = (const char *) mmap(NULL, l.size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if (l.text == MAP_FAILED)
+	{
+	  fprintf(stderr, "Could not read %s.\n", filename);
+	  return NULL;
+	}
+
+      long n = find_bot_states(l.text, l.size, &l.start, &at);
+      if (n < 0)
+	{
+	  fprintf(stderr, "Failed to parse %s.\nLine %d: expected an object with a bot_states array\n",
+		  filename, line_of(l.text, at));
+	  if (l.size > 0)
+	    munmap((void *) l.text, l.size);
+	  return NULL;
+	}
+      l.n_bots = n;
+      bots = create_loaded_bots(&l, filename);
+      munmap((void *) l.text, l.size);
+      free(l.start);
+    }
+
+  *n_bots = l.n_bots;
   return bots;
 }
 
@@ -0,0 +1,189 @@
+#include <stdlib.h>
+#include <check.h>
+
+#include <stdio.h>
+#include <string.h>
+#include "skilobot.h"
+#undef main // to prevent main here from being re-defined
+
+#include "params.h"
+#include "sim.h"
+#include "checkpoint.h"
+
+#define PARAM_FILE "check_checkpoint.json"
+#define CHECKPOINT_FILE "check_checkpoint.bin"
+#define N_BOTS 60
+
+// A bot program that moves, blinks, talks and draws random numbers, so that
+// its state depends on all of the simulation.
+typedef struct {
+    message_t msg;
+    uint8_t mode;
+    uint32_t n_rx, n_tx;
+    int32_t sum_dist;
+} USERDATA;
+int UserdataSize = sizeof(USERDATA);
+__thread void *mydata;
+#define botdata ((USERDATA *) mydata)
+
+void setup(void) {
+    memset(botdata, 0, sizeof(USERDATA));
+    botdata->mode = rand_hard() % 4;
+    botdata->msg.type = NORMAL;
+    botdata->msg.data[0] = kilo_uid;
+}
+
+void loop(void) {
+    if (kilo_ticks % 32 == kilo_uid % 32)
+        botdata->mode = (botdata->mode + rand_soft()) % 4;
+    set_color(RGB(botdata->mode, 0, botdata->n_rx % 4));
+    switch (botdata->mode) {
+        case 0: set_motors(0, 0); break;
+        case 1: set_motors(kilo_straight_left, kilo_straight_right); break;
+        case 2: set_motors(kilo_turn_left, 0); break;
+        default: set_motors(0, kilo_turn_right); break;
+    }
+    botdata->msg.data[1] = botdata->mode;
+    botdata->msg.crc = message_crc(&botdata->msg);
+}
+
+message_t *tx(void) { return &botdata->msg; }
+void tx_success(void) { botdata->n_tx++; }
+void rx(message_t *m, distance_measurement_t *d) {
+    botdata->n_rx++;
+    botdata->sum_dist += estimate_distance(d);
+    if (m->data[1] == 0 && botdata->mode == 1)
+        botdata->mode = 0;
+}
+
+int bot_main(void) {
+    kilo_init();
+    kilo_message_tx = tx;
+    kilo_message_tx_success = tx_success;
+    kilo_message_rx = rx;
+    kilo_start(setup, loop);
+    return 0;
+}
+
+simulation_params *read_params(void)
+{
+    FILE *f = fopen(PARAM_FILE, "w");
+    ck_assert(f != NULL);
+    fprintf(f, "{\"nBots\": %d, \"GUI\": 0, \"storeHistory\": 1}\n", N_BOTS);
+    fclose(f);
+    simulation_params *p = parse_param_file(PARAM_FILE);
+    remove(PARAM_FILE);
+    ck_assert(p != NULL);
+    p->GUI = 0;
+    p->numThreads = 1;
+    p->numProcesses = 1;
+    p->storeHistory = 1;
+    p->maxTime = 0;
+    return p;
+}
+
+#define ASSERT_SAME(a, b, field) ck_assert(memcmp(&(a)->field, &(b)->field, sizeof((a)->field)) == 0)
+
+void check_same_bots(sim_t *a, sim_t *b)
+{
+    comm_stats stats_a, stats_b;
+
+    ck_assert_int_eq(a->n_step, b->n_step);
+    ck_assert_int_eq(a->ticks, b->ticks);
+    ck_assert(a->time == b->time);
+    ck_assert_int_eq(a->n_bots, b->n_bots);
+
+    for (int i=0; i<a->n_bots; i++) {
+        kilobot *p = a->bots[i], *q = b->bots[i];
+        ASSERT_SAME(p, q, ID);
+        ASSERT_SAME(p, q, x);
+        ASSERT_SAME(p, q, y);
+        ASSERT_SAME(p, q, direction);
+        ASSERT_SAME(p, q, left_motor_power);
+        ASSERT_SAME(p, q, right_motor_power);
+        ASSERT_SAME(p, q, r_led);
+        ASSERT_SAME(p, q, g_led);
+        ASSERT_SAME(p, q, b_led);
+        ASSERT_SAME(p, q, tx_enabled);
+        ASSERT_SAME(p, q, tx_ticks);
+        ASSERT_SAME(p, q, outbox);
+        ASSERT_SAME(p, q, comm);
+        ASSERT_SAME(p, q, seed);
+        ASSERT_SAME(p, q, accumulator);
+        ASSERT_SAME(p, q, hard_draws);
+        ASSERT_SAME(p, q, p_hist);
+        ASSERT_SAME(p, q, n_hist);
+        ck_assert(memcmp(p->data, q->data, UserdataSize) == 0);
+        ck_assert(memcmp(p->x_history, q->x_history, sizeof(double) * p->n_hist) == 0);
+        ck_assert(memcmp(p->y_history, q->y_history, sizeof(double) * p->n_hist) == 0);
+    }
+
+    sim = a;
+    comm_stats_merge(&stats_a);
+    sim = b;
+    comm_stats_merge(&stats_b);
+    ck_assert(memcmp(&stats_a, &stats_b, sizeof(comm_stats)) == 0);
+}
+
+START_TEST(test_continue_from_checkpoint)
+{
+    // N steps, a checkpoint, and M steps from it in a new simulation, give
+    // the same as N + M steps in one go
+    const int n = 300, m = 200;
+    simulation_params *p = read_params();
+
+    sim_t *whole = sim_create(p, 17, N_BOTS, NULL);
+    ck_assert(whole != NULL);
+    sim_step(whole, n + m);
+
+    sim_t *first = sim_create(p, 17, N_BOTS, NULL);
+    ck_assert(first != NULL);
+    sim_step(first, n);
+    ck_assert_int_eq(checkpoint_save(CHECKPOINT_FILE), 0);
+    sim_destroy(first);
+
+    sim_t *rest = sim_create(p, 0, N_BOTS, CHECKPOINT_FILE);
+    ck_assert(rest != NULL);
+    remove(CHECKPOINT_FILE);
+    ck_assert_int_eq(rest->n_step, n);
+    sim_step(rest, m);
+
+    // the bots must have done something
+    USERDATA *d = (USERDATA *) rest->bots[0]->data;
+    ck_assert(d->n_rx > 0 && d->n_tx > 0);
+
+    check_same_bots(whole, rest);
+    sim_destroy(whole);
+    sim_destroy(rest);
+}
+END_TEST
+
+
+Suite *add_suite(void)
+{
+    Suite *s;
+    TCase *tc_core;
+
+    s = suite_create("checkpoint");
+    tc_core = tcase_create("core");
+
+    tcase_add_test(tc_core, test_continue_from_checkpoint);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void)
+{
+    int number_failed;
+    Suite *s;
+    SRunner *sr;
+
+    s = add_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_VERBOSE);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
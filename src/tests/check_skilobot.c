@@ -2,10 +2,17 @@
 #include <check.h>
 
 #include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
 #include "skilobot.h"
 #undef main // to prevent main here from being re-defined
 
 #include "params.h"
+#include "neighbors.h"
+#include "threadpool.h"
+#include "sim.h"
+#include "eventlog.h"
 
 
 
@@ -22,14 +29,18 @@ coord2D separation_unit_vector(kilobot *bot1, kilobot *bot2);
 void separate_clashing_bots(kilobot *bot1, kilobot *bot2);
 void reset_n_in_range_indices(int n_bots);
 void update_n_in_range_indices(kilobot *bot1, kilobot *bot2);
+void pass_message(kilobot *tx);
+void process_messaging(int n_bots);
+extern __thread uint8_t *fate_success;
+extern __thread double *fate_noise;
+void sim_event(int type, int a, int b);
 
 // Needed to compile any program with a library.
 //#include "kilolib.h"
 typedef struct { int num_bot_steps; } USERDATA;
 int UserdataSize = sizeof(USERDATA);
-void *mydata;
+__thread void *mydata;
 //char* botinfo_simple(void) { return NULL; }; 
-extern uint16_t kilo_uid;
 
 // simulator parameter structure.
 // to avoid dragging in the whole parameter parsing in this test, populate with default values here as needed.
@@ -37,7 +48,11 @@ simulation_params params = {
   .commsRadius = 70
 };
 
-simulation_params* simparams = &params;
+sim_t test_sim = {
+  .params = &params,
+  .tx_period = 15,
+  .tag_byte = -1
+};
 
 
 // Needed to setup a new kilobot.
@@ -46,7 +61,7 @@ int get_int_param(const char *param_name, int default_val) { return default_val;
 // Define a dummy bot_main function for testing purposes.
 int n_calls_to_bot_main = 0;
 int bot_main(void) {
-    n_calls_to_bot_main++;
+    __atomic_add_fetch(&n_calls_to_bot_main, 1, __ATOMIC_RELAXED);
     return 0;
 };
 
@@ -57,6 +72,10 @@ void setup(void) {
 void dummy_loop(void) {
     ((USERDATA* )mydata)->num_bot_steps++;
 }
+void delaying_loop(void) {
+    ((USERDATA* )mydata)->num_bot_steps++;
+    delay(100);  // 4 ticks
+}
 
 
 // Helper function to do a double comparison.
@@ -128,6 +147,100 @@ START_TEST(test_run_all_bots)
 }
 END_TEST
 
+START_TEST(test_run_all_bots_threads)
+{
+    int n = 1000;
+    create_bots(n);
+    init_all_bots(n);
+    for (int i=0; i<n; i++) {
+      prepare_bot(allbots[i]);
+      current_bot->user_loop = &dummy_loop;
+      setup();
+    }
+
+    sim_set_threads(4);
+    ck_assert_int_eq(pool_size(sim->pool), 4);
+    run_all_bots(n);
+    run_all_bots(n);
+    sim_set_threads(1);
+
+    for (int i=0; i<n; i++)
+      ck_assert_int_eq(((USERDATA* )allbots[i]->data)->num_bot_steps, 2);
+}
+END_TEST
+
+START_TEST(test_delay)
+{
+    int n = 500;
+    params.botStackSize = 16384;
+    create_bots(n);
+    init_all_bots(n);
+    for (int i=0; i<n; i++) {
+      prepare_bot(allbots[i]);
+      current_bot->user_loop = (i % 2) ? &delaying_loop : &dummy_loop;
+      setup();
+    }
+
+    sim_set_threads(4);
+    for (int t=0; t<=20; t++) {
+      kilo_ticks = t;
+      run_all_bots(n);
+    }
+    sim_set_threads(1);
+
+    // loop() runs again as soon as delay() has returned
+    for (int i=0; i<n; i++)
+      ck_assert_int_eq(((USERDATA* )allbots[i]->data)->num_bot_steps, (i % 2) ? 6 : 21);
+    for (int i=1; i<n; i+=2)
+      ck_assert(allbots[i]->runner != NULL);
+    free_all_bots();
+    free_runners();
+    kilo_ticks = 0;
+    params.botStackSize = 0;
+}
+END_TEST
+
+// run a simulation of n bots for n steps, in a thread of its own
+void *run_own_sim(void *arg)
+{
+    int n = (int) (intptr_t) arg;
+    sim_t *s = (sim_t *) calloc(1, sizeof(sim_t));
+    s->params = &params;
+    s->tx_period = 15;
+    sim = s;
+
+    create_bots(n);
+    init_all_bots(n);
+    for (int i=0; i<n; i++) {
+      prepare_bot(allbots[i]);
+      current_bot->user_loop = &dummy_loop;
+      setup();
+    }
+    sim_set_threads(2);
+    for (int i=0; i<n; i++)
+      run_all_bots(n);
+    return s;
+}
+
+START_TEST(test_separate_simulations)
+{
+    pthread_t t1, t2;
+    sim_t *s1, *s2;
+    pthread_create(&t1, NULL, run_own_sim, (void *) (intptr_t) 100);
+    pthread_create(&t2, NULL, run_own_sim, (void *) (intptr_t) 300);
+    pthread_join(t1, (void **) &s1);
+    pthread_join(t2, (void **) &s2);
+
+    ck_assert_int_eq(s1->n_bots, 100);
+    ck_assert_int_eq(s2->n_bots, 300);
+    for (int i=0; i<100; i++)
+      ck_assert_int_eq(((USERDATA* )s1->bots[i]->data)->num_bot_steps, 100);
+    for (int i=0; i<300; i++)
+      ck_assert_int_eq(((USERDATA* )s2->bots[i]->data)->num_bot_steps, 300);
+    ck_assert(sim == &test_sim);
+}
+END_TEST
+
 START_TEST(test_update_bot_history)
 {
     kilobot* k;
@@ -341,6 +454,20 @@ START_TEST(test_update_n_in_range_indices)
 }
 END_TEST
 
+START_TEST(test_add_in_range)
+{
+    // The list of bots in range grows past its initial size.
+    kilobot *k = new_kilobot(0, 1000);
+    for (int i=0; i<100; i++)
+        add_in_range(k, i);
+    ck_assert_int_eq(k->n_in_range, 100);
+    ck_assert_int_ge(k->in_range_size, 100);
+    for (int i=0; i<100; i++)
+        ck_assert_int_eq(k->in_range[i], i);
+    free_kilobot(k);
+}
+END_TEST
+
 START_TEST(test_update_interactions)
 {
     // Setup.
@@ -405,6 +532,411 @@ START_TEST(test_update_interactions)
 }
 END_TEST
 
+START_TEST(test_message_crc)
+{
+    // Reference value from avr-libc's _crc_ccitt_update, as used by kilolib.
+    message_t msg = {{1, 2, 3, 4, 5, 6, 7, 8, 9}, NORMAL, 0};
+    ck_assert_int_eq(message_crc(&msg), 0xa718);
+
+    // The CRC field itself is not part of the checksum.
+    msg.crc = 0x1234;
+    ck_assert_int_eq(message_crc(&msg), 0xa718);
+
+    msg.data[4] ^= 0x10;
+    ck_assert_int_ne(message_crc(&msg), 0xa718);
+}
+END_TEST
+
+START_TEST(test_corrupt_message)
+{
+    message_t msg = {{1, 2, 3, 4, 5, 6, 7, 8, 9}, NORMAL, 0};
+    msg.crc = message_crc(&msg);
+
+    rng_stream rng;
+    rng_stream_init(&rng, 1, 2, 3, 4, RNG_CORRUPTION);
+
+    message_t copy = msg;
+    ck_assert_int_eq(corrupt_message(&copy, 0.0, &rng), 0);
+    ck_assert_int_eq(message_crc(&copy), copy.crc);
+
+    // Every bit flipped.
+    ck_assert_int_eq(corrupt_message(&copy, 1.0, &rng), 8 * sizeof(message_t));
+    ck_assert_int_eq(copy.data[0], (uint8_t) ~msg.data[0]);
+    ck_assert_int_eq(copy.crc, (uint16_t) ~msg.crc);
+}
+END_TEST
+
+START_TEST(test_draw_message_fates)
+{
+    // The fate of a message depends on the sender, receiver and slot only,
+    // not on the order of the receivers in the sender's list.
+    int n = 3;
+    create_bots(n);
+    params.msg_success_rate = 0.5;
+    params.distance_noise = 1.0;
+
+    kilobot *tx = allbots[0];
+    tx->n_in_range = 2;
+    tx->in_range[0] = 1;
+    tx->in_range[1] = 2;
+    draw_message_fates(tx, 7, 2);
+    uint8_t s1 = fate_success[0], s2 = fate_success[1];
+    double n1 = fate_noise[0], n2 = fate_noise[1];
+
+    tx->in_range[0] = 2;
+    tx->in_range[1] = 1;
+    draw_message_fates(tx, 7, 2);
+    ck_assert_int_eq(fate_success[0], s2);
+    ck_assert_int_eq(fate_success[1], s1);
+    ck_assert(fate_noise[0] == n2);
+    ck_assert(fate_noise[1] == n1);
+
+    // Arrival frequency and noise moments.
+    int arrived = 0;
+    double sum = 0, sum_sq = 0;
+    int trials = 20000;
+    for (int slot = 0; slot < trials; slot++) {
+        draw_message_fates(tx, slot, 1);
+        arrived += fate_success[0];
+        sum += fate_noise[0];
+        sum_sq += fate_noise[0] * fate_noise[0];
+    }
+    ck_assert(abs(arrived - trials/2) < 500);
+    ck_assert(fabs(sum / trials) < 0.05);
+    ck_assert(fabs(sum_sq / trials - 1.0) < 0.05);
+
+    params.msg_success_rate = 0;
+    params.distance_noise = 0;
+}
+END_TEST
+
+START_TEST(test_random_streams)
+{
+    // Each bot has its own random numbers, whatever order the bots draw in.
+    int n = 2;
+    create_bots(n);
+    prepare_bot(allbots[1]);
+    uint8_t a1 = rand_hard(), a2 = rand_hard();
+    prepare_bot(allbots[0]);
+    uint8_t b1 = rand_hard();
+    free_all_bots();
+
+    create_bots(n);
+    prepare_bot(allbots[0]);
+    ck_assert_int_eq(rand_hard(), b1);
+    prepare_bot(allbots[1]);
+    ck_assert_int_eq(rand_hard(), a1);
+    ck_assert_int_eq(rand_hard(), a2);
+    free_all_bots();
+
+    // The calibration of a bot depends on its ID only.
+    params.speedVariation = 1.0;
+    kilobot *k1 = new_kilobot(5, 1);
+    rand_hard();
+    kilobot *k2 = new_kilobot(5, 1);
+    ck_assert(k1->speed == k2->speed);
+    ck_assert_int_eq(k1->tx_ticks, k2->tx_ticks);
+    params.speedVariation = 0;
+    free_kilobot(k1);
+    free_kilobot(k2);
+}
+END_TEST
+
+START_TEST(test_gauss_fill)
+{
+    // Moments and tails of the Ziggurat samples, one by one and in batches.
+    int n = 400000, tail = 0, far = 0;
+    double *x = malloc(sizeof(double) * n);
+    double sum = 0, sum_sq = 0;
+    rng_stream r;
+    rng_stream_init(&r, 1, 2, 3, 4, 5);
+    for (int i = 0; i < n / 2; i++)
+        x[i] = rng_next_gauss(&r);
+    rng_gauss_fill(&r, x + n / 2, n / 2);
+    for (int i = 0; i < n; i++) {
+        sum += x[i];
+        sum_sq += x[i] * x[i];
+        tail += fabs(x[i]) > 2;
+        far += fabs(x[i]) > 3.442619855899;  // past the last layer
+    }
+    ck_assert(fabs(sum / n) < 0.01);
+    ck_assert(fabs(sum_sq / n - 1.0) < 0.01);
+    ck_assert(abs(tail - (int) (0.0455 * n)) < 400);
+    ck_assert(abs(far - (int) (0.000576 * n)) < 60);
+
+    // The same stream gives the same samples.
+    double y[100], z[100];
+    rng_stream_init(&r, 7, 7, 7, 7, 7);
+    rng_gauss_fill(&r, y, 100);
+    rng_stream_init(&r, 7, 7, 7, 7, 7);
+    rng_gauss_fill(&r, z, 100);
+    for (int i = 0; i < 100; i++)
+        ck_assert(y[i] == z[i]);
+    free(x);
+}
+END_TEST
+
+message_t test_msg;
+int n_test_rx = 0;
+message_t *test_tx(void) { return &test_msg; }
+void test_rx(message_t *m, distance_measurement_t *d) { n_test_rx++; }
+
+START_TEST(test_comm_counters)
+{
+    int n = 3;
+    create_bots(n);
+    init_all_bots(n);
+    memset(comm_stats_worker, 0, sizeof(comm_stats_worker));
+    for (int i=0; i<n; i++)
+        allbots[i]->ctx.message_rx = test_rx;
+
+    kilobot *tx = allbots[0];
+    tx->ctx.message_tx = test_tx;
+    tx->n_in_range = 2;
+    tx->in_range[0] = 1;
+    tx->in_range[1] = 2;
+    test_msg.type = 5;
+    test_msg.data[0] = 3;
+    comm_stats_tag_byte = 0;
+
+    params.msg_success_rate = 1;
+    n_test_rx = 0;
+    pass_message(tx);
+    ck_assert_int_eq(n_test_rx, 2);
+    ck_assert_int_eq(tx->comm.sent, 1);
+    ck_assert_int_eq(tx->comm.bytes, sizeof(message_t));
+    ck_assert_int_eq(allbots[1]->comm.delivered, 1);
+    ck_assert_int_eq(allbots[2]->comm.delivered, 1);
+    ck_assert_int_eq(comm_stats_worker[0].type[5].sent, 1);
+    ck_assert_int_eq(comm_stats_worker[0].type[5].delivered, 2);
+    ck_assert_int_eq(comm_stats_worker[0].tag[3].delivered, 2);
+
+    params.msg_success_rate = 0;
+    pass_message(tx);
+    ck_assert_int_eq(n_test_rx, 2);
+    ck_assert_int_eq(tx->comm.sent, 2);
+    ck_assert_int_eq(allbots[1]->comm.dropped, 1);
+    ck_assert_int_eq(comm_stats_worker[0].type[5].dropped, 2);
+
+    comm_stats_tag_byte = -1;
+}
+END_TEST
+
+#define PAR_N 40
+message_t par_msg[PAR_N];
+int par_log[PAR_N][PAR_N], par_n_log[PAR_N], par_n_success[PAR_N];
+message_t *par_tx(void) { par_msg[kilo_uid].data[0] = kilo_uid; return &par_msg[kilo_uid]; }
+void par_tx_success(void) { par_n_success[kilo_uid]++; }
+void par_rx(message_t *m, distance_measurement_t *d) {
+    par_log[kilo_uid][par_n_log[kilo_uid]++] = m->data[0];
+}
+
+void run_parallel_messaging(int threads)
+{
+    memset(par_n_log, 0, sizeof(par_n_log));
+    memset(par_n_success, 0, sizeof(par_n_success));
+    create_bots(PAR_N);
+    init_all_bots(PAR_N);
+    for (int i=0; i<PAR_N; i++) {
+        kilobot *b = allbots[i];
+        b->ctx.message_tx = par_tx;
+        b->ctx.message_tx_success = par_tx_success;
+        b->ctx.message_rx = par_rx;
+        b->tx_ticks = i % 2;  // half of the bots are due
+        b->n_in_range = 0;
+        for (int j=PAR_N-1; j>=0; j--)
+            if (j != i)
+                add_in_range(b, j);
+    }
+    kilo_ticks = 0;
+    sim_set_threads(threads);
+    process_messaging(PAR_N);
+    sim_set_threads(1);
+}
+
+START_TEST(test_parallel_messaging)
+{
+    int log[PAR_N][PAR_N], n_log[PAR_N];
+    params.parallelMessaging = 1;
+    params.msg_success_rate = 0.5;
+
+    run_parallel_messaging(1);
+    memcpy(log, par_log, sizeof(log));
+    memcpy(n_log, par_n_log, sizeof(n_log));
+
+    run_parallel_messaging(4);
+    for (int i=0; i<PAR_N; i++) {
+        ck_assert_int_eq(par_n_success[i], i % 2 == 0);
+        ck_assert_int_eq(par_n_log[i], n_log[i]);
+        ck_assert(n_log[i] > 0 && n_log[i] < PAR_N/2);
+        for (int k=0; k<n_log[i]; k++) {
+            ck_assert_int_eq(par_log[i][k], log[i][k]);
+            ck_assert_int_eq(log[i][k] % 2, 0);           // only due transmitters
+            ck_assert(k == 0 || log[i][k] > log[i][k-1]); // in ID order
+        }
+    }
+
+    params.parallelMessaging = 0;
+    params.msg_success_rate = 0;
+}
+END_TEST
+
+// reports a bot's ID and step, a varying number of times per step
+void event_loop(void) {
+    int n = ((USERDATA* )mydata)->num_bot_steps++;
+    for (int k=0; k<=(kilo_uid+n)%3; k++)
+        sim_event(k, kilo_uid, n);
+}
+
+// the events of n bots over 3 steps, and one outside of them after each
+// step, in events.bin; returns their number
+long log_events(int n, int threads, sim_event_record *events, long max)
+{
+    event_log_header h;
+    create_bots(n);
+    init_all_bots(n);
+    for (int i=0; i<n; i++) {
+      prepare_bot(allbots[i]);
+      mydata = (USERDATA* )(Me()->data);
+      current_bot->user_loop = &event_loop;
+      setup();
+    }
+
+    event_log_start("events.bin");
+    sim_set_threads(threads);
+    for (kilo_ticks=0; kilo_ticks<3; kilo_ticks++) {
+      process_bots(n, 0);
+      sim_event(9, -1, kilo_ticks);
+      event_log_flush();
+    }
+    sim_set_threads(1);
+    event_log_stop();
+    free_all_bots();
+
+    FILE *f = fopen("events.bin", "rb");
+    ck_assert(f != NULL);
+    ck_assert_int_eq(fread(&h, sizeof(h), 1, f), 1);
+    ck_assert_int_eq(h.byte_order, EVENT_LOG_BYTE_ORDER);
+    ck_assert_int_eq(h.record_size, sizeof(sim_event_record));
+    long n_events = fread(events, sizeof(sim_event_record), max, f);
+    fclose(f);
+    remove("events.bin");
+    return n_events;
+}
+
+START_TEST(test_event_log)
+{
+    int n = 1000;
+    long max = 3 * n * 3 + 1;
+    sim_event_record *one = malloc(sizeof(sim_event_record) * max);
+    sim_event_record *four = malloc(sizeof(sim_event_record) * max);
+
+    long n_one = log_events(n, 1, one, max);
+    long n_four = log_events(n, 4, four, max);
+    ck_assert_int_eq(n_one, 3 * n * 2 + 3);
+    ck_assert_int_eq(n_four, n_one);
+
+    // the same events in the same order, sorted by ticks, ID and seq
+    ck_assert(memcmp(one, four, sizeof(sim_event_record) * n_one) == 0);
+    for (long k=1; k<n_one; k++) {
+      sim_event_record *a = &one[k-1], *b = &one[k];
+      ck_assert(a->ticks < b->ticks || (a->ticks == b->ticks
+                && (a->id < b->id || (a->id == b->id && a->seq < b->seq))));
+    }
+    for (long k=0; k<n_one; k++) {
+      ck_assert_int_eq(one[k].a, one[k].id);
+      ck_assert_int_eq(one[k].b, one[k].ticks);
+    }
+
+    // without an event file, nothing is logged nor counted
+    create_bots(1);
+    prepare_bot(allbots[0]);
+    sim_event(1, 2, 3);
+    event_log_flush();
+    ck_assert(sim->events == NULL);
+    ck_assert_int_eq(allbots[0]->n_events, 0);
+    free_all_bots();
+
+    free(one);
+    free(four);
+}
+END_TEST
+
+START_TEST(test_comm_line_store)
+{
+    int n = 2;
+    create_bots(n);
+    allbots[1]->x = 50;
+
+    // Fill past the initial capacity, 100 lines per tick.
+    int total = 3 * COMMLINES_INITIAL;
+    for (int i = 0; i < total; i++) {
+        kilo_ticks = i / 100;
+        addCommLine(allbots[0], allbots[1]);
+    }
+    ck_assert_int_eq(commLines.count, total);
+    ck_assert_int_ge(commLines.capacity, total);
+
+    // Lines older than 2 ticks expire, oldest first, the rest stay in order.
+    int now = kilo_ticks;
+    removeOldCommLines(now, 2);
+    ck_assert_int_eq(getCommLine(0)->time, now - 2);
+    ck_assert_int_eq(getCommLine(commLines.count-1)->time, now);
+    for (int i = 1; i < commLines.count; i++)
+        ck_assert_int_le(getCommLine(i-1)->time, getCommLine(i)->time);
+
+    removeOldCommLines(now + 10, 2);
+    ck_assert_int_eq(commLines.count, 0);
+
+    // Lines entirely outside the viewport are not stored.
+    setCommLineViewport(100, 100, 200, 200);
+    addCommLine(allbots[0], allbots[1]);
+    ck_assert_int_eq(commLines.count, 0);
+    allbots[1]->x = 150;
+    allbots[1]->y = 150;
+    addCommLine(allbots[0], allbots[1]);
+    ck_assert_int_eq(commLines.count, 1);
+    kilo_ticks = 0;
+}
+END_TEST
+
+START_TEST(test_count_occluders)
+{
+    int n = 4;
+    create_bots(n);
+    for (int i=0; i<n; i++) {
+        allbots[i]->cr = 100;
+        allbots[i]->x = 0;
+        allbots[i]->y = 0;
+    }
+    // tx, blocker, rx on a line, and one bot beside the line
+    allbots[1]->x = 45;
+    allbots[2]->x = 90;
+    allbots[3]->x = 45;
+    allbots[3]->y = 50;
+
+    for (int grid = 0; grid <= 1; grid++) {
+        params.useGrid = grid;
+        allbots[1]->y = 0;
+        if (grid)
+            update_interactions_grid(n);
+        else
+            update_interactions(n);
+        ck_assert_int_eq(count_occluders(allbots[0], allbots[2], n), 1);
+        ck_assert_int_eq(count_occluders(allbots[0], allbots[1], n), 0);
+        ck_assert_int_eq(count_occluders(allbots[0], allbots[3], n), 0);
+
+        // just touching the line
+        allbots[1]->y = 16;
+        ck_assert_int_eq(count_occluders(allbots[0], allbots[2], n), 1);
+        // clear of the line
+        allbots[1]->y = 18;
+        ck_assert_int_eq(count_occluders(allbots[0], allbots[2], n), 0);
+    }
+    params.useGrid = 0;
+}
+END_TEST
+
 
 Suite *add_suite(void)
 {
@@ -419,6 +951,9 @@ Suite *add_suite(void)
     tcase_add_test(tc_core, test_init_all_bots);
     tcase_add_test(tc_core, test_me);
     tcase_add_test(tc_core, test_run_all_bots);
+    tcase_add_test(tc_core, test_run_all_bots_threads);
+    tcase_add_test(tc_core, test_separate_simulations);
+    tcase_add_test(tc_core, test_delay);
     tcase_add_test(tc_core, test_update_bot_history);
     tcase_add_test(tc_core, test_manage_bot_history_memory);
     tcase_add_test(tc_core, test_move_bot_forward);
@@ -430,7 +965,18 @@ Suite *add_suite(void)
     tcase_add_test(tc_core, test_separate_clashing_bots);
     tcase_add_test(tc_core, test_reset_n_in_range_indices);
     tcase_add_test(tc_core, test_update_n_in_range_indices);
+    tcase_add_test(tc_core, test_add_in_range);
     tcase_add_test(tc_core, test_update_interactions);
+    tcase_add_test(tc_core, test_message_crc);
+    tcase_add_test(tc_core, test_corrupt_message);
+    tcase_add_test(tc_core, test_draw_message_fates);
+    tcase_add_test(tc_core, test_random_streams);
+    tcase_add_test(tc_core, test_gauss_fill);
+    tcase_add_test(tc_core, test_comm_counters);
+    tcase_add_test(tc_core, test_parallel_messaging);
+    tcase_add_test(tc_core, test_event_log);
+    tcase_add_test(tc_core, test_comm_line_store);
+    tcase_add_test(tc_core, test_count_occluders);
     suite_add_tcase(s, tc_core);
 
     return s;
@@ -442,6 +988,7 @@ int main(void)
     Suite *s;
     SRunner *sr;
 
+    sim = &test_sim;
     s = add_suite();
     sr = srunner_create(s);
 
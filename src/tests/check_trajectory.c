@@ -0,0 +1,334 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <check.h>
+
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include "trajectory.h"
+
+#ifndef M_PI
+// C99 doesn't define M_PI
+#define M_PI 3.14159265358979323846264338327950288
+#endif
+
+#define KTR_FILE "check_trajectory.ktr"
+#define N_STATES 120
+#define MAX_BOTS 16
+#define USERDATA_SIZE 6
+
+// the columns of a test state
+typedef struct {
+    int32_t id[MAX_BOTS];
+    double x[MAX_BOTS], y[MAX_BOTS], direction[MAX_BOTS];
+    uint8_t r_led[MAX_BOTS], g_led[MAX_BOTS], b_led[MAX_BOTS];
+    uint8_t userdata[MAX_BOTS * USERDATA_SIZE];
+} test_state;
+
+// the number of bots changes twice, and some columns are left out now and then
+int n_bots_at(int t) { return t < 30 ? 10 : t < 80 ? MAX_BOTS : 7; }
+int has_x(int t) { return t % 7 != 3; }
+int has_leds(int t) { return t % 7 != 3 && t % 13 != 4; }
+int has_userdata(int t) { return t % 11 != 5; }
+
+// precision < 0 changes it in the middle of the file
+double precision_at(double precision, int t)
+{
+    if (precision >= 0)
+        return precision;
+    return t < 40 ? 0.01 : t < 70 ? 0 : 0.5;
+}
+
+// state t, into s and f
+void make_state(int t, test_state *s, ktr_frame *f)
+{
+    int n = n_bots_at(t);
+
+    for (int i=0; i<n; i++) {
+        s->id[i] = 3 * i + 1;
+        s->x[i] = 100 * sin(0.05 * t + i) + 0.37 * i;
+        s->y[i] = -50 * cos(0.03 * t * (i % 3)) - 1.1 * i;
+        s->direction[i] = fmod(0.2 * t + i, 2 * M_PI) - M_PI;
+        s->r_led[i] = (t / 10 + i) % 4;
+        s->g_led[i] = i % 4;
+        s->b_led[i] = (t + i) % 4;
+        for (int k=0; k<USERDATA_SIZE; k++)
+            s->userdata[i * USERDATA_SIZE + k] = (uint8_t) (t * (k + 1) + i);
+    }
+
+    memset(f, 0, sizeof(*f));
+    f->ticks = 10 * t;
+    f->n_bots = n;
+    f->id = s->id;
+    f->x = has_x(t) ? s->x : NULL;
+    f->y = s->y;
+    f->direction = s->direction;
+    if (has_leds(t)) {
+        f->r_led = s->r_led;
+        f->g_led = s->g_led;
+        f->b_led = s->b_led;
+    }
+    if (has_userdata(t))
+        f->userdata = s->userdata;
+}
+
+void write_states(double precision)
+{
+    ktr_writer *w = ktr_create(KTR_FILE, USERDATA_SIZE);
+    test_state s;
+    ktr_frame f;
+
+    ck_assert(w != NULL);
+    for (int t=0; t<N_STATES; t++) {
+        if (t == 0 || precision_at(precision, t) != precision_at(precision, t - 1))
+            ktr_set_precision(w, precision_at(precision, t));
+        make_state(t, &s, &f);
+        ck_assert_int_eq(ktr_write(w, &f), 0);
+    }
+    ck_assert_int_eq(ktr_close_writer(w), 0);
+}
+
+// raw values exactly, encoded ones within one quantum
+void check_doubles(const double *read, const double *written, int n, double quantum)
+{
+    ck_assert(read != NULL);
+    for (int i=0; i<n; i++)
+        if (quantum == 0)
+            ck_assert(read[i] == written[i]);
+        else
+            ck_assert(fabs(read[i] - written[i]) <= quantum);
+}
+
+// check that f holds state t of a file written with precision
+void check_state(const ktr_frame *f, int t, double precision)
+{
+    double p = precision_at(precision, t);
+    test_state s;
+    ktr_frame w;
+
+    make_state(t, &s, &w);
+    ck_assert_int_eq(f->ticks, w.ticks);
+    ck_assert_int_eq(f->n_bots, w.n_bots);
+    ck_assert(memcmp(f->id, s.id, sizeof(int32_t) * w.n_bots) == 0);
+
+    if (has_x(t))
+        check_doubles(f->x, s.x, w.n_bots, p);
+    else
+        ck_assert(f->x == NULL);
+    check_doubles(f->y, s.y, w.n_bots, p);
+    check_doubles(f->direction, s.direction, w.n_bots, p / 100);
+
+    if (has_leds(t)) {
+        ck_assert(f->r_led && f->g_led && f->b_led);
+        ck_assert(memcmp(f->r_led, s.r_led, w.n_bots) == 0);
+        ck_assert(memcmp(f->g_led, s.g_led, w.n_bots) == 0);
+        ck_assert(memcmp(f->b_led, s.b_led, w.n_bots) == 0);
+    } else
+        ck_assert(f->r_led == NULL && f->g_led == NULL && f->b_led == NULL);
+
+    if (has_userdata(t)) {
+        ck_assert(f->userdata != NULL);
+        ck_assert(memcmp(f->userdata, s.userdata, USERDATA_SIZE * w.n_bots) == 0);
+    } else
+        ck_assert(f->userdata == NULL);
+}
+
+void check_round_trip(double precision)
+{
+    ktr_frame f;
+    int t;
+
+    write_states(precision);
+    ktr_reader *r = ktr_open(KTR_FILE);
+    ck_assert(r != NULL);
+    ck_assert_int_eq(ktr_userdata_size(r), USERDATA_SIZE);
+    ck_assert_int_eq(ktr_states(r), N_STATES);
+    for (t=0; ktr_read(r, &f) > 0; t++)
+        check_state(&f, t, precision);
+    ck_assert_int_eq(t, N_STATES);
+    ktr_close(r);
+    remove(KTR_FILE);
+}
+
+START_TEST(test_round_trip_raw)
+{
+    check_round_trip(0);
+}
+END_TEST
+
+START_TEST(test_round_trip_encoded)
+{
+    check_round_trip(0.01);
+    check_round_trip(1);
+}
+END_TEST
+
+START_TEST(test_round_trip_mixed)
+{
+    // encoded, then raw, then encoded with another precision
+    check_round_trip(-1);
+}
+END_TEST
+
+START_TEST(test_read_at)
+{
+    // backwards and forwards, across keyframes and changes of the bot count
+    static const int order[] = {119, 0, 55, 49, 50, 51, 100, 99, 30, 29, 80, 79, 3, 4, 118, 1};
+    ktr_frame f;
+
+    write_states(0.01);
+    ktr_reader *r = ktr_open(KTR_FILE);
+    ck_assert(r != NULL);
+    for (int k=0; k<(int) (sizeof(order) / sizeof(order[0])); k++) {
+        ck_assert_int_eq(ktr_read_at(r, order[k], &f), 1);
+        check_state(&f, order[k], 0.01);
+        // ktr_read() goes on from there
+        if (order[k] + 1 < N_STATES) {
+            ck_assert_int_eq(ktr_read(r, &f), 1);
+            check_state(&f, order[k] + 1, 0.01);
+        } else
+            ck_assert_int_eq(ktr_read(r, &f), 0);
+    }
+    ck_assert_int_eq(ktr_read_at(r, N_STATES, &f), 0);
+    ck_assert_int_eq(ktr_find(r, 10 * 42), 42);
+    ck_assert_int_eq(ktr_find(r, 10 * 42 - 5), 42);
+    ck_assert_int_eq(ktr_find(r, 10 * N_STATES), N_STATES);
+    ktr_close(r);
+    remove(KTR_FILE);
+}
+END_TEST
+
+// check the track of bot i in states from to to - 1
+void check_track(ktr_reader *r, int i, int from, int to)
+{
+    ktr_point track[N_STATES];
+    test_state s;
+    ktr_frame w;
+    int n = 0;
+
+    long m = ktr_track(r, 3 * i + 1, from, to, track);
+    for (int t=from; t<to && t<N_STATES; t++) {
+        // states without x are skipped, as are those without the bot
+        if (!has_x(t) || i >= n_bots_at(t))
+            continue;
+        make_state(t, &s, &w);
+        ck_assert(n < m);
+        ck_assert_int_eq(track[n].ticks, w.ticks);
+        check_doubles(&track[n].x, &s.x[i], 1, 0.01);
+        check_doubles(&track[n].y, &s.y[i], 1, 0.01);
+        check_doubles(&track[n].direction, &s.direction[i], 1, 0.0001);
+        n++;
+    }
+    ck_assert_int_eq(m, n);
+}
+
+START_TEST(test_track_then_read)
+{
+    // a track decodes some columns only, which the next full read must not reuse
+    ktr_frame f;
+
+    write_states(0.01);
+    ktr_reader *r = ktr_open(KTR_FILE);
+    ck_assert(r != NULL);
+
+    ck_assert_int_eq(ktr_read_at(r, 20, &f), 1);
+    check_track(r, 12, 20, 90);  // bot 12 is there from 30 to 79 only
+    ck_assert_int_eq(ktr_read(r, &f), 1);
+    check_state(&f, 21, 0.01);
+
+    check_track(r, 3, 40, 46);
+    ck_assert_int_eq(ktr_read_at(r, 46, &f), 1);
+    check_state(&f, 46, 0.01);
+    check_track(r, 3, 44, 47);
+    ck_assert_int_eq(ktr_read(r, &f), 1);
+    check_state(&f, 47, 0.01);
+
+    check_track(r, 5, 0, N_STATES);
+    for (int t=0; t<N_STATES; t++) {
+        ck_assert_int_eq(ktr_read_at(r, t, &f), 1);
+        check_state(&f, t, 0.01);
+        check_track(r, t % 10, t, t + 2);
+    }
+    ktr_close(r);
+    remove(KTR_FILE);
+}
+END_TEST
+
+START_TEST(test_no_index)
+{
+    // a file cut off before its index, or in its last state, is read by
+    // skipping from state to state
+    ktr_frame f;
+    uint64_t index_offset;
+
+    write_states(0.01);
+    FILE *file = fopen(KTR_FILE, "rb");
+    ck_assert(file != NULL);
+    fseek(file, -16, SEEK_END);
+    ck_assert_int_eq(fread(&index_offset, sizeof(index_offset), 1, file), 1);
+    fclose(file);
+
+    ck_assert_int_eq(truncate(KTR_FILE, index_offset), 0);
+    ktr_reader *r = ktr_open(KTR_FILE);
+    ck_assert(r != NULL);
+    ck_assert_int_eq(ktr_states(r), N_STATES);
+    for (int t=N_STATES-1; t>=0; t-=7) {
+        ck_assert_int_eq(ktr_ticks(r, t), 10 * t);
+        ck_assert_int_eq(ktr_read_at(r, t, &f), 1);
+        check_state(&f, t, 0.01);
+    }
+    ck_assert_int_eq(ktr_read_at(r, N_STATES, &f), 0);
+    ktr_close(r);
+
+    ck_assert_int_eq(truncate(KTR_FILE, index_offset - 20), 0);
+    r = ktr_open(KTR_FILE);
+    ck_assert(r != NULL);
+    ck_assert_int_eq(ktr_states(r), N_STATES - 1);
+    ck_assert_int_eq(ktr_read_at(r, 60, &f), 1);
+    check_state(&f, 60, 0.01);
+    for (int t=61; t<N_STATES-1; t++) {
+        ck_assert_int_eq(ktr_read(r, &f), 1);
+        check_state(&f, t, 0.01);
+    }
+    ck_assert_int_eq(ktr_read(r, &f), 0);
+    ktr_close(r);
+    remove(KTR_FILE);
+}
+END_TEST
+
+
+Suite *add_suite(void)
+{
+    Suite *s;
+    TCase *tc_core;
+
+    s = suite_create("trajectory");
+    tc_core = tcase_create("core");
+
+    tcase_add_test(tc_core, test_round_trip_raw);
+    tcase_add_test(tc_core, test_round_trip_encoded);
+    tcase_add_test(tc_core, test_round_trip_mixed);
+    tcase_add_test(tc_core, test_read_at);
+    tcase_add_test(tc_core, test_track_then_read);
+    tcase_add_test(tc_core, test_no_index);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void)
+{
+    int number_failed;
+    Suite *s;
+    SRunner *sr;
+
+    s = add_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_VERBOSE);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,263 @@
+/* Work-stealing thread pool, see threadpool.h.
+ *
+ * The remaining range of each worker is kept in one 64 bit word, begin in the
+ * high half and end in the low half, so that the owner taking a chunk from
+ * the front and a thief taking the back half are both a single
+ * compare-and-swap. Ranges only ever shrink or move between workers, never
+ * revisit indices already handed out, so a stale compare-and-swap always fails.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "threadpool.h"
+
+typedef struct {
+  uint64_t range;
+} __attribute__((aligned(64))) pool_slot;  // one cache line each
+
+struct thread_pool {
+  pool_slot slots[POOL_MAX_THREADS];
+  pthread_t threads[POOL_MAX_THREADS];
+  int n_workers;
+
+  pthread_mutex_t lock;
+  pthread_cond_t start_cond;
+  pthread_cond_t done_cond;
+  unsigned generation;  // incremented for every job
+  int running;          // worker threads still busy with the job
+  int quit;
+
+  void (*thread_init)(void *);
+  void *init_arg;
+
+  pool_fn job_fn;
+  void *job_arg;
+  uint32_t job_chunk;
+  int job_steal;  // 0 for pool_each()
+};
+
+typedef struct {
+  thread_pool *pool;
+  int w;
+} worker_arg;
+
+__thread int pool_worker = 0;
+
+static inline uint64_t pack(uint32_t begin, uint32_t end)
+{
+  return (uint64_t) begin << 32 | end;
+}
+
+// take the next chunk from the front of worker w's own range
+static int take_own(thread_pool *p, int w, int *begin, int *end)
+{
+  uint64_t r = __atomic_load_n(&p->slots[w].range, __ATOMIC_ACQUIRE);
+  for (;;)
+    {
+      uint32_t b = r >> 32, e = (uint32_t) r;
+      uint32_t next = b + p->job_chunk;
+      if (b >= e)
+	return 0;
+      if (next > e)
+	next = e;
+      if (__atomic_compare_exchange_n(&p->slots[w].range, &r, pack(next, e), 0,
+				      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+	  *begin = b;
+	  *end = next;
+	  return 1;
+	}
+    }
+}
+
+// move the back half of some other worker's range to worker w
+static int steal(thread_pool *p, int w)
+{
+  for (int k = 1; k < p->n_workers; k++)
+    {
+      int v = (w + k) % p->n_workers;
+      uint64_t r = __atomic_load_n(&p->slots[v].range, __ATOMIC_ACQUIRE);
+      for (;;)
+	{
+	  uint32_t b = r >> 32, e = (uint32_t) r;
+	  uint32_t mid = b + (e - b) / 2;
+	  if (b >= e)
+	    break;
+	  if (__atomic_compare_exchange_n(&p->slots[v].range, &r, pack(b, mid), 0,
+					  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	    {
+	      // our own range is empty, nobody else will modify it
+	      __atomic_store_n(&p->slots[w].range, pack(mid, e), __ATOMIC_RELEASE);
+	      return 1;
+	    }
+	}
+    }
+  return 0;
+}
+
+static void run_worker(thread_pool *p, int w)
+{
+  int begin, end;
+  do {
+    while (take_own(p, w, &begin, &end))
+      p->job_fn(begin, end, p->job_arg);
+  } while (p->job_steal && steal(p, w));
+}
+
+static void *worker_main(void *arg)
+{
+  worker_arg *a = (worker_arg *) arg;
+  thread_pool *p = a->pool;
+  unsigned seen = 0;
+  pool_worker = a->w;
+  free(a);
+
+  if (p->thread_init)
+    p->thread_init(p->init_arg);
+
+  pthread_mutex_lock(&p->lock);
+  for (;;)
+    {
+      while (p->generation == seen && !p->quit)
+	pthread_cond_wait(&p->start_cond, &p->lock);
+      if (p->quit)
+	break;
+      seen = p->generation;
+      pthread_mutex_unlock(&p->lock);
+
+      run_worker(p, pool_worker);
+
+      pthread_mutex_lock(&p->lock);
+      if (--p->running == 0)
+	pthread_cond_signal(&p->done_cond);
+    }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+/* Start a pool of n_threads, counting the calling thread. Each new worker
+ * thread calls thread_init(arg) first, if given.
+ */
+thread_pool *pool_create(int n_threads, void (*thread_init)(void *), void *arg)
+{
+  if (n_threads <= 0)
+    n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_threads < 1)
+    n_threads = 1;
+  if (n_threads > POOL_MAX_THREADS)
+    n_threads = POOL_MAX_THREADS;
+
+  thread_pool *p = (thread_pool *) calloc(1, sizeof(thread_pool));
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->start_cond, NULL);
+  pthread_cond_init(&p->done_cond, NULL);
+  p->thread_init = thread_init;
+  p->init_arg = arg;
+  p->n_workers = n_threads;
+  for (int w = 1; w < p->n_workers; w++)
+    {
+      worker_arg *a = (worker_arg *) malloc(sizeof(worker_arg));
+      a->pool = p;
+      a->w = w;
+      if (pthread_create(&p->threads[w], NULL, worker_main, a))
+	{
+	  fprintf(stderr, "Could not start worker thread %d.\n", w);
+	  exit(1);
+	}
+    }
+  return p;
+}
+
+void pool_destroy(thread_pool *p)
+{
+  if (!p)
+    return;
+
+  pthread_mutex_lock(&p->lock);
+  p->quit = 1;
+  pthread_cond_broadcast(&p->start_cond);
+  pthread_mutex_unlock(&p->lock);
+
+  for (int w = 1; w < p->n_workers; w++)
+    pthread_join(p->threads[w], NULL);
+
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->start_cond);
+  pthread_cond_destroy(&p->done_cond);
+  free(p);
+}
+
+int pool_size(thread_pool *p)
+{
+  return p ? p->n_workers : 1;
+}
+
+// run the job set up in p on all workers, and wait for it
+static void run_job(thread_pool *p)
+{
+  pthread_mutex_lock(&p->lock);
+  p->running = p->n_workers - 1;
+  p->generation++;
+  pthread_cond_broadcast(&p->start_cond);
+  pthread_mutex_unlock(&p->lock);
+
+  run_worker(p, 0);
+
+  pthread_mutex_lock(&p->lock);
+  while (p->running > 0)
+    pthread_cond_wait(&p->done_cond, &p->lock);
+  pthread_mutex_unlock(&p->lock);
+}
+
+/* Call fn on chunks covering 0 ... n-1, in parallel, and return when all are
+ * done. The calling thread works as worker 0. Without a pool, fn is called
+ * once for the whole range.
+ */
+void pool_for(thread_pool *p, int n, pool_fn fn, void *arg)
+{
+  if (!p || p->n_workers == 1 || n < 2)
+    {
+      if (n > 0)
+	fn(0, n, arg);
+      return;
+    }
+
+  p->job_fn = fn;
+  p->job_arg = arg;
+  p->job_steal = 1;
+  // small chunks, so that there is something left to steal
+  p->job_chunk = n / (p->n_workers * 16);
+  if (p->job_chunk < 1)
+    p->job_chunk = 1;
+  for (int w = 0; w < p->n_workers; w++)
+    p->slots[w].range = pack((int64_t) n * w / p->n_workers, (int64_t) n * (w + 1) / p->n_workers);
+
+  run_job(p);
+}
+
+/* Call fn(w, w+1, arg) on each worker thread w, in parallel, for work that
+ * has to stay with the thread that started it.
+ */
+void pool_each(thread_pool *p, pool_fn fn, void *arg)
+{
+  if (!p || p->n_workers == 1)
+    {
+      fn(0, 1, arg);
+      return;
+    }
+
+  p->job_fn = fn;
+  p->job_arg = arg;
+  p->job_steal = 0;
+  p->job_chunk = 1;
+  for (int w = 0; w < p->n_workers; w++)
+    p->slots[w].range = pack(w, w + 1);
+
+  run_job(p);
+}
@@ -0,0 +1,33 @@
+/* A pool of worker threads for running loops over the bots in parallel.
+ *
+ * pool_for() splits the index range [0,n) evenly between the workers.
+ * Each worker takes small chunks from the front of its own range, and when it
+ * runs out, steals the back half of the range of another worker. This keeps
+ * all threads busy even when some bots need much more time than others.
+ * pool_each() runs a function once on every worker thread.
+ *
+ * Each simulation has a pool of its own, so that simulations running in
+ * different threads of one process do not share workers.
+ */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#define POOL_MAX_THREADS 64
+
+// process bots begin ... end-1
+typedef void (*pool_fn)(int begin, int end, void *arg);
+
+// index of the calling thread in the pool, 0 for the main thread
+extern __thread int pool_worker;
+
+typedef struct thread_pool thread_pool;
+
+// n_threads <= 0: one per CPU core
+thread_pool *pool_create(int n_threads, void (*thread_init)(void *), void *arg);
+void pool_destroy(thread_pool *p);
+int pool_size(thread_pool *p);
+void pool_for(thread_pool *p, int n, pool_fn fn, void *arg);
+void pool_each(thread_pool *p, pool_fn fn, void *arg);
+
+#endif
@@ -0,0 +1,405 @@
+/* kilombo-convert: convert state files between formats.
+ *
+ *   kilombo-convert states.jsonl states.json
+ *
+ * The format of the input is found from its contents, that of the output
+ * from its file name. An input holding one object over several lines,
+ * such as endstate.json, is read as a single state. Output files are:
+ *   .json   a JSON array of states, as the simulator used to write
+ *   .ktr    a binary trajectory file, see trajectory.h
+ *   other   JSON Lines, one state per line, as the simulator writes now
+ * States are converted one at a time, except when reading a JSON array.
+ *
+ * Binary files hold the bots' positions, directions and LEDs, and
+ * optionally their raw USERDATA, which goes to JSON as an object of its
+ * fields if the file describes them, and as a hex string otherwise. The
+ * json_state output and the communication counters of JSON states are not
+ * kept in binary files.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jansson.h>
+
+#include "trajectory.h"
+
+enum {FORMAT_JSONL, FORMAT_JSON, FORMAT_BINARY};
+
+typedef struct {
+  FILE *f;
+  int format;
+  ktr_reader *ktr;
+  json_t *array;  // a JSON array input, loaded in full
+  size_t index;   // ... and the next state in it
+  char *line;     // a JSON Lines input: the line buffer
+  size_t line_size;
+  long line_no;
+  int error;
+} reader;
+
+typedef struct {
+  FILE *f;
+  int format;
+  long n_written;
+  ktr_writer *ktr;
+  ktr_frame frame;  // the state being converted to binary
+  int capacity;
+} writer;
+
+static int ends_with(const char *s, const char *suffix)
+{
+  size_t n = strlen(s), m = strlen(suffix);
+  return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+/* Whether the object the file starts with spans several lines, as in
+ * endstate.json, rather than being the first state of JSON Lines.
+ */
+static int single_state(reader *r)
+{
+  long pos = ftell(r->f);
+  int single = 0;
+
+  if (getline(&r->line, &r->line_size, r->f) > 0)
+    {
+      json_t *state = json_loads(r->line, 0, NULL);
+      single = state == NULL;
+      json_decref(state);
+    }
+  fseek(r->f, pos, SEEK_SET);
+  return single;
+}
+
+static int open_reader(reader *r, const char *filename)
+{
+  int c;
+
+  memset(r, 0, sizeof(*r));
+  if (is_trajectory(filename))
+    {
+      r->format = FORMAT_BINARY;
+      r->ktr = ktr_open(filename);
+      if (!r->ktr)
+	fprintf(stderr, "Could not read %s\n", filename);
+      return r->ktr == NULL;
+    }
+
+  r->f = fopen(filename, "r");
+  if (!r->f)
+    {
+      fprintf(stderr, "Could not open %s\n", filename);
+      return 1;
+    }
+
+  // a JSON array starts with [
+  do
+    c = fgetc(r->f);
+  while (c == ' ' || c == '\t' || c == '\n' || c == '\r');
+  ungetc(c, r->f);
+
+  if (c == '[' || (c == '{' && single_state(r)))
+    {
+      // a JSON array, or a single state such as endstate.json
+      json_error_t error;
+      r->format = FORMAT_JSON;
+      r->array = json_loadf(r->f, 0, &error);
+      if (json_is_object(r->array))
+	{
+	  json_t *state = r->array;
+	  r->array = json_array();
+	  json_array_append_new(r->array, state);
+	}
+      if (!json_is_array(r->array))
+	{
+	  fprintf(stderr, "%s line %d: %s\n", filename, error.line, error.text);
+	  return 1;
+	}
+    }
+  else
+    r->format = FORMAT_JSONL;
+  return 0;
+}
+
+static json_t *state_of_frame(const ktr_frame *f, int userdata_size, const ktr_field *layout);
+
+// the next state, NULL at the end or on error
+static json_t *read_state(reader *r)
+{
+  if (r->format == FORMAT_BINARY)
+    {
+      ktr_frame f;
+      int k = ktr_read(r->ktr, &f);
+      if (k < 0)
+	{
+	  fprintf(stderr, "Broken binary state file\n");
+	  r->error = 1;
+	}
+      return k > 0 ? state_of_frame(&f, ktr_userdata_size(r->ktr), ktr_userdata_layout(r->ktr)) : NULL;
+    }
+
+  if (r->format == FORMAT_JSON)
+    {
+      json_t *state = json_array_get(r->array, r->index++);
+      return state ? json_incref(state) : NULL;
+    }
+
+  while (getline(&r->line, &r->line_size, r->f) > 0)
+    {
+      json_error_t error;
+      r->line_no++;
+      if (strspn(r->line, " \t\r\n") == strlen(r->line))
+	continue;
+      json_t *state = json_loads(r->line, 0, &error);
+      if (!state)
+	{
+	  fprintf(stderr, "line %ld: %s\n", r->line_no, error.text);
+	  r->error = 1;
+	}
+      return state;
+    }
+  return NULL;
+}
+
+static void close_reader(reader *r)
+{
+  if (r->ktr)
+    {
+      ktr_close(r->ktr);
+      return;
+    }
+  json_decref(r->array);
+  free(r->line);
+  fclose(r->f);
+}
+
+// the USERDATA d as an object of the fields in layout
+static json_t *json_of_userdata(const uint8_t *d, const ktr_field *layout)
+{
+  json_t *fields = json_object();
+
+  for (const ktr_field *l = layout; l->name; l++)
+    {
+      int n = ktr_field_count(l);
+      int integer = l->type != KTR_FIELD_FLOAT && l->type != KTR_FIELD_DOUBLE;
+      json_t *v = n == 1 ? NULL : json_array();
+      for (int k = 0; k < n; k++)
+	{
+	  double x = ktr_field_value(l, d, k);
+	  json_t *e = integer ? json_integer((json_int_t) x) : json_real(x);
+	  if (v)
+	    json_array_append_new(v, e);
+	  else
+	    v = e;
+	}
+      json_object_set_new(fields, l->name, v ? v : json_array());
+    }
+  return fields;
+}
+
+/* A binary state as JSON, in the format of the simulator's state file. */
+static json_t *state_of_frame(const ktr_frame *f, int userdata_size, const ktr_field *layout)
+{
+  static const char hex[] = "0123456789abcdef";
+  json_t *state = json_object();
+  json_t *bots = json_array();
+  char *text = (char *) malloc(2 * userdata_size + 1);
+
+  json_object_set_new(state, "ticks", json_integer(f->ticks));
+  json_object_set_new(state, "bot_states", bots);
+  for (int i = 0; i < f->n_bots; i++)
+    {
+      json_t *bot = json_object();
+      json_object_set_new(bot, "ID", json_integer(f->id[i]));
+      if (f->x)
+	{
+	  json_object_set_new(bot, "direction", json_real(f->direction[i]));
+	  json_object_set_new(bot, "x_position", json_real(f->x[i]));
+	  json_object_set_new(bot, "y_position", json_real(f->y[i]));
+	}
+      if (f->r_led)
+	{
+	  json_t *led = json_array();
+	  json_array_append_new(led, json_integer(f->r_led[i]));
+	  json_array_append_new(led, json_integer(f->g_led[i]));
+	  json_array_append_new(led, json_integer(f->b_led[i]));
+	  json_object_set_new(bot, "led", led);
+	}
+      if (f->userdata && layout)
+	json_object_set_new(bot, "userdata",
+			    json_of_userdata(f->userdata + (size_t) userdata_size * i, layout));
+      else if (f->userdata)
+	{
+	  const uint8_t *d = f->userdata + (size_t) userdata_size * i;
+	  for (int k = 0; k < userdata_size; k++)
+	    {
+	      text[2*k] = hex[d[k] >> 4];
+	      text[2*k+1] = hex[d[k] & 15];
+	    }
+	  text[2 * userdata_size] = 0;
+	  json_object_set_new(bot, "userdata", json_string(text));
+	}
+      json_array_append_new(bots, bot);
+    }
+  free(text);
+  return state;
+}
+
+/* A JSON state as a binary one, in w->frame. The USERDATA is left out, and
+ * so are the positions or LEDs if the first bot has none.
+ */
+static ktr_frame frame_of_state(writer *w, json_t *state)
+{
+  ktr_frame *f = &w->frame;
+  json_t *bots = json_object_get(state, "bot_states");
+  int n = json_array_size(bots);
+
+  if (n > w->capacity)
+    {
+      w->capacity = n;
+      f->id = (int32_t *) realloc(f->id, sizeof(int32_t) * n);
+      f->x = (double *) realloc(f->x, sizeof(double) * n);
+      f->y = (double *) realloc(f->y, sizeof(double) * n);
+      f->direction = (double *) realloc(f->direction, sizeof(double) * n);
+      f->r_led = (uint8_t *) realloc(f->r_led, n);
+      f->g_led = (uint8_t *) realloc(f->g_led, n);
+      f->b_led = (uint8_t *) realloc(f->b_led, n);
+    }
+
+  f->ticks = json_integer_value(json_object_get(state, "ticks"));
+  f->n_bots = n;
+  f->userdata = NULL;
+  for (int i = 0; i < n; i++)
+    {
+      json_t *bot = json_array_get(bots, i);
+      json_t *led = json_object_get(bot, "led");
+      f->id[i] = json_integer_value(json_object_get(bot, "ID"));
+      f->x[i] = json_number_value(json_object_get(bot, "x_position"));
+      f->y[i] = json_number_value(json_object_get(bot, "y_position"));
+      f->direction[i] = json_number_value(json_object_get(bot, "direction"));
+      f->r_led[i] = json_integer_value(json_array_get(led, 0));
+      f->g_led[i] = json_integer_value(json_array_get(led, 1));
+      f->b_led[i] = json_integer_value(json_array_get(led, 2));
+    }
+
+  ktr_frame g = *f;
+  json_t *first = json_array_get(bots, 0);
+  if (!json_object_get(first, "x_position"))
+    g.x = g.y = g.direction = NULL;
+  if (!json_object_get(first, "led"))
+    g.r_led = g.g_led = g.b_led = NULL;
+  return g;
+}
+
+// from: the binary file the states are copied from, if any
+static int open_writer(writer *w, const char *filename, ktr_reader *from)
+{
+  memset(w, 0, sizeof(*w));
+  if (ends_with(filename, ".ktr"))
+    {
+      w->format = FORMAT_BINARY;
+      w->ktr = ktr_create(filename, from ? ktr_userdata_size(from) : 0);
+      if (!w->ktr)
+	fprintf(stderr, "Could not open %s for writing\n", filename);
+      else if (from)
+	ktr_set_userdata_layout(w->ktr, ktr_userdata_layout(from));
+      return w->ktr == NULL;
+    }
+
+  w->format = ends_with(filename, ".json") ? FORMAT_JSON : FORMAT_JSONL;
+  w->f = fopen(filename, "w");
+  if (!w->f)
+    {
+      fprintf(stderr, "Could not open %s for writing\n", filename);
+      return 1;
+    }
+  return 0;
+}
+
+static void write_state(writer *w, json_t *state)
+{
+  if (w->format == FORMAT_BINARY)
+    {
+      ktr_frame f = frame_of_state(w, state);
+      ktr_write(w->ktr, &f);
+      return;
+    }
+  if (w->format == FORMAT_JSON)
+    {
+      fputs(w->n_written ? ",\n" : "[\n", w->f);
+      json_dumpf(state, w->f, JSON_INDENT(2) | JSON_SORT_KEYS);
+    }
+  else
+    {
+      json_dumpf(state, w->f, JSON_COMPACT | JSON_SORT_KEYS);
+      fputc('\n', w->f);
+    }
+  w->n_written++;
+}
+
+static int close_writer(writer *w)
+{
+  if (w->ktr)
+    {
+      free(w->frame.id);
+      free(w->frame.x);
+      free(w->frame.y);
+      free(w->frame.direction);
+      free(w->frame.r_led);
+      free(w->frame.g_led);
+      free(w->frame.b_led);
+      return ktr_close_writer(w->ktr);
+    }
+  if (w->format == FORMAT_JSON)
+    fputs(w->n_written ? "\n]\n" : "[]\n", w->f);
+  return fclose(w->f) != 0;
+}
+
+int main(int argc, char *argv[])
+{
+  reader r;
+  writer w;
+  json_t *state;
+
+  if (argc != 3)
+    {
+      fprintf(stderr, "usage: %s input output\n"
+	      "Converts state files; the output is a JSON array if its name ends in .json,\n"
+	      "a binary trajectory file if it ends in .ktr, and JSON Lines otherwise.\n", argv[0]);
+      return 2;
+    }
+
+  if (open_reader(&r, argv[1])
+      || open_writer(&w, argv[2], r.ktr))
+    return 1;
+
+  if (r.ktr && w.ktr)
+    {
+      // binary to binary: copy the states as they are
+      ktr_frame f;
+      int k;
+      while ((k = ktr_read(r.ktr, &f)) > 0)
+	ktr_write(w.ktr, &f);
+      if (k < 0)
+	{
+	  fprintf(stderr, "Broken binary state file\n");
+	  r.error = 1;
+	}
+    }
+  else
+    while ((state = read_state(&r)) != NULL)
+      {
+	write_state(&w, state);
+	json_decref(state);
+      }
+
+  close_reader(&r);
+  if (close_writer(&w))
+    {
+      fprintf(stderr, "Error writing %s\n", argv[2]);
+      return 1;
+    }
+  return r.error;
+}
@@ -0,0 +1,995 @@
+/* Binary trajectory files, see trajectory.h.
+ *
+ * The writer gathers nothing itself: the frame already holds each column as
+ * one array, which is either written with a single fwrite() into a large
+ * stdio buffer, or encoded in one pass over it.
+ *
+ * Encoded columns hold integers: IDs and LEDs as they are, USERDATA byte by
+ * byte, and positions and directions rounded to multiples of a quantum. In
+ * a keyframe, every KTR_KEYFRAME_INTERVAL chunks or when the number of bots
+ * changes, the values themselves are coded, otherwise their differences to
+ * the previous chunk (KTR_DELTA). Most of these are zero between two states,
+ * so the column is written as runs: the number of zeros, as a varint, then
+ * the nonzero value that ends the run, zigzag coded so small negative
+ * numbers take few bytes as well. Built with KILOMBO_ZSTD, each encoded
+ * column is then compressed with zstd if that makes it smaller.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef KILOMBO_ZSTD
+#include <zstd.h>
+#endif
+
+#include "trajectory.h"
+
+#define KTR_MAGIC "KILOTRAJ"
+#define KTR_VERSION 3  // 2 added the USERDATA fields, 3 the byte order mark
+#define KTR_BYTE_ORDER 0x01020304u  // reads 0x04030201 on a machine of the other order
+#define KTR_CHUNK_MAGIC 0x4b545243u  // "CRTK" on disk
+#define KTR_INDEX_MAGIC 0x4b545249u  // "IRTK"
+#define KTR_TRAILER_MAGIC "KTRINDEX"
+#define KTR_BUFFER_SIZE (1 << 20)
+#define KTR_KEYFRAME_INTERVAL 50
+#define KTR_DEFAULT_PRECISION 0.01  // mm
+
+// column types
+enum {KTR_I32, KTR_F64, KTR_U8, KTR_BYTES};
+
+// how a column's values are stored in a chunk
+enum {KTR_RAW,      // as they are in the frame
+      KTR_VARINT,   // runs of zeros and varints of the values
+      KTR_DELTA,    // ... of the differences to the previous chunk
+      KTR_ABSENT};  // not in this chunk, no data
+#define KTR_ZSTD 0x100      // flag: the encoded column is compressed with zstd
+#define KTR_ENCODING 0xff   // mask of the encoding without the flags
+
+enum {COL_ID, COL_X, COL_Y, COL_DIRECTION, COL_R_LED, COL_G_LED, COL_B_LED,
+      COL_USERDATA, N_COLUMNS};
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t n_columns;
+  uint32_t userdata_size;
+  uint32_t n_fields;
+  uint32_t byte_order;  // KTR_BYTE_ORDER, as the writer stored it
+  uint32_t reserved;
+} ktr_header;
+
+// the size of the header of a file of the given version
+static size_t header_size(uint32_t version)
+{
+  return version >= 3 ? sizeof(ktr_header) : offsetof(ktr_header, byte_order);
+}
+
+typedef struct {
+  char name[16];
+  uint32_t type;
+  uint32_t width;  // bytes per bot
+} ktr_column;
+
+typedef struct {
+  char name[32];
+  uint32_t type;
+  uint32_t offset;
+  uint32_t size;
+  uint32_t reserved;
+} ktr_field_desc;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t ticks;
+  uint32_t n_bots;
+  uint32_t n_columns;
+  uint64_t size;  // bytes of the columns that follow
+} ktr_chunk;
+
+typedef struct {
+  uint32_t encoding;
+  uint32_t reserved;
+  uint64_t size;  // bytes of data that follow, before padding
+} ktr_column_data;
+
+/* The index, after the last chunk: a header, an entry per chunk, and a
+ * trailer at the very end of the file that points back to the header.
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t reserved;
+  uint64_t n_entries;
+} ktr_index_header;
+
+typedef struct {
+  uint32_t ticks;
+  uint32_t key;     // 1 if the chunk can be decoded without the one before
+  uint64_t offset;  // of the chunk, from the start of the file
+} ktr_index_entry;
+
+typedef struct {
+  uint64_t index_offset;
+  char magic[8];
+} ktr_trailer;
+
+static const ktr_column columns[N_COLUMNS] = {
+  {"ID",        KTR_I32, 4},
+  {"x",         KTR_F64, 8},
+  {"y",         KTR_F64, 8},
+  {"direction", KTR_F64, 8},
+  {"r_led",     KTR_U8,  1},
+  {"g_led",     KTR_U8,  1},
+  {"b_led",     KTR_U8,  1},
+  {"userdata",  KTR_BYTES, 0},  // width is the USERDATA size
+};
+
+static const int field_width[] = {1, 1, 2, 2, 4, 4, 8, 8, 4, 8};
+
+int ktr_field_count(const ktr_field *f)
+{
+  return f->size / field_width[f->type];
+}
+
+double ktr_field_value(const ktr_field *f, const uint8_t *userdata, int k)
+{
+  const uint8_t *p = userdata + f->offset + k * field_width[f->type];
+  union {int8_t i8; uint8_t u8; int16_t i16; uint16_t u16; int32_t i32; uint32_t u32;
+    int64_t i64; uint64_t u64; float f; double d;} v;
+
+  memcpy(&v, p, field_width[f->type]);
+  switch (f->type)
+    {
+    case KTR_FIELD_INT8:   return v.i8;
+    case KTR_FIELD_UINT8:  return v.u8;
+    case KTR_FIELD_INT16:  return v.i16;
+    case KTR_FIELD_UINT16: return v.u16;
+    case KTR_FIELD_INT32:  return v.i32;
+    case KTR_FIELD_UINT32: return v.u32;
+    case KTR_FIELD_INT64:  return v.i64;
+    case KTR_FIELD_UINT64: return v.u64;
+    case KTR_FIELD_FLOAT:  return v.f;
+    default:               return v.d;
+    }
+}
+
+static inline uint64_t align8(uint64_t n)
+{
+  return (n + 7) & ~(uint64_t) 7;
+}
+
+// where frame f keeps column c
+static void **column_of(ktr_frame *f, int c)
+{
+  switch (c)
+    {
+    case COL_ID:        return (void **) &f->id;
+    case COL_X:         return (void **) &f->x;
+    case COL_Y:         return (void **) &f->y;
+    case COL_DIRECTION: return (void **) &f->direction;
+    case COL_R_LED:     return (void **) &f->r_led;
+    case COL_G_LED:     return (void **) &f->g_led;
+    case COL_B_LED:     return (void **) &f->b_led;
+    default:            return (void **) &f->userdata;
+    }
+}
+
+// a growing byte buffer
+typedef struct {
+  uint8_t *p;
+  size_t size, capacity;
+} ktr_buffer;
+
+static void buffer_reserve(ktr_buffer *b, size_t n)
+{
+  if (b->size + n <= b->capacity)
+    return;
+  b->capacity = 2 * b->capacity > b->size + n ? 2 * b->capacity : b->size + n;
+  b->p = (uint8_t *) realloc(b->p, b->capacity);
+}
+
+static inline void put_varint(ktr_buffer *b, uint64_t x)
+{
+  while (x >= 0x80)
+    {
+      b->p[b->size++] = (uint8_t) x | 0x80;
+      x >>= 7;
+    }
+  b->p[b->size++] = (uint8_t) x;
+}
+
+// 0 if the varint runs past end
+static inline int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *x)
+{
+  int shift;
+
+  *x = 0;
+  for (shift = 0; *p < end && shift < 64; shift += 7)
+    {
+      uint8_t c = *(*p)++;
+      *x |= (uint64_t) (c & 0x7f) << shift;
+      if (!(c & 0x80))
+	return 1;
+    }
+  return 0;
+}
+
+static inline uint64_t zigzag(int64_t v)
+{
+  return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t u)
+{
+  return (int64_t) (u >> 1) ^ -(int64_t) (u & 1);
+}
+
+// values per bot in the encoded column c, of width bytes per bot
+static inline size_t column_elements(int c, uint32_t width)
+{
+  return columns[c].type == KTR_BYTES ? width : 1;
+}
+
+// the value at index i of column c, scale is 1 / quantum for doubles
+static inline int64_t column_value(int type, const void *p, size_t i, double scale)
+{
+  double x;
+
+  switch (type)
+    {
+    case KTR_I32: return ((const int32_t *) p)[i];
+    case KTR_F64:
+      x = ((const double *) p)[i] * scale;
+      return x >= 0 ? (int64_t) (x + 0.5) : -(int64_t) (0.5 - x);
+    default:      return ((const uint8_t *) p)[i];
+    }
+}
+
+static int write_padded(FILE *f, const void *p, uint64_t n)
+{
+  static const char zeros[8];
+  return fwrite(p, 1, n, f) != n || fwrite(zeros, 1, align8(n) - n, f) != align8(n) - n;
+}
+
+/* Writing */
+
+struct ktr_writer {
+  FILE *f;
+  int n_columns;
+  uint32_t width[N_COLUMNS];
+  char *buffer;
+  int error;
+  double precision;           // 0 writes the columns raw
+  int capacity;               // bots prev has room for
+  int prev_n;                 // bots in the last chunk, -1 to start a keyframe
+  unsigned prev_columns;      // the columns in the last chunk
+  uint32_t n_chunks;
+  int64_t *prev[N_COLUMNS];   // the last chunk's values, as encoded
+  uint64_t offset;            // of the next chunk, 0 until the header is written
+  int userdata_size;
+  ktr_field_desc *fields;     // the layout of USERDATA ...
+  int n_fields;               // ... if set
+  ktr_index_entry *index;     // of the chunks written, capacity n_chunks rounded up
+  ktr_buffer out[N_COLUMNS];  // the encoded columns of this chunk
+#ifdef KILOMBO_ZSTD
+  ZSTD_CCtx *zstd;
+  ktr_buffer packed[N_COLUMNS];  // ... and compressed
+#endif
+};
+
+ktr_writer *ktr_create(const char *filename, int userdata_size)
+{
+  ktr_writer *w = (ktr_writer *) calloc(1, sizeof(ktr_writer));
+  int c;
+
+  w->f = fopen(filename, "wb");
+  if (!w->f)
+    {
+      free(w);
+      return NULL;
+    }
+  w->buffer = (char *) malloc(KTR_BUFFER_SIZE);
+  setvbuf(w->f, w->buffer, _IOFBF, KTR_BUFFER_SIZE);
+  w->precision = KTR_DEFAULT_PRECISION;
+  w->prev_n = -1;
+  w->userdata_size = userdata_size;
+#ifdef KILOMBO_ZSTD
+  w->zstd = ZSTD_createCCtx();
+#endif
+
+  w->n_columns = userdata_size > 0 ? N_COLUMNS : COL_USERDATA;
+  for (c = 0; c < w->n_columns; c++)
+    w->width[c] = c == COL_USERDATA ? userdata_size : columns[c].width;
+  return w;
+}
+
+// the header is written with the first state, after the layout is known
+static void write_header(ktr_writer *w)
+{
+  ktr_header h = {KTR_MAGIC, KTR_VERSION, w->n_columns, w->userdata_size, w->n_fields,
+		  KTR_BYTE_ORDER, 0};
+  int c;
+
+  w->error |= write_padded(w->f, &h, sizeof(h));
+  for (c = 0; c < w->n_columns; c++)
+    {
+      ktr_column col = columns[c];
+      col.width = w->width[c];
+      w->error |= write_padded(w->f, &col, sizeof(col));
+    }
+  w->error |= write_padded(w->f, w->fields, sizeof(ktr_field_desc) * w->n_fields);
+  w->offset = align8(sizeof(h)) + w->n_columns * align8(sizeof(ktr_column))
+    + w->n_fields * sizeof(ktr_field_desc);
+}
+
+void ktr_set_userdata_layout(ktr_writer *w, const ktr_field *fields)
+{
+  int i;
+
+  if (w->offset || !fields || w->n_columns <= COL_USERDATA)
+    return;
+  for (w->n_fields = 0; fields[w->n_fields].name; w->n_fields++)
+    ;
+  w->fields = (ktr_field_desc *) calloc(w->n_fields, sizeof(ktr_field_desc));
+  for (i = 0; i < w->n_fields; i++)
+    {
+      strncpy(w->fields[i].name, fields[i].name, sizeof(w->fields[i].name) - 1);
+      w->fields[i].type = fields[i].type;
+      w->fields[i].offset = fields[i].offset;
+      w->fields[i].size = fields[i].size;
+    }
+}
+
+void ktr_set_precision(ktr_writer *w, double precision)
+{
+  w->precision = precision;
+  w->prev_n = -1;
+}
+
+// the quantum of the values of column c
+static double column_quantum(ktr_writer *w, int c)
+{
+  if (columns[c].type != KTR_F64)
+    return 1;
+  return c == COL_DIRECTION ? w->precision / 100 : w->precision;
+}
+
+/* Encode the n values at p of column c into w->out[c], against the last
+ * chunk's unless key.
+ */
+static void encode_column(ktr_writer *w, int c, const void *p, size_t n, int key)
+{
+  ktr_buffer *b = &w->out[c];
+  int type = columns[c].type;
+  double quantum = column_quantum(w, c), scale = 1 / quantum;
+  int64_t *prev = w->prev[c];
+  uint64_t run = 0;
+  size_t i;
+
+  b->size = 0;
+  if (type == KTR_F64)
+    {
+      buffer_reserve(b, sizeof(quantum));
+      memcpy(b->p, &quantum, sizeof(quantum));
+      b->size = sizeof(quantum);
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      int64_t v = column_value(type, p, i, scale);
+      int64_t d = key ? v : (int64_t) ((uint64_t) v - (uint64_t) prev[i]);
+      prev[i] = v;
+      if (d == 0)
+	{
+	  run++;
+	  continue;
+	}
+      buffer_reserve(b, 20);
+      put_varint(b, run);
+      put_varint(b, zigzag(d));
+      run = 0;
+    }
+  if (run)
+    {
+      buffer_reserve(b, 10);
+      put_varint(b, run);
+    }
+}
+
+// append state f, 0 on success
+int ktr_write(ktr_writer *w, const ktr_frame *f)
+{
+  ktr_chunk chunk = {KTR_CHUNK_MAGIC, f->ticks, f->n_bots, w->n_columns, 0};
+  ktr_column_data d[N_COLUMNS];
+  const void *data[N_COLUMNS];
+  int key = w->prev_n != f->n_bots || w->n_chunks % KTR_KEYFRAME_INTERVAL == 0;
+  unsigned present = 0;
+  int c, deltas = 0;
+
+  if (!w->offset)
+    write_header(w);
+
+  if (w->precision > 0 && f->n_bots > w->capacity)
+    {
+      w->capacity = f->n_bots;
+      for (c = 0; c < w->n_columns; c++)
+	{
+	  free(w->prev[c]);
+	  w->prev[c] = (int64_t *) malloc(sizeof(int64_t) * f->n_bots
+					  * column_elements(c, w->width[c]));
+	}
+    }
+
+  for (c = 0; c < w->n_columns; c++)
+    {
+      const void *p = *column_of((ktr_frame *) f, c);
+      d[c].reserved = 0;
+      if (!p)
+	{
+	  d[c].encoding = KTR_ABSENT;
+	  d[c].size = 0;
+	  data[c] = NULL;
+	}
+      else if (w->precision <= 0)
+	{
+	  d[c].encoding = KTR_RAW;
+	  d[c].size = (uint64_t) w->width[c] * f->n_bots;
+	  data[c] = p;
+	}
+      else
+	{
+	  // a column missing from the last chunk starts again from its values
+	  int delta = !key && (w->prev_columns & 1u << c);
+	  encode_column(w, c, p, (size_t) f->n_bots * column_elements(c, w->width[c]), !delta);
+	  d[c].encoding = delta ? KTR_DELTA : KTR_VARINT;
+	  deltas |= delta;
+	  d[c].size = w->out[c].size;
+	  data[c] = w->out[c].p;
+#ifdef KILOMBO_ZSTD
+	  ktr_buffer *z = &w->packed[c];
+	  size_t bound = ZSTD_compressBound(d[c].size), size;
+	  z->size = 0;
+	  buffer_reserve(z, bound);
+	  size = ZSTD_compressCCtx(w->zstd, z->p, bound, data[c], d[c].size, 1);
+	  if (!ZSTD_isError(size) && size < d[c].size)
+	    {
+	      d[c].encoding |= KTR_ZSTD;
+	      d[c].size = size;
+	      data[c] = z->p;
+	    }
+#endif
+	}
+      chunk.size += sizeof(ktr_column_data) + align8(d[c].size);
+      if (p)
+	present |= 1u << c;
+    }
+
+  if ((w->n_chunks & (w->n_chunks - 1)) == 0)
+    w->index = (ktr_index_entry *) realloc(w->index, sizeof(ktr_index_entry)
+					   * (w->n_chunks ? 2 * w->n_chunks : 1));
+  w->index[w->n_chunks].ticks = f->ticks;
+  w->index[w->n_chunks].key = !deltas;
+  w->index[w->n_chunks].offset = w->offset;
+  w->offset += align8(sizeof(chunk)) + chunk.size;
+
+  w->error |= write_padded(w->f, &chunk, sizeof(chunk));
+  for (c = 0; c < w->n_columns; c++)
+    {
+      w->error |= write_padded(w->f, &d[c], sizeof(d[c]));
+      w->error |= write_padded(w->f, data[c], d[c].size);
+    }
+  w->prev_n = f->n_bots;
+  w->prev_columns = present;
+  w->n_chunks++;
+  return w->error;
+}
+
+// write the index and finish the file, 0 if all was written
+int ktr_close_writer(ktr_writer *w)
+{
+  ktr_index_header h = {KTR_INDEX_MAGIC, 0, w->n_chunks};
+  ktr_trailer t;
+  int error;
+
+  if (!w->offset)
+    write_header(w);
+  t.index_offset = w->offset;
+  memcpy(t.magic, KTR_TRAILER_MAGIC, 8);
+  w->error |= write_padded(w->f, &h, sizeof(h));
+  w->error |= write_padded(w->f, w->index, sizeof(ktr_index_entry) * w->n_chunks);
+  w->error |= write_padded(w->f, &t, sizeof(t));
+  error = w->error | (fclose(w->f) != 0);
+  free(w->index);
+  free(w->fields);
+  for (int c = 0; c < N_COLUMNS; c++)
+    {
+      free(w->prev[c]);
+      free(w->out[c].p);
+#ifdef KILOMBO_ZSTD
+      free(w->packed[c].p);
+#endif
+    }
+#ifdef KILOMBO_ZSTD
+  ZSTD_freeCCtx(w->zstd);
+#endif
+  free(w->buffer);
+  free(w);
+  return error;
+}
+
+/* Reading
+ *
+ * The reader maps the file into memory and finds the chunks from the index,
+ * or, if the file has none because it was not closed, by walking from one
+ * chunk to the next. A state is decoded from the last keyframe before it,
+ * or from the state read before if that is closer.
+ */
+
+struct ktr_reader {
+  const uint8_t *map;
+  size_t map_size;
+  int n_columns;
+  const ktr_column *cols;  // in the map
+  int *known;      // for each column in the file, COL_..., or -1 if unknown
+  int userdata_size;
+  ktr_field *fields;         // the layout of USERDATA, NULL if not stored
+  char (*field_names)[33];
+  int capacity;    // bots the columns below have room for
+  ktr_frame frame;
+  int64_t *prev[N_COLUMNS];  // the current state's encoded values
+  long current;              // the state in frame and prev, -1 if none
+  unsigned current_mask;     // ... its columns that were decoded
+  unsigned absent;           // ... and those it does not have
+  long next;                 // the state ktr_read() returns
+  const ktr_index_entry *index;  // of the chunks, in the map or index_copy
+  ktr_index_entry *index_copy;   // for files without an index
+  long n_states;
+  int broken;      // 1 if the chunks end in something else than the index
+#ifdef KILOMBO_ZSTD
+  ZSTD_DCtx *zstd;
+  ktr_buffer unpacked;
+#endif
+};
+
+#define ALL_COLUMNS ((1u << N_COLUMNS) - 1)
+
+// 1 if the chunk at offset has no column that refers to the one before
+static int chunk_is_key(const ktr_reader *r, uint64_t offset)
+{
+  const ktr_chunk *chunk = (const ktr_chunk *) (r->map + offset);
+  uint64_t p = offset + sizeof(ktr_chunk), end = p + chunk->size;
+  int c;
+
+  for (c = 0; c < r->n_columns && p + sizeof(ktr_column_data) <= end; c++)
+    {
+      const ktr_column_data *d = (const ktr_column_data *) (r->map + p);
+      if ((d->encoding & KTR_ENCODING) == KTR_DELTA)
+	return 0;
+      p += sizeof(ktr_column_data) + align8(d->size);
+    }
+  return 1;
+}
+
+// use the index at the end of the file, 0 if there is none
+static int map_index(ktr_reader *r)
+{
+  const ktr_trailer *t;
+  const ktr_index_header *h;
+
+  if (r->map_size < header_size(1) + sizeof(ktr_index_header) + sizeof(ktr_trailer))
+    return 0;
+  t = (const ktr_trailer *) (r->map + r->map_size - sizeof(ktr_trailer));
+  if (memcmp(t->magic, KTR_TRAILER_MAGIC, 8) || t->index_offset % 8
+      || t->index_offset > r->map_size - sizeof(ktr_trailer) - sizeof(ktr_index_header))
+    return 0;
+  h = (const ktr_index_header *) (r->map + t->index_offset);
+  if (h->magic != KTR_INDEX_MAGIC || h->n_entries > r->map_size / sizeof(ktr_index_entry)
+      || t->index_offset + sizeof(ktr_index_header)
+      + h->n_entries * sizeof(ktr_index_entry) + sizeof(ktr_trailer) != r->map_size)
+    return 0;
+  r->index = (const ktr_index_entry *) (h + 1);
+  r->n_states = h->n_entries;
+  return 1;
+}
+
+// index the chunks from offset on, up to one that is cut short
+static void scan_index(ktr_reader *r, uint64_t offset)
+{
+  long capacity = 0;
+
+  while (offset + sizeof(ktr_chunk) <= r->map_size)
+    {
+      const ktr_chunk *chunk = (const ktr_chunk *) (r->map + offset);
+      if (chunk->magic != KTR_CHUNK_MAGIC)
+	{
+	  r->broken = chunk->magic != KTR_INDEX_MAGIC;
+	  break;
+	}
+      if (chunk->size > r->map_size - offset - sizeof(ktr_chunk))
+	break;
+      if (r->n_states == capacity)
+	{
+	  capacity = capacity ? 2 * capacity : 64;
+	  r->index_copy = (ktr_index_entry *) realloc(r->index_copy, sizeof(ktr_index_entry) * capacity);
+	}
+      r->index_copy[r->n_states].ticks = chunk->ticks;
+      r->index_copy[r->n_states].key = chunk_is_key(r, offset);
+      r->index_copy[r->n_states].offset = offset;
+      r->n_states++;
+      offset += sizeof(ktr_chunk) + chunk->size;
+    }
+  r->index = r->index_copy;
+}
+
+ktr_reader *ktr_open(const char *filename)
+{
+  const ktr_header *h;
+  struct stat st;
+  void *map;
+  uint64_t offset;
+  int c, k;
+  int fd = open(filename, O_RDONLY);
+
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) || (size_t) st.st_size < header_size(1))
+    {
+      close(fd);
+      return NULL;
+    }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  /* Numbers are stored in the byte order of the writer, so a file written
+   * on a machine of the other order has a version far out of range.
+   */
+  h = (const ktr_header *) map;
+  offset = header_size(h->version) + (uint64_t) h->n_columns * sizeof(ktr_column)
+    + (uint64_t) h->n_fields * sizeof(ktr_field_desc);
+  if (memcmp(h->magic, KTR_MAGIC, 8) || h->version < 1 || h->version > KTR_VERSION
+      || offset > (uint64_t) st.st_size
+      || (h->version >= 3 && h->byte_order != KTR_BYTE_ORDER))
+    {
+      munmap(map, st.st_size);
+      return NULL;
+    }
+
+  ktr_reader *r = (ktr_reader *) calloc(1, sizeof(ktr_reader));
+  r->map = (const uint8_t *) map;
+  r->map_size = st.st_size;
+  r->n_columns = h->n_columns;
+  r->userdata_size = h->userdata_size;
+  r->cols = (const ktr_column *) ((const uint8_t *) map + header_size(h->version));
+  r->known = (int *) malloc(sizeof(int) * h->n_columns);
+  r->current = -1;
+#ifdef KILOMBO_ZSTD
+  r->zstd = ZSTD_createDCtx();
+#endif
+  for (c = 0; c < r->n_columns; c++)
+    {
+      r->known[c] = -1;
+      for (k = 0; k < N_COLUMNS; k++)
+	if (strncmp(r->cols[c].name, columns[k].name, sizeof(columns[k].name)) == 0
+	    && r->cols[c].type == columns[k].type)
+	  r->known[c] = k;
+    }
+
+  if (h->n_fields)
+    {
+      const ktr_field_desc *d = (const ktr_field_desc *) (r->cols + r->n_columns);
+      r->fields = (ktr_field *) calloc(h->n_fields + 1, sizeof(ktr_field));
+      r->field_names = (char (*)[33]) calloc(h->n_fields, sizeof(r->field_names[0]));
+      for (c = 0; c < (int) h->n_fields; c++)
+	{
+	  memcpy(r->field_names[c], d[c].name, sizeof(d[c].name));
+	  r->fields[c].name = r->field_names[c];
+	  r->fields[c].type = d[c].type;
+	  r->fields[c].offset = d[c].offset;
+	  r->fields[c].size = d[c].size;
+	  // fields outside the USERDATA, or of unknown types, are left empty
+	  if (d[c].type > KTR_FIELD_DOUBLE || d[c].offset > (uint32_t) r->userdata_size
+	      || d[c].size > (uint32_t) r->userdata_size - d[c].offset)
+	    {
+	      r->fields[c].type = KTR_FIELD_UINT8;
+	      r->fields[c].size = 0;
+	    }
+	}
+    }
+
+  if (!map_index(r))
+    scan_index(r, offset);
+  return r;
+}
+
+int ktr_userdata_size(const ktr_reader *r)
+{
+  return r->userdata_size;
+}
+
+const ktr_field *ktr_userdata_layout(const ktr_reader *r)
+{
+  return r->fields;
+}
+
+long ktr_states(const ktr_reader *r)
+{
+  return r->n_states;
+}
+
+uint32_t ktr_ticks(const ktr_reader *r, long i)
+{
+  return r->index[i].ticks;
+}
+
+// the first state at or after ticks, ktr_states() if there is none
+long ktr_find(const ktr_reader *r, uint32_t ticks)
+{
+  long lo = 0, hi = r->n_states;
+
+  while (lo < hi)
+    {
+      long mid = lo + (hi - lo) / 2;
+      if (r->index[mid].ticks < ticks)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  return lo;
+}
+
+static void reserve(ktr_reader *r, int n_bots)
+{
+  int c;
+
+  if (n_bots <= r->capacity)
+    return;
+  r->capacity = n_bots;
+  r->current = -1;
+  for (c = 0; c < N_COLUMNS; c++)
+    {
+      void **p = column_of(&r->frame, c);
+      size_t width = c == COL_USERDATA ? r->userdata_size : columns[c].width;
+      free(*p);
+      *p = width ? calloc(n_bots, width) : NULL;
+      free(r->prev[c]);
+      r->prev[c] = width ? (int64_t *) malloc(sizeof(int64_t) * n_bots * column_elements(c, width)) : NULL;
+    }
+}
+
+static int decode_column(ktr_reader *r, int k, const uint8_t *p, size_t size,
+			 uint32_t encoding, int n_bots)
+{
+  const uint8_t *end = p + size;
+  int type = columns[k].type;
+  size_t width = k == COL_USERDATA ? r->userdata_size : columns[k].width;
+  size_t n = n_bots * column_elements(k, width), i = 0;
+  int key = (encoding & KTR_ENCODING) == KTR_VARINT;
+  void *out = *column_of(&r->frame, k);
+  int64_t *prev = r->prev[k];
+  double quantum = 1;
+
+  if (encoding & KTR_ZSTD)
+    {
+#ifdef KILOMBO_ZSTD
+      unsigned long long m = ZSTD_getFrameContentSize(p, size);
+      if (m == ZSTD_CONTENTSIZE_ERROR || m == ZSTD_CONTENTSIZE_UNKNOWN)
+	return 0;
+      r->unpacked.size = 0;
+      buffer_reserve(&r->unpacked, m);
+      size = ZSTD_decompressDCtx(r->zstd, r->unpacked.p, m, p, size);
+      if (ZSTD_isError(size))
+	return 0;
+      p = r->unpacked.p;
+      end = p + size;
+#else
+      fprintf(stderr, "The state file is compressed with zstd, build kilombo with USE_ZSTD to read it.\n");
+      return 0;
+#endif
+    }
+
+  if (type == KTR_F64)
+    {
+      if (size < sizeof(quantum))
+	return 0;
+      memcpy(&quantum, p, sizeof(quantum));
+      p += sizeof(quantum);
+    }
+
+  while (i < n)
+    {
+      uint64_t run, u;
+      if (!get_varint(&p, end, &run) || run > n - i)
+	return 0;
+      if (key)
+	memset(prev + i, 0, sizeof(int64_t) * run);
+      i += run;
+      if (i == n)
+	break;
+      if (!get_varint(&p, end, &u))
+	return 0;
+      prev[i] = key ? unzigzag(u) : (int64_t) ((uint64_t) prev[i] + (uint64_t) unzigzag(u));
+      i++;
+    }
+
+  for (i = 0; i < n; i++)
+    switch (type)
+      {
+      case KTR_I32: ((int32_t *) out)[i] = (int32_t) prev[i]; break;
+      case KTR_F64: ((double *) out)[i] = prev[i] * quantum; break;
+      default:      ((uint8_t *) out)[i] = (uint8_t) prev[i]; break;
+      }
+  return 1;
+}
+
+/* Decode the columns in mask of chunk i, which must be a keyframe or the
+ * chunk after the current one. 1 on success.
+ */
+static int decode_chunk(ktr_reader *r, long i, unsigned mask)
+{
+  uint64_t offset = r->index[i].offset;
+  const ktr_chunk *chunk = (const ktr_chunk *) (r->map + offset);
+  const uint8_t *p, *end;
+  unsigned known, absent = 0;
+  int c, k;
+
+  if (offset % 8 || offset > r->map_size - sizeof(ktr_chunk)
+      || chunk->magic != KTR_CHUNK_MAGIC || chunk->n_columns != (uint32_t) r->n_columns
+      || chunk->size > r->map_size - offset - sizeof(ktr_chunk))
+    return 0;
+  p = r->map + offset + sizeof(ktr_chunk);
+  end = p + chunk->size;
+  // the columns that the delta coded ones may refer to
+  known = r->current == i - 1 && r->frame.n_bots == (int) chunk->n_bots ? r->current_mask : 0;
+
+  reserve(r, chunk->n_bots);
+
+  for (c = 0; c < r->n_columns; c++)
+    {
+      const ktr_column_data *d = (const ktr_column_data *) p;
+      const uint8_t *data = p + sizeof(ktr_column_data);
+      if (end - p < (ptrdiff_t) sizeof(ktr_column_data) || (uint64_t) (end - data) < d->size)
+	return 0;
+      p = data + align8(d->size);
+      k = r->known[c];
+      if (k < 0 || !(mask & 1u << k) || !*column_of(&r->frame, k))
+	continue;
+
+      if (d->encoding == KTR_ABSENT)
+	absent |= 1u << k;
+      else if (d->encoding == KTR_RAW)
+	{
+	  if (d->size != (uint64_t) r->cols[c].width * chunk->n_bots)
+	    return 0;
+	  memcpy(*column_of(&r->frame, k), data, d->size);
+	}
+      else
+	{
+	  uint32_t e = d->encoding & KTR_ENCODING;
+	  if ((e != KTR_VARINT && e != KTR_DELTA) || (e == KTR_DELTA && !(known & 1u << k)))
+	    return 0;
+	  if (!decode_column(r, k, data, d->size, d->encoding, chunk->n_bots))
+	    return 0;
+	}
+    }
+
+  r->frame.ticks = chunk->ticks;
+  r->frame.n_bots = chunk->n_bots;
+  r->current = i;
+  r->current_mask = mask & ~absent;
+  r->absent = absent;
+  return 1;
+}
+
+// decode the columns in mask of state i: 1 if done, 0 past the end, -1 on error
+static int decode_state(ktr_reader *r, long i, unsigned mask)
+{
+  long k;
+
+  if (i < 0 || i >= r->n_states)
+    return r->broken && i == r->n_states ? -1 : 0;
+  if (r->current == i && ((r->current_mask | r->absent) & mask) == mask)
+    return 1;
+
+  for (k = i; k > 0 && !r->index[k].key; k--)
+    ;
+  if (r->current >= k && r->current < i && ((r->current_mask | r->absent) & mask) == mask)
+    k = r->current + 1;
+  for (; k <= i; k++)
+    if (!decode_chunk(r, k, mask))
+      {
+	r->current = -1;
+	return -1;
+      }
+  return 1;
+}
+
+int ktr_read(ktr_reader *r, ktr_frame *f)
+{
+  int k = decode_state(r, r->next, ALL_COLUMNS);
+
+  if (k > 0)
+    {
+      r->next++;
+      *f = r->frame;
+      for (int c = 0; c < N_COLUMNS; c++)
+	if (r->absent & 1u << c)
+	  *column_of(f, c) = NULL;
+    }
+  return k;
+}
+
+int ktr_read_at(ktr_reader *r, long i, ktr_frame *f)
+{
+  r->next = i;
+  return ktr_read(r, f);
+}
+
+long ktr_track(ktr_reader *r, int32_t id, long from, long to, ktr_point *track)
+{
+  const unsigned mask = 1u << COL_ID | 1u << COL_X | 1u << COL_Y | 1u << COL_DIRECTION;
+  long i, n = 0;
+  int j = 0, k;
+
+  for (i = from < 0 ? 0 : from; i < to && i < r->n_states; i++)
+    {
+      if ((k = decode_state(r, i, mask)) < 0)
+	return -1;
+      const ktr_frame *f = &r->frame;
+      if (r->absent & mask)
+	continue;
+      // the bots rarely change places
+      if (j >= f->n_bots || f->id[j] != id)
+	for (j = 0; j < f->n_bots && f->id[j] != id; j++)
+	  ;
+      if (j == f->n_bots)
+	continue;
+      track[n].ticks = f->ticks;
+      track[n].x = f->x[j];
+      track[n].y = f->y[j];
+      track[n].direction = f->direction[j];
+      n++;
+    }
+  return n;
+}
+
+void ktr_close(ktr_reader *r)
+{
+  for (int c = 0; c < N_COLUMNS; c++)
+    {
+      free(*column_of(&r->frame, c));
+      free(r->prev[c]);
+    }
+#ifdef KILOMBO_ZSTD
+  free(r->unpacked.p);
+  ZSTD_freeDCtx(r->zstd);
+#endif
+  munmap((void *) r->map, r->map_size);
+  free(r->index_copy);
+  free(r->fields);
+  free(r->field_names);
+  free(r->known);
+  free(r);
+}
+
+// 1 if filename starts like a trajectory file
+int is_trajectory(const char *filename)
+{
+  char magic[8];
+  FILE *f = fopen(filename, "rb");
+  int r;
+
+  if (!f)
+    return 0;
+  r = fread(magic, 1, 8, f) == 8 && memcmp(magic, KTR_MAGIC, 8) == 0;
+  fclose(f);
+  return r;
+}
@@ -0,0 +1,114 @@
+/* Binary trajectory files.
+ *
+ * A compact, column oriented alternative to the JSON state file, written by
+ * the simulator with stateFileFormat = "binary" and read back with the
+ * functions here, which do not depend on the rest of the simulator. A file
+ * is a header, listing the columns, followed by one chunk per state:
+ *
+ *   header   "KILOTRAJ", version, number of columns, USERDATA size, number
+ *            of USERDATA fields, a byte order mark, per column its name,
+ *            type and width in bytes per bot, and per field its name, type,
+ *            offset and size
+ *   chunk    ticks, number of bots, size, then for each column its encoding,
+ *            its size, and the values of all bots one after another
+ *   index    when the file is closed: per chunk its ticks, whether it is a
+ *            keyframe, and its offset in the file, then the offset of the
+ *            index itself in the last 16 bytes
+ *
+ * Numbers are stored in the byte order of the machine that wrote the file,
+ * which the mark in the header tells; the reader rejects files of the other
+ * order. Every part starts at a multiple of 8 bytes. The columns are ID
+ * (int32), x, y and direction (double), r_led, g_led and b_led (uint8), and
+ * optionally the bots' raw USERDATA.
+ *
+ * Unless the precision is set to 0, the values are not stored as they are
+ * but encoded: positions rounded to multiples of the precision, in mm, and
+ * directions to multiples of a hundredth of it, in radians, then coded as
+ * differences to the previous state, with runs of unchanged values taking
+ * a byte or so. trajectory.c describes the encoding.
+ *
+ * The reader maps the file into memory, and can jump to any state through
+ * the index, decoding it from the keyframe before it, at most 50 states
+ * back. Files that were not closed have no index; the reader then finds
+ * the states by skipping from one to the next. A reader must only be used
+ * by one thread at a time, but any number of them may read the same file.
+ */
+
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include <stdint.h>
+
+// one state of the swarm, the values of bot i at index i of each column
+typedef struct {
+  uint32_t ticks;
+  int n_bots;
+  int32_t *id;
+  double *x, *y, *direction;
+  uint8_t *r_led, *g_led, *b_led;
+  uint8_t *userdata;  // n_bots * userdata_size bytes, NULL if not stored
+} ktr_frame;
+
+// a bot's position in one state
+typedef struct {
+  uint32_t ticks;
+  double x, y, direction;
+} ktr_point;
+
+/* A field of the USERDATA structure, for decoding the raw USERDATA. Bot
+ * programs describe their USERDATA with USERDATA_LAYOUT, see kilombo.h.
+ */
+enum {KTR_FIELD_INT8, KTR_FIELD_UINT8, KTR_FIELD_INT16, KTR_FIELD_UINT16,
+      KTR_FIELD_INT32, KTR_FIELD_UINT32, KTR_FIELD_INT64, KTR_FIELD_UINT64,
+      KTR_FIELD_FLOAT, KTR_FIELD_DOUBLE};
+
+typedef struct {
+  const char *name;  // NULL ends a list of fields
+  int type;          // KTR_FIELD_...
+  uint32_t offset;   // in bytes from the start of USERDATA
+  uint32_t size;     // in bytes, a multiple of the type's for arrays
+} ktr_field;
+
+// the number of values in field f, and value k of them in a bot's USERDATA
+int ktr_field_count(const ktr_field *f);
+double ktr_field_value(const ktr_field *f, const uint8_t *userdata, int k);
+
+typedef struct ktr_writer ktr_writer;
+typedef struct ktr_reader ktr_reader;
+
+// userdata_size 0 leaves the USERDATA out
+ktr_writer *ktr_create(const char *filename, int userdata_size);
+// precision of the positions stored from the next state on, 0.01 mm unless
+// set, 0 to store all values exactly and uncompressed
+void ktr_set_precision(ktr_writer *w, double precision);
+// store the layout of the USERDATA, a list of fields ending with a NULL
+// name, before the first state is written
+void ktr_set_userdata_layout(ktr_writer *w, const ktr_field *fields);
+// columns that are NULL in f are left out of this state
+int ktr_write(ktr_writer *w, const ktr_frame *f);
+int ktr_close_writer(ktr_writer *w);
+
+ktr_reader *ktr_open(const char *filename);
+int ktr_userdata_size(const ktr_reader *r);
+// the layout of the USERDATA, ending with a NULL name, or NULL if not stored
+const ktr_field *ktr_userdata_layout(const ktr_reader *r);
+// the next state: 1 if read, 0 at the end, -1 on error. The columns belong
+// to the reader and stay valid until the next call; those not stored in
+// this state are NULL.
+int ktr_read(ktr_reader *r, ktr_frame *f);
+// the number of states, state i is at ticks ktr_ticks(r, i)
+long ktr_states(const ktr_reader *r);
+uint32_t ktr_ticks(const ktr_reader *r, long i);
+// the first state at or after ticks, ktr_states() if there is none
+long ktr_find(const ktr_reader *r, uint32_t ticks);
+// state i, as ktr_read(); ktr_read() then continues with state i + 1
+int ktr_read_at(ktr_reader *r, long i, ktr_frame *f);
+// the track of bot id in states from to to - 1, into track, which has room
+// for to - from points: the number of states with the bot and its
+// position, -1 on error
+long ktr_track(ktr_reader *r, int32_t id, long from, long to, ktr_point *track);
+void ktr_close(ktr_reader *r);
+
+int is_trajectory(const char *filename);
+
+#endif